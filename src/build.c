@@ -84,9 +84,9 @@ ex:
  * operation, where FSVS commands are not so tightly packed, it is normally 
  * preferable to use the \ref o_delay "delay" option.
  * */
-/** Waits until the \c dir and \c Urls files have been modified in the 
- * past, ie their timestamp is lower than the current time (rounded to 
- * seconds.) */
+/** Waits until the \c dir, \c dirlog and \c Urls files have been 
+ * modified in the past, ie their timestamp is lower than the current time 
+ * (rounded to seconds.) */
 int delay__work(struct estat *root, int argc, char *argv[])
 {
 	int status;
@@ -94,7 +94,7 @@ int delay__work(struct estat *root, int argc, char *argv[])
 	time_t last;
 	struct sstat_t st;
 	char *filename, *eos;
-	char *list[]= { WAA__DIR_EXT, WAA__URLLIST_EXT };
+	char *list[]= { WAA__DIR_EXT, WAA__DIR_JOURNAL_EXT, WAA__URLLIST_EXT };
 
 
 	STOPIF( waa__find_base(root, &argc, &argv), NULL);
@@ -0,0 +1,274 @@
+/************************************************************************
+ * Copyright (C) 2026 Philipp Marek.
+ *
+ * This program is free software;  you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ ************************************************************************/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "cdc.h"
+
+
+/** \file
+ * Content defined chunking.
+ *
+ * The functions that find the block borders for the \ref md5s files; the
+ * MD5s and the rest are done in checksum.c. See \ref md5s_gear. */
+
+
+/** The bits of the gear hash that must be zero for a border.
+ * The upper bits are used, as they depend on all 64 bytes of the window;
+ * after the normal block size one bit less, so that the blocks don't get
+ * much bigger than that. (With the minimum size the average is about the
+ * same as with the manber hash.) @{ */
+#define CDC___MASK_SMALL (~0ULL << (64 - CS__APPROX_BLOCKSIZE_BITS))
+#define CDC___MASK_LARGE (~0ULL << (64 - (CS__APPROX_BLOCKSIZE_BITS-1)))
+/** @} */
+/** Only the last this many bytes go into the gear hash. */
+#define CDC___GEAR_WINDOW (64)
+/** The seed for the gear table; changing it makes all \ref md5s files
+ * with the gear hash invalid. */
+#define CDC___GEAR_SEED (0x6673767367656172ULL)
+
+#if CS__GEAR_MIN_SIZE < CDC___GEAR_WINDOW
+#error CS__GEAR_MIN_SIZE must be at least the gear window
+#endif
+
+
+/** The precalculated tables. */
+static struct {
+	/** Manber: the values of the bytes that leave the backtrack window. */
+	uint32_t values[256];
+	/** The same for the 64bit hash. */
+	uint64_t values64[256];
+	/** A random value per byte for the gear hash. */
+	uint64_t gear[256];
+} cdc___tab;
+
+
+/** -. */
+void cdc__init(void)
+{
+	static int initialized=0;
+	int i;
+	uint32_t p;
+	uint64_t p64, x, z;
+
+	/* values[0] is always 0, so we need an extra flag. */
+	if (initialized) return;
+
+	/* Calculate the CS__MANBER_BACKTRACK power of the prime */
+	/* TODO: speedup like done in RSA - log2(power) */
+	for(p=1,p64=1,i=0; i<CS__MANBER_BACKTRACK; i++)
+	{
+		p=(p * CS__MANBER_PRIME) & CS__MANBER_MODULUS;
+		p64 *= CS__MANBER_PRIME64;
+	}
+
+	/* Precalculate for all 8bit values.
+	 * values[0xff] stays 0; changing that now would make all existing \ref
+	 * md5s files invalid. */
+	for(i=0x00; i<0xff; i++)
+		cdc___tab.values[i]=(i*p) & CS__MANBER_MODULUS;
+	/* The 64bit values are new, so they can be complete. */
+	for(i=0x00; i<=0xff; i++)
+		cdc___tab.values64[i]=i*p64;
+
+	/* splitmix64; it's fixed, so the same table is made everywhere. */
+	x=CDC___GEAR_SEED;
+	for(i=0x00; i<=0xff; i++)
+	{
+		x+=0x9e3779b97f4a7c15ULL;
+		z=x;
+		z=(z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z=(z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		cdc___tab.gear[i]=z ^ (z >> 31);
+	}
+
+	initialized=1;
+}
+
+
+/** -. */
+void cdc__manber_reset(struct cdc__manber_t *mnb)
+{
+	mnb->state=0;
+	mnb->last_state=0;
+	mnb->state64=0;
+	mnb->last_state64=0;
+	mnb->bktrk_bytes=0;
+	mnb->bktrk_last=0;
+}
+
+
+/** -. */
+void cdc__gear_reset(struct cdc__gear_t *gear)
+{
+	gear->hash=0;
+	gear->len=0;
+}
+
+
+/** -.
+ * The first \c CS__MANBER_BACKTRACK bytes of a block go into the backtrack
+ * buffer. */
+int cdc__manber_fill(struct cdc__manber_t *mnb,
+		const unsigned char *data, int len, int *bits)
+{
+	int i;
+
+	i=0;
+	while (i<len &&
+			mnb->bktrk_bytes < CS__MANBER_BACKTRACK)
+	{
+		/* In this initialization, we simply \c OR the bytes together.
+		 * On block end detection we see if this is at least a
+		 * \c CS__MANBER_BACKTRACK bytes long zero-byte block. */
+		*bits |= data[i];
+
+		mnb->state = (mnb->state * CS__MANBER_PRIME +
+				data[i] ) % CS__MANBER_MODULUS;
+		mnb->state64 = mnb->state64 * CS__MANBER_PRIME64 + data[i];
+		mnb->backtrack[ mnb->bktrk_last ] = data[i];
+		/* The reason why CS__MANBER_BACKTRACK must be a power of 2:
+		 * bitwise-AND is much faster than a modulo.
+		 * In this loop the & is redundant - in a new block we should
+		 * start from bktrk_last==0, but the AND is only 1 or 2 cycles,
+		 * and we hope that gcc optimizes that. */
+		mnb->bktrk_last = ( mnb->bktrk_last + 1 ) &
+			(CS__MANBER_BACKTRACK - 1);
+		mnb->bktrk_bytes++;
+		i++;
+	}
+
+	return i;
+}
+
+
+/** -. */
+int cdc__manber_roll(struct cdc__manber_t *mnb,
+		const unsigned char *data, int len, int *border)
+{
+	int i;
+
+	*border=0;
+	i=0;
+	while(i<len)
+	{
+		/* ->last_state gets the previous CRC, and this gets stored.
+		 * This is because the ->state has, on a block border, a lot of
+		 * zeroes (per definition); so we store the previous value, which
+		 * may be better suited for comparison. If the blocks are equal
+		 * up to byte N, they're equal up to N-1, too. */
+		mnb->last_state=mnb->state;
+		mnb->last_state64=mnb->state64;
+		mnb->state = (mnb->state*CS__MANBER_PRIME + data[i] -
+				cdc___tab.values[ mnb->backtrack[ mnb->bktrk_last ] ] )
+			% CS__MANBER_MODULUS;
+		mnb->state64 = mnb->state64*CS__MANBER_PRIME64 + data[i] -
+			cdc___tab.values64[ mnb->backtrack[ mnb->bktrk_last ] ];
+		mnb->backtrack[ mnb->bktrk_last ] = data[i];
+		mnb->bktrk_last = ( mnb->bktrk_last + 1 ) &
+			(CS__MANBER_BACKTRACK - 1);
+		/* This value has already been used. */
+		i++;
+
+		/* special value ? */
+		if ( !(mnb->state & CS__MANBER_BITMASK) )
+		{
+			*border=1;
+			break;
+		}
+	}
+
+	return i;
+}
+
+
+/** -.
+ * No border can be in the first \c CS__GEAR_MIN_SIZE bytes of a block,
+ * so only the last \c CDC___GEAR_WINDOW of them have to be hashed; the
+ * others are just \c OR ed, which the compiler can vectorize. */
+int cdc__gear_fill(struct cdc__gear_t *gear,
+		const unsigned char *data, int len, int *bits)
+{
+	int i, n, skip;
+	unsigned char acc;
+	uint64_t hash;
+
+	n=CS__GEAR_MIN_SIZE - gear->len;
+	if (n > len) n=len;
+
+	acc=0;
+	skip=CS__GEAR_MIN_SIZE - CDC___GEAR_WINDOW - gear->len;
+	if (skip > n) skip=n;
+	for(i=0; i<skip; i++)
+		acc |= data[i];
+
+	hash=gear->hash;
+	for(; i<n; i++)
+	{
+		acc |= data[i];
+		hash=(hash << 1) + cdc___tab.gear[data[i]];
+	}
+
+	gear->hash=hash;
+	gear->len+=n;
+	*bits |= acc;
+	return n;
+}
+
+
+/** -.
+ * After the normal block size a border needs one zero bit less; a block
+ * ends in any case at \c CS__GEAR_MAX_SIZE. */
+int cdc__gear_roll(struct cdc__gear_t *gear,
+		const unsigned char *data, int len, int *border)
+{
+	int i, n;
+	uint64_t hash, mask;
+
+	*border=0;
+	hash=gear->hash;
+	i=0;
+	while (i<len)
+	{
+		if (gear->len + i < (1ULL << CS__APPROX_BLOCKSIZE_BITS))
+		{
+			n=(1ULL << CS__APPROX_BLOCKSIZE_BITS) - gear->len;
+			mask=CDC___MASK_SMALL;
+		}
+		else
+		{
+			n=CS__GEAR_MAX_SIZE - gear->len;
+			mask=CDC___MASK_LARGE;
+		}
+		if (n > len) n=len;
+
+		/* The hot loop: one shift, one add, one test per byte. */
+		for(; i<n; i++)
+		{
+			hash=(hash << 1) + cdc___tab.gear[data[i]];
+			if (!(hash & mask))
+			{
+				*border=1;
+				i++;
+				goto ex;
+			}
+		}
+
+		if (gear->len + i >= CS__GEAR_MAX_SIZE)
+		{
+			*border=1;
+			goto ex;
+		}
+	}
+
+ex:
+	gear->hash=hash;
+	gear->len+=i;
+	return i;
+}
@@ -0,0 +1,86 @@
+/************************************************************************
+ * Copyright (C) 2026 Philipp Marek.
+ *
+ * This program is free software;  you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ ************************************************************************/
+
+#ifndef __CDC_H__
+#define __CDC_H__
+
+#include <stdint.h>
+#include "interface.h"
+
+/** \file
+ * Content defined chunking header file.
+ *
+ * This has no dependencies on the rest of FSVS, so that
+ * dev/chunker-bench.c can use it, too. */
+
+
+/** Which function gives the block borders of a \ref md5s file. */
+enum cdc__type_e
+{
+	/** The manber hash, used for the text format of the \ref md5s files. */
+	CDC__MANBER=0,
+	/** The gear hash, see \ref md5s_gear. */
+	CDC__GEAR,
+};
+
+
+/** The state of the manber hash. */
+struct cdc__manber_t
+{
+	/** The internal manber-state. */
+	uint32_t state;
+	/** The previous manber-state.  */
+	uint32_t last_state;
+	/** The 64bit hash, calculated alongside; it is only stored, the block
+	 * borders are given by \c state. */
+	uint64_t state64, last_state64;
+	/** Count of bytes in backtrack buffer. */
+	int bktrk_bytes;
+	/** The last byte in the rotating backtrack-buffer. */
+	int bktrk_last;
+	/** The backtrack buffer. */
+	unsigned char backtrack[CS__MANBER_BACKTRACK];
+};
+
+
+/** The state of the gear hash. */
+struct cdc__gear_t
+{
+	/** The hash; depends only on the last 64 bytes. */
+	uint64_t hash;
+	/** The number of bytes in the current block. */
+	uint64_t len;
+};
+
+
+/** Calculates the tables. */
+void cdc__init(void);
+
+/** Starts a new block. @{ */
+void cdc__manber_reset(struct cdc__manber_t *mnb);
+void cdc__gear_reset(struct cdc__gear_t *gear);
+/** @} */
+
+/** Takes the first bytes of a block, where no border can be; returns
+ * how many bytes were taken, and \c OR s them into \a *bits. @{ */
+int cdc__manber_fill(struct cdc__manber_t *mnb,
+		const unsigned char *data, int len, int *bits);
+int cdc__gear_fill(struct cdc__gear_t *gear,
+		const unsigned char *data, int len, int *bits);
+/** @} */
+
+/** Looks for a border in \a data; returns the number of bytes that
+ * belong to the current block, and sets \a *border if it ends there.
+ * @{ */
+int cdc__manber_roll(struct cdc__manber_t *mnb,
+		const unsigned char *data, int len, int *border);
+int cdc__gear_roll(struct cdc__gear_t *gear,
+		const unsigned char *data, int len, int *border);
+/** @} */
+
+#endif
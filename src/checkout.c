@@ -17,6 +17,7 @@
 #include "helper.h"
 #include "commit.h"
 #include "export.h"
+#include "pristine.h"
 
 
 /** \file
@@ -131,6 +132,7 @@ int co__work(struct estat *root, int argc, char *argv[])
 	delay_start=time(NULL);
 	STOPIF( url__output_list(), NULL);
 	STOPIF( waa__output_tree(root), NULL);
+	STOPIF( pst__write_refs(), NULL);
 	STOPIF( hlp__delay(delay_start, DELAY_CHECKOUT), NULL);
 
 ex:
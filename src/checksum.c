@@ -9,14 +9,25 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
 #include <apr_md5.h>
+#include <apr_strings.h>
 #include <sys/mman.h>
 
 #include "checksum.h"
 #include "helper.h"
 #include "global.h"
 #include "est_ops.h"
+#include "options.h"
+#include "prefetch.h"
 #include "waa.h"
+#include "md5mb.h"
+#include "cdc.h"
 
 
 /** \file
@@ -24,14 +35,202 @@
 
 #define MAPSIZE (32*1024*1024)
 
+/** How many zero bytes are given at once for a hole; see 
+ * cs___next_run(). */
+#define CS___ZEROS (256*1024)
+/** The zeroes for holes. */
+static const unsigned char cs___zeros[CS___ZEROS];
+
+/** How many bytes are read at once, if the file isn't mapped; see \ref 
+ * o_hash_read. */
+#define CS___READSIZE (4*1024*1024)
+/** The alignment needed for \c O_DIRECT. */
+#define CS___ALIGN (4096)
+
+/** The numbers for \ref o_hash_stats. */
+static struct {
+	unsigned files, links;
+	t_ull read, holes;
+} cs___stats;
+static pthread_mutex_t cs___stats_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+
+/** \name Fast hash
+ * XXH64, for a quick local check whether a file changed; see \ref 
+ * o_change_hash.
+ * The value is only compared with values stored on the same machine, so 
+ * the data is read in native byte order; on little-endian machines that's 
+ * the reference XXH64.
+ * @{ */
+#define CS___XXH_P1 (0x9E3779B185EBCA87ULL)
+#define CS___XXH_P2 (0xC2B2AE3D27D4EB4FULL)
+#define CS___XXH_P3 (0x165667B19E3779F9ULL)
+#define CS___XXH_P4 (0x85EBCA77C2B2AE63ULL)
+#define CS___XXH_P5 (0x27D4EB2F165667C5ULL)
+
+/** The state of a calculation. */
+struct cs___xxh64_t
+{
+	/** The 4 lanes. */
+	uint64_t v[4];
+	/** Number of bytes so far. */
+	uint64_t total;
+	/** Bytes that don't fill a stripe of 32 bytes yet. */
+	unsigned char mem[32];
+	unsigned memsize;
+};
 
 
-/** CRC table.
- * We calculate it once, and reuse it. */
-struct t_manber_parms
+static inline uint64_t cs___rotl64(uint64_t x, int r)
 {
-	uint32_t values[256];
-};
+	return (x << r) | (x >> (64-r));
+}
+
+static inline uint64_t cs___read64(const unsigned char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t cs___read32(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t cs___xxh_round(uint64_t acc, uint64_t input)
+{
+	acc += input * CS___XXH_P2;
+	acc=cs___rotl64(acc, 31);
+	return acc * CS___XXH_P1;
+}
+
+static inline uint64_t cs___xxh_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= cs___xxh_round(0, val);
+	return acc * CS___XXH_P1 + CS___XXH_P4;
+}
+
+
+static void cs___xxh64_init(struct cs___xxh64_t *x)
+{
+	memset(x, 0, sizeof(*x));
+	x->v[0]=CS___XXH_P1 + CS___XXH_P2;
+	x->v[1]=CS___XXH_P2;
+	x->v[2]=0;
+	x->v[3]=-CS___XXH_P1;
+}
+
+
+/** Processes \a count stripes of 32 bytes.
+ * The lanes are independent, so the CPU can work on all of them at once. 
+ * */
+static void cs___xxh64_stripes(uint64_t *v, 
+		const unsigned char *p, size_t count)
+{
+	uint64_t v0=v[0], v1=v[1], v2=v[2], v3=v[3];
+
+	while (count--)
+	{
+		v0=cs___xxh_round(v0, cs___read64(p));
+		v1=cs___xxh_round(v1, cs___read64(p+8));
+		v2=cs___xxh_round(v2, cs___read64(p+16));
+		v3=cs___xxh_round(v3, cs___read64(p+24));
+		p+=32;
+	}
+
+	v[0]=v0;
+	v[1]=v1;
+	v[2]=v2;
+	v[3]=v3;
+}
+
+
+static void cs___xxh64_update(struct cs___xxh64_t *x, 
+		const unsigned char *p, size_t len)
+{
+	size_t fill;
+
+
+	x->total+=len;
+	if (x->memsize + len < sizeof(x->mem))
+	{
+		memcpy(x->mem + x->memsize, p, len);
+		x->memsize+=len;
+		return;
+	}
+
+	if (x->memsize)
+	{
+		fill=sizeof(x->mem) - x->memsize;
+		memcpy(x->mem + x->memsize, p, fill);
+		cs___xxh64_stripes(x->v, x->mem, 1);
+		p+=fill;
+		len-=fill;
+	}
+
+	cs___xxh64_stripes(x->v, p, len/32);
+	p+=len & ~(size_t)31;
+	len&=31;
+
+	memcpy(x->mem, p, len);
+	x->memsize=len;
+}
+
+
+static uint64_t cs___xxh64_digest(const struct cs___xxh64_t *x)
+{
+	uint64_t h;
+	const unsigned char *p;
+	unsigned len;
+
+
+	if (x->total >= 32)
+	{
+		h=cs___rotl64(x->v[0], 1) + cs___rotl64(x->v[1], 7) +
+			cs___rotl64(x->v[2], 12) + cs___rotl64(x->v[3], 18);
+		h=cs___xxh_merge(h, x->v[0]);
+		h=cs___xxh_merge(h, x->v[1]);
+		h=cs___xxh_merge(h, x->v[2]);
+		h=cs___xxh_merge(h, x->v[3]);
+	}
+	else
+		h=x->v[2] + CS___XXH_P5;
+
+	h+=x->total;
+
+	p=x->mem;
+	len=x->memsize;
+	for(; len>=8; p+=8, len-=8)
+	{
+		h ^= cs___xxh_round(0, cs___read64(p));
+		h=cs___rotl64(h, 27) * CS___XXH_P1 + CS___XXH_P4;
+	}
+	if (len >= 4)
+	{
+		h ^= (uint64_t)cs___read32(p) * CS___XXH_P1;
+		h=cs___rotl64(h, 23) * CS___XXH_P2 + CS___XXH_P3;
+		p+=4;
+		len-=4;
+	}
+	for(; len; p++, len--)
+	{
+		h ^= *p * CS___XXH_P5;
+		h=cs___rotl64(h, 11) * CS___XXH_P1;
+	}
+
+	h ^= h >> 33;
+	h *= CS___XXH_P2;
+	h ^= h >> 29;
+	h *= CS___XXH_P3;
+	h ^= h >> 32;
+	return h;
+}
+/** @} */
+
+
 
 /** Everything needed to calculate manber-hashes out of a stream.
  * */
@@ -60,33 +259,46 @@ struct t_manber_data
 	int manber_fd;
 
 
+	/** Which function gives the block borders. */
+	enum cdc__type_e chunker;
 	/** The internal manber-state. */
-	uint32_t state;
-	/** The previous manber-state.  */
-	uint32_t last_state;
-	/** Count of bytes in backtrack buffer. */
-	int bktrk_bytes;
-	/** The last byte in the rotating backtrack-buffer. */
-	int bktrk_last;
-	/** The backtrack buffer. */
-	unsigned char backtrack[CS__MANBER_BACKTRACK];
+	struct cdc__manber_t mnb;
+	/** The gear hash, see \ref md5s_gear. */
+	struct cdc__gear_t gear;
+	/** Whether the \ref md5s file is written in the binary format. */
+	int binary;
+	/** Set if the full-file MD5 is not needed. */
+	int no_full_md5;
 	/** Flag to see whether we're in a zero-bytes block.
 	 * If there are large blocks with only \c \\0 in them, we don't CRC
 	 * or MD5 them - just output as zero blocks with a MD5 of \c \\0*16.
 	 * Useful for sparse files. */
 	int data_bits;
+	/** The full-file MD5 state at the last border written. */
+	struct cs__md5s_midstate_t border_md5;
+	/** The fast hash of the full file, see \ref o_change_hash. */
+	struct cs___xxh64_t fast;
+	/** Set if only \c fast is needed; the manber blocks and MD5s are not 
+	 * calculated then. */
+	int fast_only;
+
+	/** \name Appending to the existing \ref md5s file.
+	 * See \ref md5s_append.
+	 * @{ */
+	/** The local file the data is read from; \c NULL if the data doesn't 
+	 * come from there. */
+	const char *local_path;
+	/** The blocks of the previous version. */
+	struct cs__manber_hashes old;
+	/** The next block in \c old to compare. */
+	unsigned old_pos;
+	/** Set while the data is still the same as in \c old. */
+	int verifying;
+	/** Set if \c manber_fd is the existing file, not a temporary one. */
+	int in_place;
+	/** @} */
 };
 
-/** The precalculated CRC-table. */
-struct t_manber_parms manber_parms;
-
-
-/** \b The Manber-structure.
- * Currently only a single instance of manber-hashing runs at once,
- * so we simply use a static structure. */
-static struct t_manber_data cs___manber;
-
-
 /** The write format string for \ref md5s. */
 const char cs___mb_wr_format[]= "%s %08x %10llu %10llu\n";
 /** The read format string for \ref md5s. */
@@ -103,6 +315,17 @@ const char cs___mb_rd_format[]= "%*s%n %x %llu %llu\n";
 #define MANBER_LINELEN (APR_MD5_DIGESTSIZE*2+1 + 8+1 + 10+1 +10+1 + 1)
 
 
+/** The 64bit hash that's stored for a block that ended at a border, or 
+ * (if \a tail is set) for the data after the last border. */
+static inline uint64_t cs___hash64(const struct t_manber_data *mb_f, 
+		int tail)
+{
+	if (mb_f->chunker == CDC__GEAR)
+		return mb_f->gear.hash;
+	return tail ? mb_f->mnb.state64 : mb_f->mnb.last_state64;
+}
+
+
 /** Initializes a Manber-data structure from a struct \a estat. */
 int cs___manber_data_init(struct t_manber_data *mbd, 
 		struct estat *sts);
@@ -281,6 +504,1216 @@ ex:
 }
 
 
+/** Stores the state of \a ctx for the position \a pos in \a ms. */
+static void cs___md5_save(const apr_md5_ctx_t *ctx, off_t pos,
+		struct cs__md5s_midstate_t *ms)
+{
+	unsigned used;
+
+	ms->pos=pos;
+	memcpy(ms->state, ctx->state, sizeof(ms->state));
+	memcpy(ms->count, ctx->count, sizeof(ms->count));
+	memcpy(ms->buffer, ctx->buffer, sizeof(ms->buffer));
+	/* Only the bytes not yet hashed are used; the rest depends on how the 
+	 * data was given, and would make equal files look different. */
+	used=(ctx->count[0] >> 3) & 0x3f;
+	memset(ms->buffer+used, 0, sizeof(ms->buffer)-used);
+}
+
+
+/** Sets \a ctx to the state stored in \a ms. */
+static void cs___md5_restore(const struct cs__md5s_midstate_t *ms, 
+		apr_md5_ctx_t *ctx)
+{
+	apr_md5_init(ctx);
+	memcpy(ctx->state, ms->state, sizeof(ctx->state));
+	memcpy(ctx->count, ms->count, sizeof(ctx->count));
+	memcpy(ctx->buffer, ms->buffer, sizeof(ctx->buffer));
+}
+
+
+/** Adds to the statistics; can be called from any thread. */
+static void cs___count(unsigned files, unsigned links, 
+		t_ull read, t_ull holes)
+{
+	pthread_mutex_lock(&cs___stats_mutex);
+	cs___stats.files+=files;
+	cs___stats.links+=links;
+	cs___stats.read+=read;
+	cs___stats.holes+=holes;
+	pthread_mutex_unlock(&cs___stats_mutex);
+}
+
+
+/** -. */
+int cs__print_stats(FILE *output)
+{
+	int status;
+	static const char *modes[]= {
+		[HASH_READ_MMAP]="mmap",
+		[HASH_READ_READ]="read",
+		[HASH_READ_DIRECT]="direct",
+	};
+
+
+	status=0;
+	STOPIF_CODE_EPIPE( fprintf(output, "\nHashing statistics (%s, %s MD5):\n"
+				"%u files, %llu bytes read, %llu bytes in holes, "
+				"%u taken from other hardlinks\n",
+				modes[opt__get_int(OPT__HASH_READ)], md5mb__engine(),
+				cs___stats.files, cs___stats.read, cs___stats.holes,
+				cs___stats.links), NULL);
+
+ex:
+	return status;
+}
+
+
+/** \name Hardlinks
+ * A file with several hardlinks is seen once per path; its data is hashed 
+ * only for the first of them, the others get the result from this table.
+ *
+ * An inode is identified by device and inode number; the size and times 
+ * have to match, too, so that a file that got changed in the meantime is 
+ * hashed again.
+ *
+ * A result with cs__compare_t::block_changed set isn't a complete MD5, 
+ * but just says that the file differs from the \ref md5s data; it's only 
+ * used for paths with the same old MD5.
+ * @{ */
+struct cs___link_t {
+	struct cs___link_t *next;
+	struct sstat_t st;
+	md5_digest_t md5, old_md5;
+	int block_changed;
+};
+static struct {
+	struct cs___link_t **buckets;
+	/** Number of buckets, a power of 2; and of entries. */
+	unsigned size, count;
+} cs___links;
+static pthread_mutex_t cs___links_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+
+static inline unsigned cs___link_bucket(const struct sstat_t *st, 
+		unsigned size)
+{
+	return ((unsigned)st->ino * 2654435761U ^ (unsigned)st->dev) & (size-1);
+}
+
+
+/** Finds the entry for \a st; called with \c cs___links_mutex held. */
+static struct cs___link_t *cs___link_find(const struct sstat_t *st)
+{
+	struct cs___link_t *l;
+
+	if (!cs___links.size) return NULL;
+
+	l=cs___links.buckets[ cs___link_bucket(st, cs___links.size) ];
+	while (l)
+	{
+		if (l->st.ino == st->ino && l->st.dev == st->dev &&
+				l->st.size == st->size &&
+				l->st.mtim.tv_sec == st->mtim.tv_sec &&
+				l->st.mtim.tv_nsec == st->mtim.tv_nsec &&
+				l->st.ctim.tv_sec == st->ctim.tv_sec &&
+				l->st.ctim.tv_nsec == st->ctim.tv_nsec)
+			return l;
+		l=l->next;
+	}
+
+	return NULL;
+}
+
+
+/** Fills the result into \a cmp, if another link to \a st was already 
+ * hashed. Returns whether it did. */
+static int cs___link_get(const struct sstat_t *st, struct cs__compare_t *cmp)
+{
+	struct cs___link_t *l;
+	int found;
+
+	found=0;
+	pthread_mutex_lock(&cs___links_mutex);
+	l=cs___link_find(st);
+	if (l && (!l->block_changed ||
+				memcmp(l->old_md5, cmp->old_md5, sizeof(l->old_md5)) == 0))
+	{
+		memcpy(cmp->md5, l->md5, sizeof(cmp->md5));
+		cmp->block_changed=l->block_changed;
+		found=1;
+	}
+	pthread_mutex_unlock(&cs___links_mutex);
+
+	return found;
+}
+
+
+/** Remembers the result in \a cmp for \a st.
+ * This is only an optimization; if there's no memory, nothing is stored. 
+ * */
+static void cs___link_put(const struct sstat_t *st, 
+		const struct cs__compare_t *cmp)
+{
+	struct cs___link_t *l, *next, **buckets;
+	unsigned i, b, size;
+
+
+	pthread_mutex_lock(&cs___links_mutex);
+	/* Grow the table, so that the chains stay short. */
+	if (cs___links.count >= cs___links.size*2)
+	{
+		size= cs___links.size ? cs___links.size*4 : 256;
+		buckets=calloc(size, sizeof(*buckets));
+		if (buckets)
+		{
+			for(i=0; i<cs___links.size; i++)
+				for(l=cs___links.buckets[i]; l; l=next)
+				{
+					next=l->next;
+					b=cs___link_bucket(&l->st, size);
+					l->next=buckets[b];
+					buckets[b]=l;
+				}
+
+			free(cs___links.buckets);
+			cs___links.buckets=buckets;
+			cs___links.size=size;
+		}
+	}
+
+	l=cs___link_find(st);
+	if (!l && cs___links.size && (l=malloc(sizeof(*l))))
+	{
+		l->st=*st;
+		b=cs___link_bucket(st, cs___links.size);
+		l->next=cs___links.buckets[b];
+		cs___links.buckets[b]=l;
+		cs___links.count++;
+	}
+
+	if (l)
+	{
+		memcpy(l->md5, cmp->md5, sizeof(l->md5));
+		memcpy(l->old_md5, cmp->old_md5, sizeof(l->old_md5));
+		l->block_changed=cmp->block_changed;
+	}
+	pthread_mutex_unlock(&cs___links_mutex);
+}
+/** @} */
+
+
+/** \name Throttling
+ * A token bucket each for bytes and read calls, shared by all threads; 
+ * see \ref o_io_limit.
+ * @{ */
+static struct {
+	/** The limits in effect, per second; \c 0 means unlimited. */
+	double bytes, ops;
+	/** What's left in the buckets. This may get negative; the callers 
+	 * wait until it would be refilled. */
+	double byte_tokens, op_tokens;
+	/** When the buckets were last refilled. */
+	struct timeval last;
+	/** When the first bytes came, and how many there were since then; 
+	 * used when the throttling is switched on without a configured 
+	 * limit. */
+	struct timeval start;
+	t_ull total;
+	/** How many toggle requests have been handled. */
+	int toggled;
+	int is_init;
+} cs___tb;
+static pthread_mutex_t cs___tb_mutex=PTHREAD_MUTEX_INITIALIZER;
+/** Incremented by cs__throttle_toggle(). */
+static volatile sig_atomic_t cs___tb_toggle=0;
+
+/** The smallest limit that gets set by cs__throttle_toggle(). */
+#define CS___TB_MIN (64*1024)
+
+
+/** -.
+ * Only a counter is changed, so this can be called from a signal 
+ * handler; the next read does the work. */
+void cs__throttle_toggle(void)
+{
+	cs___tb_toggle++;
+}
+
+
+/** Handler for \c SIGHUP. */
+static void cs___sighup(int num UNUSED)
+{
+	cs__throttle_toggle();
+}
+
+
+/** -.
+ * Only done if \ref o_io_limit "io_limit" or \c io_ops is set, so that 
+ * FSVS normally still terminates on a hangup; else a run started from a 
+ * terminal would go on reading the disk after the session is gone.
+ * Called again after each configuration file is read. */
+void cs__throttle_signal(void)
+{
+	if (opt__get_int(OPT__IO_LIMIT) || opt__get_int(OPT__IO_OPS))
+		signal(SIGHUP, cs___sighup);
+}
+
+
+/** Switches the throttling on or off; called with \c cs___tb_mutex held.
+ * */
+static void cs___throttle_switch(struct timeval *now)
+{
+	double elapsed;
+
+
+	if (cs___tb.bytes || cs___tb.ops)
+	{
+		cs___tb.bytes=cs___tb.ops=0;
+		return;
+	}
+
+	cs___tb.bytes=opt__get_int(OPT__IO_LIMIT);
+	cs___tb.ops=opt__get_int(OPT__IO_OPS);
+	if (!cs___tb.bytes && !cs___tb.ops)
+	{
+		/* Nothing configured - go down to half of what we had so far. */
+		elapsed=(now->tv_sec - cs___tb.start.tv_sec) +
+			(now->tv_usec - cs___tb.start.tv_usec)/1e6;
+		cs___tb.bytes= elapsed > 0 ? cs___tb.total/elapsed/2 : 0;
+		if (cs___tb.bytes < CS___TB_MIN) cs___tb.bytes=CS___TB_MIN;
+	}
+
+	cs___tb.byte_tokens=cs___tb.bytes;
+	cs___tb.op_tokens=cs___tb.ops;
+}
+
+
+/** Takes \a bytes and one read from the buckets, and waits if they're 
+ * used up. Can be called from any thread. */
+static void cs___throttle(size_t bytes)
+{
+	struct timeval now;
+	struct timespec ts;
+	double elapsed, wait;
+
+
+	pthread_mutex_lock(&cs___tb_mutex);
+	gettimeofday(&now, NULL);
+	if (!cs___tb.is_init)
+	{
+		cs___tb.bytes=opt__get_int(OPT__IO_LIMIT);
+		cs___tb.ops=opt__get_int(OPT__IO_OPS);
+		cs___tb.byte_tokens=cs___tb.bytes;
+		cs___tb.op_tokens=cs___tb.ops;
+		cs___tb.start=cs___tb.last=now;
+		cs___tb.is_init=1;
+	}
+
+	while (cs___tb.toggled != cs___tb_toggle)
+	{
+		cs___tb.toggled++;
+		cs___throttle_switch(&now);
+	}
+	cs___tb.total+=bytes;
+
+	elapsed=(now.tv_sec - cs___tb.last.tv_sec) +
+		(now.tv_usec - cs___tb.last.tv_usec)/1e6;
+	cs___tb.last=now;
+
+	/* At most a second's worth is kept, so that there are no long bursts 
+	 * after idle times. */
+	wait=0;
+	if (cs___tb.bytes)
+	{
+		cs___tb.byte_tokens += elapsed*cs___tb.bytes;
+		if (cs___tb.byte_tokens > cs___tb.bytes)
+			cs___tb.byte_tokens=cs___tb.bytes;
+		cs___tb.byte_tokens -= bytes;
+		if (cs___tb.byte_tokens < 0)
+			wait=-cs___tb.byte_tokens/cs___tb.bytes;
+	}
+	if (cs___tb.ops)
+	{
+		cs___tb.op_tokens += elapsed*cs___tb.ops;
+		if (cs___tb.op_tokens > cs___tb.ops)
+			cs___tb.op_tokens=cs___tb.ops;
+		cs___tb.op_tokens -= 1;
+		if (cs___tb.op_tokens < 0 && -cs___tb.op_tokens/cs___tb.ops > wait)
+			wait=-cs___tb.op_tokens/cs___tb.ops;
+	}
+	pthread_mutex_unlock(&cs___tb_mutex);
+
+	/* The tokens are already taken, so other threads wait for their share 
+	 * after us. */
+	if (wait > 0)
+	{
+		ts.tv_sec=wait;
+		ts.tv_nsec=(wait-ts.tv_sec)*1e9;
+		while (nanosleep(&ts, &ts) == -1 && errno == EINTR) ;
+	}
+}
+/** @} */
+
+
+/** Allocates a buffer for cs___pread(), for \a len bytes. */
+static int cs___read_buffer(unsigned char **buffer, size_t len)
+{
+	void *ptr;
+
+	/* O_DIRECT may need up to one aligned block more at each end. */
+	if (posix_memalign(&ptr, CS___ALIGN, len + 2*CS___ALIGN))
+		return ENOMEM;
+
+	*buffer=ptr;
+	return 0;
+}
+
+
+/** Reads up to \a len bytes at \a pos into \a buffer (see 
+ * cs___read_buffer()); \a *data is set to the first of them.
+ *
+ * For \c HASH_READ_DIRECT the read is aligned as \c O_DIRECT needs it; 
+ * for \c HASH_READ_READ the data is dropped from the page cache again, 
+ * as it's in \a buffer now.
+ *
+ * Returns the number of bytes, \c 0 at the end of the file, or \c -1 on 
+ * error. */
+static ssize_t cs___pread(int fh, int mode, unsigned char *buffer, 
+		size_t len, off_t pos, const unsigned char **data)
+{
+	off_t start;
+	size_t skip, want;
+	ssize_t got;
+
+
+	skip= mode == HASH_READ_DIRECT ? pos % CS___ALIGN : 0;
+	start=pos-skip;
+	want=len+skip;
+	if (mode == HASH_READ_DIRECT)
+		want=(want + CS___ALIGN-1) & ~(size_t)(CS___ALIGN-1);
+
+	got=pread(fh, buffer, want, start);
+	if (got == -1) return -1;
+	cs___throttle(got);
+
+#ifdef POSIX_FADV_DONTNEED
+	/* Partial pages at the end are left; the next read drops them. */
+	if (mode == HASH_READ_READ && got > 0)
+		posix_fadvise(fh, start - start % CS___ALIGN, 
+				got + start % CS___ALIGN, POSIX_FADV_DONTNEED);
+#endif
+
+	if (got <= skip) return 0;
+	got-=skip;
+	if (got > len) got=len;
+
+	*data=buffer+skip;
+	return got;
+}
+
+
+/** Returns the length of the data resp. hole (then \a *hole is set) 
+ * starting at \a pos, but only up to \a end.
+ *
+ * Without \c SEEK_HOLE, or if the filesystem doesn't know, everything is 
+ * data. */
+static off_t cs___next_run(int fh, off_t pos, off_t end, int *hole)
+{
+#ifdef SEEK_HOLE
+	off_t next;
+
+
+	next=lseek(fh, pos, SEEK_DATA);
+	/* A hole up to the end of the file, or we're already past that. */
+	if (next == -1 && errno == ENXIO)
+		next=lseek(fh, 0, SEEK_END);
+
+	if (next > pos)
+	{
+		*hole=1;
+		return (next < end ? next : end) - pos;
+	}
+
+	if (next == pos)
+	{
+		next=lseek(fh, pos, SEEK_HOLE);
+		if (next > pos)
+		{
+			*hole=0;
+			return (next < end ? next : end) - pos;
+		}
+	}
+#endif
+
+	*hole=0;
+	return end-pos;
+}
+
+
+/** \name Parallel verification of big files.
+ *
+ * If a binary \ref md5s file has a record for the data after the last 
+ * border (see \ref md5s_last), every block can be verified on its own; 
+ * so with \ref o_threads bigger than \c 1 several threads read and hash 
+ * disjoint block ranges of the file at once.
+ *
+ * If all blocks match, the file is unchanged, and its MD5 is the stored 
+ * one; so the full-file MD5 isn't calculated at all. The first different 
+ * block stops all threads; then the normal, sequential check is done.
+ *
+ * The number of additional threads is shared by all files, so that 
+ * together with the \ref prefetch "prefetch threads" no more than \ref 
+ * o_threads files are hashed at once, and each file uses at most \ref 
+ * o_threads threads.
+ * @{ */
+/** How many blocks a thread should have at least. */
+#define CS___PAR_MIN_BLOCKS (16)
+/** How many blocks a thread takes at once. */
+#define CS___PAR_CHUNK (8)
+/** How many bytes are read at once. */
+#define CS___PAR_READSIZE (1024*1024)
+
+/** The data shared by the threads verifying one file. */
+struct cs___par_t
+{
+	pthread_mutex_t mutex;
+	/** The file. */
+	int fh;
+	/** The blocks. */
+	const struct cs__manber_hashes *mbh;
+	/** How many blocks to verify; \c mbh->count is the tail record. */
+	unsigned blocks;
+	/** The next block to verify. */
+	unsigned next;
+	/** Set if a block differs; the other threads stop then. */
+	volatile int changed;
+	/** How the file is read, see \ref o_hash_read. */
+	int mode;
+};
+
+/** How many additional threads may still be started. */
+static int cs___par_spare=-1;
+static pthread_mutex_t cs___par_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+
+/** Returns whether the block \a nr matches the file data.
+ *
+ * Errors are not reported; the block is just taken as changed, and the 
+ * sequential check that's done then tells the reason. */
+static int cs___par_block(struct cs___par_t *par, unsigned nr,
+		unsigned char *buffer, t_ull *read, t_ull *holes)
+{
+	const struct cs__manber_hashes *mbh=par->mbh;
+	struct t_manber_data mb;
+	off_t pos, end, limit, run_end;
+	ssize_t len;
+	int eob, is_tail, hole;
+	const unsigned char *data;
+
+
+	is_tail= nr == mbh->count;
+	pos= nr ? mbh->end[nr-1] : 0;
+	end=mbh->end[nr];
+	if (end < pos) return 0;
+
+	/* A block of zeroes ends only at the next non-zero byte, so we need 
+	 * that one, too. After the last border there must not be another. */
+	limit= is_tail ? end : end+1;
+
+	if (cs___manber_data_init(&mb, NULL)) return 0;
+	mb.chunker=mbh->chunker;
+	mb.no_full_md5=1;
+	mb.fpos=mb.last_fpos=pos;
+
+	eob=-1;
+	run_end=pos;
+	hole=0;
+	while (pos < limit)
+	{
+		if (par->changed) return 0;
+
+		if (pos >= run_end)
+			run_end=pos + cs___next_run(par->fh, pos, limit, &hole);
+
+		len=run_end-pos;
+		if (hole)
+		{
+			if (len > CS___ZEROS) len=CS___ZEROS;
+			data=cs___zeros;
+			*holes+=len;
+		}
+		else
+		{
+			if (len > CS___PAR_READSIZE) len=CS___PAR_READSIZE;
+			len=cs___pread(par->fh, par->mode, buffer, len, pos, &data);
+			if (len <= 0) return 0;
+			*read+=len;
+		}
+
+		if (cs___end_of_block(data, len, &eob, &mb)) return 0;
+		if (eob != -1) break;
+		pos+=len;
+	}
+
+	if (is_tail)
+	{
+		if (eob != -1) return 0;
+		/* Same as in cs___write_tail(). */
+		if (mb.data_bits &&
+				apr_md5_final(mb.block_md5, & mb.block_md5_ctx))
+			return 0;
+	}
+	else
+	{
+		if (eob == -1 || mb.fpos != end ||
+				cs___hash64(&mb, 0) != mbh->hash[nr])
+			return 0;
+	}
+
+	return memcmp(mb.block_md5, mbh->md5[nr], sizeof(mb.block_md5)) == 0;
+}
+
+
+/** Takes chunks of blocks, until all are done or one is different. */
+static void *cs___par_worker(void *arg)
+{
+	struct cs___par_t *par=arg;
+	unsigned char *buffer;
+	unsigned nr, last;
+	t_ull read, holes;
+
+
+	read=holes=0;
+	if (cs___read_buffer(&buffer, CS___PAR_READSIZE))
+		buffer=NULL;
+
+	pthread_mutex_lock(&par->mutex);
+	if (!buffer) par->changed=1;
+	while (!par->changed && par->next < par->blocks)
+	{
+		nr=par->next;
+		last=nr+CS___PAR_CHUNK;
+		if (last > par->blocks)
+			last=par->blocks;
+		par->next=last;
+		pthread_mutex_unlock(&par->mutex);
+
+		for(; nr<last; nr++)
+			if (!cs___par_block(par, nr, buffer, &read, &holes))
+				break;
+
+		pthread_mutex_lock(&par->mutex);
+		if (nr < last) par->changed=1;
+	}
+	pthread_mutex_unlock(&par->mutex);
+
+	cs___count(0, 0, read, holes);
+	IF_FREE(buffer);
+	return NULL;
+}
+
+
+/** Verifies the first \a blocks blocks in \a mbh with additional 
+ * threads, if there are any to spare.
+ *
+ * \a *result is set to \c 0 if all blocks match, \c 1 if one is 
+ * different, and \c -1 if no threads were started; if \a always is set, 
+ * the blocks are verified by this thread alone then. */
+static int cs___par_verify(int fh, int mode, 
+		const struct cs__manber_hashes *mbh,
+		unsigned blocks, int always, int *result)
+{
+	int status;
+	int helpers, i;
+	struct cs___par_t par;
+	pthread_t threads[PF__MAX_THREADS];
+
+
+	status=0;
+	*result=-1;
+
+	helpers=blocks / CS___PAR_MIN_BLOCKS - 1;
+	pthread_mutex_lock(&cs___par_mutex);
+	if (helpers > cs___par_spare) helpers=cs___par_spare;
+	if (helpers > 0) cs___par_spare-=helpers;
+	else helpers=0;
+	pthread_mutex_unlock(&cs___par_mutex);
+	if (!helpers && !always) goto ex;
+
+	memset(&par, 0, sizeof(par));
+	STOPIF_CODE_ERR( pthread_mutex_init(&par.mutex, NULL), EBUSY,
+			"initializing a mutex");
+	par.fh=fh;
+	par.mode=mode;
+	par.mbh=mbh;
+	par.blocks=blocks;
+
+	for(i=0; i<helpers; i++)
+		if (pthread_create(threads+i, NULL, cs___par_worker, &par))
+			break;
+
+	/* We can work with fewer threads; the rest is given back now. */
+	pthread_mutex_lock(&cs___par_mutex);
+	cs___par_spare+=helpers-i;
+	pthread_mutex_unlock(&cs___par_mutex);
+	helpers=i;
+
+	if (helpers || always)
+	{
+		/* This thread helps, too. */
+		cs___par_worker(&par);
+
+		for(i=0; i<helpers; i++)
+			pthread_join(threads[i], NULL);
+
+		pthread_mutex_lock(&cs___par_mutex);
+		cs___par_spare+=helpers;
+		pthread_mutex_unlock(&cs___par_mutex);
+
+		*result= par.changed ? 1 : 0;
+	}
+
+	pthread_mutex_destroy(&par.mutex);
+
+ex:
+	return status;
+}
+/** @} */
+
+
+/** Runs \a len bytes of \a data through the manber hashing in \a 
+ * mb_dat; if \a do_manber is set, the blocks found are compared with \a 
+ * mbh, starting at \a *hash_pos.
+ * On the first different block \a *changed is set, and the rest of the 
+ * data is ignored.
+ *
+ * With cs__compare_t::fast_only only the fast hash is calculated. */
+static int cs___compare_buffer(struct t_manber_data *mb_dat,
+		const struct cs__manber_hashes *mbh, int do_manber, 
+		unsigned *hash_pos, const unsigned char *data, unsigned len,
+		int *changed)
+{
+	int status;
+	int i;
+	unsigned pos;
+
+
+	status=0;
+	if (mb_dat->fast_only)
+	{
+		cs___xxh64_update(& mb_dat->fast, data, len);
+		goto ex;
+	}
+
+	pos=0;
+	while (pos<len)
+	{
+		STOPIF( cs___end_of_block(data+pos, len-pos, &i, mb_dat), NULL);
+
+		if (i==-1) break;
+
+		if (do_manber)
+		{
+			/* If this gets true, the file has more blocks than before - we 
+			 * must not print the hash values etc., as the index [*hash_pos] 
+			 * would be outside the array boundaries. */
+			if (*hash_pos >= mbh->count)
+				goto changed;
+
+			DEBUGP("  old hash=%08llX  current hash=%08llX", 
+					(t_ull)mbh->hash[*hash_pos], 
+					mbh->wide_hash ? (t_ull)cs___hash64(mb_dat, 0) : 
+					(t_ull)mb_dat->mnb.last_state);
+			DEBUGP("  old end=%llu  current end=%llu", 
+					(t_ull)mbh->end[*hash_pos], 
+					(t_ull)mb_dat->fpos);
+			DEBUGP("  old md5=%s  current md5=%s", 
+					cs__md5tohex_buffered(mbh->md5[*hash_pos]),
+					cs__md5tohex_buffered(mb_dat->block_md5));
+
+			if ((mbh->wide_hash ? cs___hash64(mb_dat, 0) : 
+						mb_dat->mnb.last_state) != mbh->hash[*hash_pos] ||
+					mb_dat->fpos != mbh->end[*hash_pos] ||
+					memcmp(mb_dat->block_md5, 
+						mbh->md5[*hash_pos], 
+						APR_MD5_DIGESTSIZE) != 0)
+			{
+				DEBUGP("found a different block before %llu:", 
+						(t_ull)mb_dat->fpos);
+changed:
+				*changed=1;
+				break;
+			}
+
+
+			DEBUGP("block #%u ok...", *hash_pos);
+			(*hash_pos)++;
+		}
+
+		/* We have to reset the blocks even if we have no manber hashes ...  
+		 * so the eg. data_bits value gets reset. */
+		STOPIF( cs___end_of_block(NULL, 0, NULL, mb_dat), NULL );
+
+		pos+=i;
+	}
+
+ex:
+	return status;
+}
+
+
+/** -.
+ * Files without a \ref md5s file (ie. smaller than \c CS__MIN_FILE_SIZE) 
+ * are read completely, and hashed together via md5mb__digest(); the 
+ * others, and files with several hardlinks (see cs___link_get()), are 
+ * given to cs__compare_data().
+ *
+ * The return value for \a cmp[i] is stored in \a result[i]; like 
+ * cs__compare_data() this can be called in other threads. */
+void cs__compare_small(struct cs__compare_t *cmp[], int result[], 
+		unsigned count)
+{
+	struct md5mb__job_t jobs[CS__SMALL_BATCH];
+	unsigned char *buffers[CS__SMALL_BATCH];
+	struct stat st64;
+	unsigned i, n;
+	ssize_t len;
+	int fh, mode;
+
+
+	BUG_ON(count > CS__SMALL_BATCH);
+	mode=opt__get_int(OPT__HASH_READ);
+	n=0;
+	for(i=0; i<count; i++)
+	{
+		cmp[i]->block_changed=0;
+		cmp[i]->unreadable=0;
+		result[i]=0;
+
+		/* Errors are reported by cs__compare_data(). */
+		if (cmp[i]->md5s_path || cmp[i]->size >= CS__MIN_FILE_SIZE)
+			goto single;
+		fh=openat(cmp[i]->dir_fd, cmp[i]->path, O_RDONLY);
+		if (fh == -1)
+			goto single;
+
+		if (fstat(fh, &st64) == -1 || !S_ISREG(st64.st_mode) ||
+				st64.st_nlink > 1 || st64.st_size >= CS__MIN_FILE_SIZE ||
+				!(buffers[n]=malloc(st64.st_size+1)))
+		{
+			close(fh);
+			goto single;
+		}
+
+		len=read(fh, buffers[n], st64.st_size);
+#ifdef POSIX_FADV_DONTNEED
+		if (mode != HASH_READ_MMAP)
+			posix_fadvise(fh, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+		close(fh);
+
+		/* Changed in the meantime. */
+		if (len != st64.st_size)
+		{
+			free(buffers[n]);
+			goto single;
+		}
+
+		cs___throttle(len);
+		cs___count(1, 0, len, 0);
+		cmp[i]->size=len;
+		jobs[n].data=buffers[n];
+		jobs[n].len=len;
+		jobs[n].digest=cmp[i]->md5;
+		n++;
+		continue;
+
+single:
+		result[i]=cs__compare_data(cmp[i]);
+	}
+
+	md5mb__digest(jobs, n);
+
+	for(i=0; i<n; i++)
+		free(buffers[i]);
+}
+
+
+/** -.
+ * The \ref md5s file is only looked for if \a size is big enough; as \a 
+ * size may be the old value, cs__compare_data() takes the current size 
+ * from cs__compare_t::size, which may be changed in between.
+ *
+ * Has to be called in the main thread, as the WAA path functions use 
+ * static buffers. */
+int cs__compare_init(struct cs__compare_t *cmp, struct estat *sts,
+		char *fullpath, off_t size)
+{
+	int status;
+	char *filename;
+
+
+	status=0;
+	memset(cmp, 0, sizeof(*cmp));
+	cmp->path=fullpath;
+	cmp->dir_fd=AT_FDCWD;
+	cmp->size=size;
+	memcpy(cmp->old_md5, sts->md5, sizeof(cmp->old_md5));
+
+	/* Has to be done before any other thread could use the table. */
+	cdc__init();
+
+	if (cs___par_spare == -1)
+	{
+		cs___par_spare=opt__get_int(OPT__THREADS);
+		if (cs___par_spare > PF__MAX_THREADS)
+			cs___par_spare=PF__MAX_THREADS;
+		cs___par_spare= cs___par_spare > 1 ? cs___par_spare-1 : 0;
+	}
+
+	if (size >= CS__MIN_FILE_SIZE)
+	{
+		STOPIF( ops__build_path(&filename, sts), NULL);
+		STOPIF( waa__get_byext_path(filename, WAA__FILE_MD5s_EXT, 
+					&cmp->md5s_path), NULL);
+	}
+
+ex:
+	return status;
+}
+
+
+/** -.
+ *
+ * This function only uses the data in \a cmp, and a local manber context; 
+ * so several files can be done in parallel.
+ * (The debug output uses static buffers; so the callers don't use threads 
+ * if debugging is enabled.)
+ *
+ * \note Performance optimization
+ * In normal circumstances not the whole file has to be read to get the 
+ * result. On update a checksum is written for each manber-block of about 
+ * 128k (but see \ref CS__APPROX_BLOCKSIZE_BITS); as soon as one is seen as 
+ * changed the verification is stopped.
+ *
+ * Big files with a binary \ref md5s file may be verified in parallel, 
+ * see cs___par_verify(); if such a file only got bigger, just the new 
+ * data is hashed, see \ref md5s_append.
+ *
+ * Holes in sparse files are found via \c SEEK_DATA and \c SEEK_HOLE; 
+ * they're hashed as zeroes, but never read, so they don't fill the page 
+ * cache.
+ *
+ * A file with several hardlinks is hashed only for the first path it's 
+ * seen under; see cs___link_get().
+ *
+ * With \ref o_change_hash "change_hash=fast" a file with a fast hash in 
+ * its \ref md5s file is only checked with that; the MD5 is calculated 
+ * when the data is committed.
+ * */
+int cs__compare_data(struct cs__compare_t *cmp)
+{
+	int i, status, fh, hole, changed, mode, flags;
+	unsigned length_mapped, map_pos, hash_pos;
+	off_t current_pos, map_start, run;
+	ssize_t len;
+	long pagesize;
+	t_ull read, holes;
+	struct cs__manber_hashes mbh_data;
+	unsigned char *filedata, *buffer;
+	const unsigned char *data;
+	int do_manber, is_linked, link_hit;
+	struct t_manber_data mb_dat;
+	struct stat st64;
+	struct sstat_t st;
+
+
+	fh=-1;
+	buffer=NULL;
+	read=holes=0;
+	filedata=MAP_FAILED;
+	length_mapped=0;
+	memset(&mbh_data, 0, sizeof(mbh_data));
+	cmp->block_changed=0;
+	cmp->unreadable=0;
+
+	link_hit=0;
+	is_linked=0;
+	do_manber=0;
+	hash_pos=0;
+	STOPIF( cs___manber_data_init(&mb_dat, NULL), NULL );
+	/* Without an md5s file the borders don't matter. */
+	mb_dat.chunker=CDC__GEAR;
+
+	/* We map windows of the file into main memory. Never more than 256MB. 
+	 * Or we read it, see \ref o_hash_read. */
+	current_pos=0;
+	mode=opt__get_int(OPT__HASH_READ);
+	flags=O_RDONLY;
+#ifdef O_DIRECT
+	if (mode == HASH_READ_DIRECT)
+		flags |= O_DIRECT;
+#else
+	if (mode == HASH_READ_DIRECT)
+		mode=HASH_READ_READ;
+#endif
+
+	fh=openat(cmp->dir_fd, cmp->path, flags);
+	/* Not every filesystem can do O_DIRECT. */
+	if (fh<0 && errno == EINVAL && flags != O_RDONLY)
+	{
+		DEBUGP("no O_DIRECT for %s", cmp->path);
+		mode=HASH_READ_READ;
+		fh=openat(cmp->dir_fd, cmp->path, O_RDONLY);
+	}
+
+	/* We allow a single special case on error handling: EACCES, which 
+	 * could simply mean that the file has mode 000. */
+	if (fh<0)
+	{
+		/* The debug statement might change errno, so we have to save the 
+		 * value.  */
+		status=errno;
+		DEBUGP("File %s is unreadable: %d", cmp->path, status);
+		if (status == EACCES) 
+		{
+			cmp->unreadable=1;
+			status=0;
+			goto ex;
+		}
+
+		/* Can that happen? */
+		if (!status) status=EBUSY;
+		STOPIF(status, "open(\"%s\", O_RDONLY) failed", cmp->path);
+	}
+
+	/* Maybe another link to this inode was already done. */
+	STOPIF_CODE_ERR( fstat(fh, &st64) == -1, errno,
+			"fstat(\"%s\") failed", cmp->path);
+	if (st64.st_nlink > 1)
+	{
+		STOPIF( hlp__stat_result(&st64, &st), NULL);
+		is_linked=1;
+		if (cs___link_get(&st, cmp))
+		{
+			DEBUGP("%s already hashed via another link", cmp->path);
+			link_hit=1;
+			goto ex;
+		}
+	}
+
+	/* Read the stream, comparing the blocks as necessary.
+	 * If a difference is found, stop, and mark file as different. */
+	/* If this call returns ENOENT, this entry simply has no md5s-file.
+	 * We'll have to MD5 it completely. */
+	if (cmp->size >= CS__MIN_FILE_SIZE && cmp->md5s_path)
+	{
+		status=cs__read_manber_file(cmp->md5s_path, &mbh_data);
+		if (status != ENOENT)
+		{
+			STOPIF(status, "reading manber-hash data for %s", cmp->path);
+			do_manber=1;
+			mb_dat.chunker=mbh_data.chunker;
+		}
+	}
+
+	/* The fast hash only tells whether the whole file is the same; so the 
+	 * blocks and the MD5 aren't calculated. */
+	if (do_manber && mbh_data.has_fast_hash &&
+			opt__get_int(OPT__CHANGE_HASH) == CHANGE_HASH_FAST)
+	{
+		DEBUGP("using the fast hash for %s", cmp->path);
+		mb_dat.fast_only=1;
+		do_manber=0;
+	}
+
+	status=0;
+	if (mode != HASH_READ_MMAP)
+	{
+#ifdef POSIX_FADV_SEQUENTIAL
+		posix_fadvise(fh, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+		STOPIF( cs___read_buffer(&buffer, CS___READSIZE), NULL);
+	}
+
+	/* Big files can be verified by several threads; the full MD5 is only 
+	 * needed if there's a change. The debug output isn't thread-safe. */
+	if (do_manber && mbh_data.has_tail && !debuglevel &&
+			mbh_data.end[mbh_data.count] == cmp->size)
+	{
+		STOPIF( cs___par_verify(fh, mode, &mbh_data, mbh_data.count+1, 0, &i), 
+				NULL);
+		if (i == 0)
+		{
+			memcpy(cmp->md5, cmp->old_md5, sizeof(cmp->md5));
+			if (is_linked) cs___link_put(&st, cmp);
+			goto ex;
+		}
+	}
+
+	/* A file that only got bigger is changed anyway; if the old blocks are 
+	 * still the same, the MD5 is resumed at the last border. */
+	if (do_manber && mbh_data.has_tail && mbh_data.has_midstate &&
+			mbh_data.count && !debuglevel &&
+			mbh_data.end[mbh_data.count] < cmp->size)
+	{
+		cmp->block_changed=1;
+		STOPIF( cs___par_verify(fh, mode, &mbh_data, mbh_data.count, 1, &i), 
+				NULL);
+		if (i)
+		{
+			/* The new MD5 isn't known; as the file is changed anyway, it's 
+			 * not worth reading it again. */
+			memcpy(cmp->md5, cmp->old_md5, sizeof(cmp->md5));
+			if (is_linked) cs___link_put(&st, cmp);
+			goto ex;
+		}
+
+		DEBUGP("%s got appended to", cmp->path);
+		cs___md5_restore(&mbh_data.midstate, & mb_dat.full_md5_ctx);
+		current_pos=mbh_data.midstate.pos;
+		mb_dat.fpos=mb_dat.last_fpos=current_pos;
+		do_manber=0;
+	}
+
+	pagesize=sysconf(_SC_PAGESIZE);
+	changed=0;
+	while (current_pos < cmp->size && !changed)
+	{
+		run=cs___next_run(fh, current_pos, cmp->size, &hole);
+
+		/* Holes are given as zeroes, without reading them. */
+		if (hole)
+		{
+			DEBUGP("hole of %llu bytes at %llu", 
+					(t_ull)run, (t_ull)current_pos); 
+			while (run && !changed)
+			{
+				length_mapped= run < CS___ZEROS ? run : CS___ZEROS;
+				STOPIF( cs___compare_buffer(&mb_dat, &mbh_data, do_manber,
+							&hash_pos, cs___zeros, length_mapped, &changed), NULL);
+				run-=length_mapped;
+				current_pos+=length_mapped;
+				holes+=length_mapped;
+			}
+			continue;
+		}
+
+		if (mode != HASH_READ_MMAP)
+		{
+			len=cs___pread(fh, mode, buffer, 
+					run < CS___READSIZE ? run : CS___READSIZE, current_pos, &data);
+			STOPIF_CODE_ERR( len == -1, errno, 
+					"comparing the file %s failed (read)", cmp->path);
+			/* The file got shorter. */
+			if (len == 0)
+			{
+				changed=1;
+				break;
+			}
+
+			STOPIF( cs___compare_buffer(&mb_dat, &mbh_data, do_manber,
+						&hash_pos, data, len, &changed), NULL);
+			current_pos+=len;
+			read+=len;
+			continue;
+		}
+
+		/* The mapping has to start on a page border. */
+		map_start=current_pos - current_pos % pagesize;
+		if (current_pos+run-map_start < MAPSIZE)
+			length_mapped=current_pos+run-map_start;
+		else
+			length_mapped=MAPSIZE;
+		DEBUGP("mapping %u bytes from %llu", 
+				length_mapped, (t_ull)map_start); 
+
+		filedata=mmap(NULL, length_mapped, 
+				PROT_READ, MAP_SHARED, 
+				fh, map_start);
+		STOPIF_CODE_ERR( filedata == MAP_FAILED, errno,
+				"comparing the file %s failed (mmap)",
+				cmp->path);
+
+		/* In pieces, so that the throttling doesn't come in bursts. */
+		map_pos=current_pos-map_start;
+		while (map_pos < length_mapped && !changed)
+		{
+			len=length_mapped-map_pos;
+			if (len > CS___READSIZE) len=CS___READSIZE;
+			cs___throttle(len);
+
+			STOPIF( cs___compare_buffer(&mb_dat, &mbh_data, do_manber,
+						&hash_pos, filedata+map_pos, len, &changed), NULL);
+			map_pos+=len;
+			read+=len;
+		}
+
+		STOPIF_CODE_ERR( munmap((void*)filedata, length_mapped) == -1,
+				errno, "unmapping of file failed");
+		filedata=MAP_FAILED;
+		current_pos=map_start+length_mapped;
+	}
+
+	if (changed)
+		cmp->block_changed=1;
+
+	if (mb_dat.fast_only)
+	{
+		/* The new MD5 isn't known; if the data is the same, it's the old 
+		 * one, else the file is changed anyway. */
+		if (cs___xxh64_digest(& mb_dat.fast) != mbh_data.fast_hash)
+			cmp->block_changed=1;
+		memcpy(cmp->md5, cmp->old_md5, sizeof(cmp->md5));
+	}
+	else
+	{
+		STOPIF( cs___finish_manber( &mb_dat), NULL);
+		memcpy(cmp->md5, mb_dat.full_md5, sizeof(cmp->md5));
+	}
+
+	if (is_linked)
+		cs___link_put(&st, cmp);
+
+ex:
+	if (filedata != MAP_FAILED) munmap((void*)filedata, length_mapped);
+	if (fh>=0)
+	{
+		close(fh);
+		cs___count(!link_hit, link_hit, read, holes);
+	}
+	IF_FREE(buffer);
+	cs__free_manber_hashes(&mbh_data);
+
+	return status;
+}
+
+
+/** -.
+ * If the file was unreadable \a *result stays at \c -1 (<i>don't 
+ * know</i>), and estat::change_flag is not set. */
+int cs__compare_finish(struct cs__compare_t *cmp, struct estat *sts, 
+		int *result)
+{
+	if (!cmp->unreadable)
+	{
+		memcpy(sts->md5, cmp->md5, sizeof(sts->md5));
+
+		sts->change_flag = (!cmp->block_changed &&
+				memcmp(cmp->old_md5, sts->md5, sizeof(sts->md5)) == 0) ?
+			CF_NOTCHANGED : CF_CHANGED;
+		DEBUGP("change flag for %s set to %d", cmp->path, sts->change_flag);
+
+		if (result)
+			*result = sts->change_flag == CF_CHANGED;
+	}
+
+	IF_FREE(cmp->md5s_path);
+	return 0;
+}
+
+
 /** 
  * -.
  * \param sts Which entry to check
@@ -293,24 +1726,17 @@ ex:
  * As a special case this function returns \c &lt;0 for <i>don't know</i> 
  * if the file is unreadable due to a \c EACCESS.
  *
- * \note Performance optimization
- * In normal circumstances not the whole file has to be read to get the 
- * result. On update a checksum is written for each manber-block of about 
- * 128k (but see \ref CS__APPROX_BLOCKSIZE_BITS); as soon as one is seen as 
- * changed the verification is stopped.
+ * For regular files the work is done by cs__compare_init(), 
+ * cs__compare_data() and cs__compare_finish(); these can be used 
+ * separately to do the hashing in another thread.
  * */
 int cs__compare_file(struct estat *sts, char *fullpath, int *result)
 {
-	int i, status, fh;
-	unsigned length_mapped, map_pos, hash_pos;
-	off_t current_pos;
-	struct cs__manber_hashes mbh_data;
-	unsigned char *filedata;
-	int do_manber;
+	int status;
 	char *cp;
 	struct sstat_t actual;
+	struct cs__compare_t cmp;
 	md5_digest_t old_md5 = { 0 };
-	static struct t_manber_data mb_dat;
 
 
 	/* Default is "don't know". */
@@ -319,7 +1745,7 @@ int cs__compare_file(struct estat *sts, char *fullpath, int *result)
 	 * they're different, this entry was replaced, and we never get here.  */
 	if (S_ISDIR(sts->st.mode)) return 0;
 
-	fh=-1;
+	cmp.md5s_path=NULL;
 	/* hash already done? */
 	if (sts->change_flag != CF_UNKNOWN)
 	{
@@ -338,147 +1764,37 @@ int cs__compare_file(struct estat *sts, char *fullpath, int *result)
 	memcpy(old_md5, sts->md5, sizeof(old_md5));
 
 	/* We'll open and read the file now, so the additional lstat() doesn't 
-	 * really hurt - and it makes sure that we see the current values (or at 
-	 * least the _current_ ones :-). */
-	STOPIF( hlp__lstat(fullpath, &actual), NULL);
-
-	if (S_ISREG(actual.mode))
-	{
-		do_manber=1;
-		/* Open the file and read the stream from there, comparing the blocks
-		 * as necessary.
-		 * If a difference is found, stop, and mark file as different. */
-		/* If this call returns ENOENT, this entry simply has no md5s-file.
-		 * We'll have to MD5 it completely. */
-		if (actual.size < CS__MIN_FILE_SIZE)
-			do_manber=0;
-		else
-		{
-			status=cs__read_manber_hashes(sts, &mbh_data);
-			if (status == ENOENT)
-				do_manber=0;
-			else 
-				STOPIF(status, "reading manber-hash data for %s", fullpath);
-		}
-
-		hash_pos=0;
-		STOPIF( cs___manber_data_init(&mb_dat, sts), NULL );
-
-		/* We map windows of the file into main memory. Never more than 256MB. */
-		current_pos=0;
-
-		fh=open(fullpath, O_RDONLY);
-		/* We allow a single special case on error handling: EACCES, which 
-		 * could simply mean that the file has mode 000. */
-		if (fh<0)
-		{
-			/* The debug statement might change errno, so we have to save the 
-			 * value.  */
-			status=errno;
-			DEBUGP("File %s is unreadable: %d", fullpath, status);
-			if (status == EACCES) 
-			{
-				status=0;
-				goto ex;
-			}
-
-			/* Can that happen? */
-			if (!status) status=EBUSY;
-			STOPIF(status, "open(\"%s\", O_RDONLY) failed", fullpath);
-		}
-
-		status=0;
-		while (current_pos < actual.size)
-		{
-			if (actual.size-current_pos < MAPSIZE)
-				length_mapped=actual.size-current_pos;
-			else
-				length_mapped=MAPSIZE;
-			DEBUGP("mapping %u bytes from %llu", 
-					length_mapped, (t_ull)current_pos); 
-
-			filedata=mmap(NULL, length_mapped, 
-					PROT_READ, MAP_SHARED, 
-					fh, current_pos);
-			STOPIF_CODE_ERR( filedata == MAP_FAILED, errno,
-					"comparing the file %s failed (mmap)",
-					fullpath);
-
-			map_pos=0;
-			while (map_pos<length_mapped)
-			{
-				STOPIF( cs___end_of_block(filedata+map_pos,
-							length_mapped-map_pos, 
-							&i, &mb_dat ),
-						NULL);
-
-				if (i==-1) break;
-
-				if (do_manber)
-				{
-					DEBUGP("  old hash=%08X  current hash=%08X", 
-							mbh_data.hash[hash_pos], mb_dat.last_state);
-					DEBUGP("  old end=%llu  current end=%llu", 
-							(t_ull)mbh_data.end[hash_pos], 
-							(t_ull)mb_dat.fpos);
-					DEBUGP("  old md5=%s  current md5=%s", 
-							cs__md5tohex_buffered(mbh_data.md5[hash_pos]),
-							cs__md5tohex_buffered(mb_dat.block_md5));
-
-					if (mb_dat.last_state != mbh_data.hash[hash_pos] ||
-							mb_dat.fpos != mbh_data.end[hash_pos] ||
-							memcmp(mb_dat.block_md5, 
-								mbh_data.md5[hash_pos], 
-								APR_MD5_DIGESTSIZE) != 0)
-					{
-						DEBUGP("found a different block before %llu:", 
-								(t_ull)(current_pos+i));
-changed:
-						sts->md5[0] ^= 0x1;
-						i=-2;
-						break;
-					}
-
-
-					DEBUGP("block #%u ok...", hash_pos);
-					hash_pos++;
-					/* If this gets true (which it should never), we must not
-					 * print the hash values etc. ... The index [hash_pos] is outside
-					 * the array boundaries. */
-					if (hash_pos > mbh_data.count)
-						goto changed;
-				}
-
-				/* We have to reset the blocks even if we have no manber hashes ...  
-				 * so the eg. data_bits value gets reset. */
-				STOPIF( cs___end_of_block(NULL, 0, NULL, &mb_dat), NULL );
-
-				map_pos+=i;
-			}
-
-			STOPIF_CODE_ERR( munmap((void*)filedata, length_mapped) == -1,
-					errno, "unmapping of file failed");
-			current_pos+=length_mapped;
-
-			if (i==-2) break;
-		}
+	 * really hurt - and it makes sure that we see the current values (or at 
+	 * least the _current_ ones :-). */
+	STOPIF( hlp__lstat(fullpath, &actual), NULL);
 
-		STOPIF( cs___finish_manber( &mb_dat), NULL);
-	}
-	else if (S_ISLNK(sts->st.mode))
+	if (S_ISREG(actual.mode))
 	{
-		STOPIF( ops__link_to_string(sts, fullpath, &cp), NULL);
+		STOPIF( cs__compare_init(&cmp, sts, fullpath, actual.size), NULL);
+		STOPIF( cs__compare_data(&cmp), NULL);
+		/* We allow a single special case on error handling: EACCES, which 
+		 * could simply mean that the file has mode 000. */
+		if (cmp.unreadable) goto ex;
 
-		apr_md5(sts->md5, cp, strlen(cp));
+		STOPIF( cs__compare_finish(&cmp, sts, result), NULL);
 	}
 	else
 	{
-		DEBUGP("nothing to hash for %s", fullpath);
-	}
+		if (S_ISLNK(sts->st.mode))
+		{
+			STOPIF( ops__link_to_string(sts, fullpath, &cp), NULL);
+
+			apr_md5(sts->md5, cp, strlen(cp));
+		}
+		else
+		{
+			DEBUGP("nothing to hash for %s", fullpath);
+		}
 
-	sts->change_flag = memcmp(old_md5, sts->md5, sizeof(sts->md5)) == 0 ?
-		CF_NOTCHANGED : CF_CHANGED;
-	DEBUGP("change flag for %s set to %d", fullpath, sts->change_flag);
+		sts->change_flag = memcmp(old_md5, sts->md5, sizeof(sts->md5)) == 0 ?
+			CF_NOTCHANGED : CF_CHANGED;
+		DEBUGP("change flag for %s set to %d", fullpath, sts->change_flag);
+	}
 
 
 ret_result:
@@ -490,7 +1806,7 @@ ret_result:
 	status=0;
 
 ex:
-	if (fh>=0) close(fh);
+	IF_FREE(cmp.md5s_path);
 
 	return status;
 }
@@ -526,10 +1842,12 @@ int cs___manber_data_init(struct t_manber_data *mbd,
 {
 	int status;
 
+	/* Every user has its own structure, so there's no "in use" check. */
 	memset(mbd, 0, sizeof(*mbd));
 	mbd->manber_fd=-1;
+	mbd->border_md5.pos=(uint64_t)-1;
+	cs___xxh64_init(& mbd->fast);
 
-	BUG_ON(mbd->sts, "manber structure already in use!");
 	mbd->sts=sts;
 	mbd->fpos= mbd->last_fpos= 0;
 	apr_md5_init(& mbd->full_md5_ctx);
@@ -540,24 +1858,6 @@ ex:
 }
 
 
-void cs___manber_init(struct t_manber_parms *mb_d)
-{
-	int i;
-	uint32_t p;
-
-	if (mb_d->values[0]) return;
-
-	/* Calculate the CS__MANBER_BACKTRACK power of the prime */
-	/* TODO: speedup like done in RSA - log2(power) */
-	for(p=1,i=0; i<CS__MANBER_BACKTRACK; i++)
-		p=(p * CS__MANBER_PRIME) & CS__MANBER_MODULUS;
-
-	/* Precalculate for all 8bit values */
-	for(i=0x00; i<0xff; i++)
-		mb_d->values[i]=(i*p) & CS__MANBER_MODULUS;
-}
-
-
 /* This function finds the position which 
  *
  *   a b c d e f g h i j k l m n
@@ -567,56 +1867,45 @@ void cs___manber_init(struct t_manber_parms *mb_d)
  *
  * If the whole data buffer belongs to the current block -1 is returned
  * in *eob.
+ *
+ * The borders are found by the functions in cdc.c; here the zero blocks 
+ * and the MD5s are done.
  * */
 int cs___end_of_block(const unsigned char *data, int maxlen, 
 		int *eob, 
 		struct t_manber_data *mb_f)
 {
 	int status;
-	int i;
+	int i, border, start;
 
 
 	status=0;
 	if (!data)
 	{
 		DEBUGP("manber reinit");
-		mb_f->state=0;
-		mb_f->last_state=0;
-		mb_f->bktrk_bytes=0;
-		mb_f->bktrk_last=0;
+		cdc__manber_reset(& mb_f->mnb);
+		cdc__gear_reset(& mb_f->gear);
 		mb_f->data_bits=0;
 		apr_md5_init(& mb_f->block_md5_ctx);
 		memset(mb_f->block_md5, 0, sizeof(mb_f->block_md5));
-		cs___manber_init(&manber_parms);
+		cdc__init();
 		goto ex;
 	}
 
 
 	*eob = -1;
-	i=0;
 	/* If we haven't had at least this many bytes in the current block,
-	 * read up to this amount. */
-	while (i<maxlen &&
-			mb_f->bktrk_bytes < CS__MANBER_BACKTRACK)
-	{
-		/* In this initialization, we simply \c OR the bytes together.
-		 * On block end detection we see if this is at least a
-		 * \c CS__MANBER_BACKTRACK bytes long zero-byte block. */
-		mb_f->data_bits |= data[i];
-
-		mb_f->state = (mb_f->state * CS__MANBER_PRIME +
-				data[i] ) % CS__MANBER_MODULUS;
-		mb_f->backtrack[ mb_f->bktrk_last ] = data[i];
-		/* The reason why CS__MANBER_BACKTRACK must be a power of 2:
-		 * bitwise-AND is much faster than a modulo.
-		 * In this loop the & is redundant - in a new block we should
-		 * start from bktrk_last==0, but the AND is only 1 or 2 cycles,
-		 * and we hope that gcc optimizes that. */
-		mb_f->bktrk_last = ( mb_f->bktrk_last + 1 ) & 
-			(CS__MANBER_BACKTRACK - 1);
-		mb_f->bktrk_bytes++;
-		i++;
+	 * read up to this amount; then i is either maxlen, or a border may 
+	 * follow. */
+	if (mb_f->chunker == CDC__GEAR)
+	{
+		i=cdc__gear_fill(& mb_f->gear, data, maxlen, & mb_f->data_bits);
+		/* Always hashed; a zero block gets a zero MD5 nonetheless, so the 
+		 * result doesn't depend on how the data is split up. */
+		apr_md5_update(& mb_f->block_md5_ctx, data, i);
 	}
+	else
+		i=cdc__manber_fill(& mb_f->mnb, data, maxlen, & mb_f->data_bits);
 
 	if (!mb_f->data_bits)
 	{
@@ -631,67 +1920,277 @@ int cs___end_of_block(const unsigned char *data, int maxlen,
 			DEBUGP("zero block border at %d", i);
 		}
 	}
-	else
+	else if (mb_f->chunker == CDC__GEAR)
 	{
-		while(i<maxlen)
+		start=i;
+		i+=cdc__gear_roll(& mb_f->gear, data+i, maxlen-i, &border);
+		apr_md5_update(& mb_f->block_md5_ctx, data+start, i-start);
+		if (border)
 		{
-			/* ->last_state gets the previous CRC, and this gets stored.
-			 * This is because the ->state has, on a block border, a lot of
-			 * zeroes (per definition); so we store the previous value, which
-			 * may be better suited for comparison. If the blocks are equal 
-			 * up to byte N, they're equal up to N-1, too. */
-			/* This need not be calculated in the previous loop, as we do no
-			 * border-checking there. Only here, in this loop, 
-			 * is the value needed. */
-			mb_f->last_state=mb_f->state;
-			mb_f->state = (mb_f->state*CS__MANBER_PRIME + data[i] -
-					manber_parms.values[ mb_f->backtrack[ mb_f->bktrk_last ] ] ) 
-				% CS__MANBER_MODULUS;
-			mb_f->backtrack[ mb_f->bktrk_last ] = data[i];
-			mb_f->bktrk_last = ( mb_f->bktrk_last + 1 ) & 
-				(CS__MANBER_BACKTRACK - 1);
-			/* This value has already been used. */
-			i++;
-
-			/* special value ? */
-			if ( !(mb_f->state & CS__MANBER_BITMASK) )
-			{
-				*eob=i;
-				apr_md5_update(& mb_f->block_md5_ctx, data, i);
-				apr_md5_final( mb_f->block_md5, & mb_f->block_md5_ctx);
-				DEBUGP("manber found a border: %u %08X %08X %s", 
-						i, mb_f->last_state, mb_f->state, cs__md5tohex_buffered(mb_f->block_md5));
-				break;
-			}
+			*eob=i;
+			apr_md5_final( mb_f->block_md5, & mb_f->block_md5_ctx);
+			DEBUGP("gear found a border: %u %016llX %s", 
+					i, (t_ull)mb_f->gear.hash,
+					cs__md5tohex_buffered(mb_f->block_md5));
 		}
-
+	}
+	else
+	{
+		i+=cdc__manber_roll(& mb_f->mnb, data+i, maxlen-i, &border);
 		/* Update md5 up to current byte. */
-		if (*eob == -1)
-			apr_md5_update(& mb_f->block_md5_ctx, data, i);
+		apr_md5_update(& mb_f->block_md5_ctx, data, i);
+		if (border)
+		{
+			*eob=i;
+			apr_md5_final( mb_f->block_md5, & mb_f->block_md5_ctx);
+			DEBUGP("manber found a border: %u %08X %08X %s", 
+					i, mb_f->mnb.last_state, mb_f->mnb.state, 
+					cs__md5tohex_buffered(mb_f->block_md5));
+		}
 	}
 
 	/* Update file global information */
-	apr_md5_update(& mb_f->full_md5_ctx, data, i);
+	if (!mb_f->no_full_md5)
+		apr_md5_update(& mb_f->full_md5_ctx, data, i);
 	mb_f->fpos += (*eob == -1) ? maxlen : *eob;
 
 ex:
-	DEBUGP("on return at fpos=%llu: %08X (databits=%2x)", 
-			(t_ull)mb_f->fpos, mb_f->state, mb_f->data_bits);
+	DEBUGP("on return at fpos=%llu: %016llX (databits=%2x)", 
+			(t_ull)mb_f->fpos, (t_ull)cs___hash64(mb_f, 1), mb_f->data_bits);
 	return status;
 }
 
 
-int cs___update_manber(struct t_manber_data *mb_f,
-		const unsigned char *data, apr_size_t len)
+/** Opens the \ref md5s file for writing, and writes the header if it's 
+ * in the binary format. */
+static int cs___open_md5s(struct t_manber_data *mb_f)
+{
+	int status;
+	char *filename;
+	struct cs__md5s_head_t head;
+
+
+	status=0;
+	STOPIF( ops__build_path(&filename, mb_f->sts), NULL);
+	STOPIF( waa__open_byext(filename, WAA__FILE_MD5s_EXT, WAA__WRITE,
+				&mb_f->manber_fd), NULL );
+	DEBUGP("now doing manber-hashing for %s...", filename);
+
+	if (mb_f->binary)
+	{
+		memset(&head, 0, sizeof(head));
+		memcpy(head.magic, CS__MD5S_MAGIC, sizeof(head.magic));
+		head.version=CS__MD5S_VERSION;
+		head.byte_order=WAA_BYTE_ORDER;
+		head.record_size=sizeof(struct cs__md5s_record_t);
+		head.blocksize_bits=CS__APPROX_BLOCKSIZE_BITS;
+		head.chunker=mb_f->chunker;
+		if (mb_f->chunker == CDC__MANBER)
+		{
+			head.prime=CS__MANBER_PRIME;
+			head.backtrack=CS__MANBER_BACKTRACK;
+		}
+		/* Known only at the end, see cs___mnbs_close(). */
+		head.border_md5.pos=(uint64_t)-1;
+		STOPIF_CODE_ERR( write( mb_f->manber_fd, &head, sizeof(head)) != 
+				sizeof(head), errno, "writing to manber hash file");
+	}
+
+ex:
+	return status;
+}
+
+
+/** Writes the line resp. record for a block into the \ref md5s file, 
+ * opening it if necessary. */
+static int cs___write_block(struct t_manber_data *mb_f, uint64_t hash,
+		off_t start, off_t end, const md5_digest_t md5)
 {
 	int status;
-	int eob, i;
+	int i;
 	/* MD5 as hex (constant-length), 
 	 * state as hex (constant-length),
 	 * offset of block, length of block, 
 	 * \n, \0, reserve */
 	char buffer[MANBER_LINELEN+10];
-	char *filename;
+	struct cs__md5s_record_t *rec;
+
+
+	status=0;
+	if (mb_f->binary)
+	{
+		BUG_ON(sizeof(*rec) > sizeof(buffer));
+		rec=(struct cs__md5s_record_t*)buffer;
+		memset(rec, 0, sizeof(*rec));
+		rec->hash=hash;
+		rec->end=end;
+		memcpy(rec->md5, md5, sizeof(rec->md5));
+		i=sizeof(*rec);
+	}
+	else
+	{
+		i=sprintf(buffer, cs___mb_wr_format, 
+				cs__md5tohex_buffered(md5),
+				(uint32_t)hash,
+				(t_ull)start, 
+				(t_ull)(end - start));
+		BUG_ON(i > sizeof(buffer)-3, "Buffer too small - stack overrun");
+	}
+
+	/* The file is opened only when the first block is known; small files 
+	 * don't get one. */
+	if (mb_f->manber_fd == -1)
+		STOPIF( cs___open_md5s(mb_f), NULL);
+
+	STOPIF_CODE_ERR( write( mb_f->manber_fd, buffer, i) != i,
+			errno, "writing to manber hash file");
+
+ex:
+	return status;
+}
+
+
+/** Adds the data from \a pos to \a end of the file \a fh to \a ctx. */
+static int cs___md5_range(int fh, off_t pos, off_t end, 
+		apr_md5_ctx_t *ctx, unsigned char *buffer)
+{
+	int status;
+	ssize_t len;
+
+
+	status=0;
+	while (pos < end)
+	{
+		len=end-pos;
+		if (len > CS___PAR_READSIZE) len=CS___PAR_READSIZE;
+		len=pread(fh, buffer, len, pos);
+		STOPIF_CODE_ERR( len <= 0, len ? errno : EIO,
+				"reading at %llu", (t_ull)pos);
+
+		apr_md5_update(ctx, buffer, len);
+		pos+=len;
+	}
+
+ex:
+	return status;
+}
+
+
+/** The data is different from the previous version; so the \ref md5s 
+ * file is written anew, and the full-file MD5 is calculated for the data 
+ * that was only compared by blocks.
+ *
+ * The blocks that were the same are taken from the previous version. */
+static int cs___append_fail(struct t_manber_data *mb_f)
+{
+	int status;
+	int fh;
+	unsigned i;
+	off_t border;
+	unsigned char *buffer;
+	struct cs__manber_hashes *old=&mb_f->old;
+
+
+	status=0;
+	fh=-1;
+	buffer=NULL;
+	DEBUGP("different to the old version at block %u", mb_f->old_pos);
+	mb_f->verifying=0;
+	mb_f->no_full_md5=0;
+
+	STOPIF( hlp__alloc( &buffer, CS___PAR_READSIZE), NULL);
+	fh=open(mb_f->local_path, O_RDONLY);
+	STOPIF_CODE_ERR( fh == -1, errno, "re-reading %s", mb_f->local_path);
+
+	border= mb_f->old_pos ? old->end[mb_f->old_pos-1] : 0;
+	STOPIF( cs___md5_range(fh, 0, border, 
+				& mb_f->full_md5_ctx, buffer), NULL);
+	if (mb_f->binary)
+		cs___md5_save(& mb_f->full_md5_ctx, border, & mb_f->border_md5);
+	STOPIF( cs___md5_range(fh, border, mb_f->fpos, 
+				& mb_f->full_md5_ctx, buffer), NULL);
+
+	for(i=0; i<mb_f->old_pos; i++)
+		STOPIF( cs___write_block(mb_f, old->hash[i], 
+					i ? old->end[i-1] : 0, old->end[i], old->md5[i]), NULL);
+
+ex:
+	if (fh != -1) close(fh);
+	IF_FREE(buffer);
+	return status;
+}
+
+
+/** Compares the block that just ended with the next one of the previous 
+ * version; see \ref md5s_append.
+ *
+ * \a *same is set if it's equal; then it mustn't be written. */
+static int cs___append_border(struct t_manber_data *mb_f, int *same)
+{
+	int status;
+	int fd;
+	off_t pos;
+	unsigned k;
+	char *filename, *md5s;
+	struct cs__manber_hashes *old=&mb_f->old;
+	struct cs__md5s_midstate_t invalid;
+
+
+	status=0;
+	md5s=NULL;
+	k=mb_f->old_pos;
+	*same= k < old->count &&
+		old->end[k] == mb_f->fpos &&
+		old->hash[k] == cs___hash64(mb_f, 0) &&
+		memcmp(old->md5[k], mb_f->block_md5, sizeof(old->md5[k])) == 0;
+
+	if (!*same)
+	{
+		STOPIF( cs___append_fail(mb_f), NULL);
+		goto ex;
+	}
+
+	mb_f->old_pos++;
+	if (mb_f->old_pos < old->count) goto ex;
+
+
+	/* All the old blocks are still there; only new ones will follow. */
+	DEBUGP("appending to the md5s file");
+	cs___md5_restore(& old->midstate, & mb_f->full_md5_ctx);
+	mb_f->border_md5=old->midstate;
+	mb_f->no_full_md5=0;
+	mb_f->verifying=0;
+
+	STOPIF( ops__build_path(&filename, mb_f->sts), NULL);
+	STOPIF( waa__get_byext_path(filename, WAA__FILE_MD5s_EXT, &md5s), NULL);
+	fd=open(md5s, O_WRONLY);
+	STOPIF_CODE_ERR( fd == -1, errno, "opening %s", md5s);
+	mb_f->manber_fd=fd;
+	mb_f->in_place=1;
+
+	/* Until the end is written, the stored state isn't valid; and the old 
+	 * tail record gets replaced. */
+	memset(&invalid, 0, sizeof(invalid));
+	invalid.pos=(uint64_t)-1;
+	pos=sizeof(struct cs__md5s_head_t) + 
+		old->count*sizeof(struct cs__md5s_record_t);
+	STOPIF_CODE_ERR( pwrite(fd, &invalid, sizeof(invalid), 
+				offsetof(struct cs__md5s_head_t, border_md5)) != sizeof(invalid) ||
+			ftruncate(fd, pos) == -1 ||
+			lseek(fd, pos, SEEK_SET) != pos, 
+			errno, "truncating %s", md5s);
+
+ex:
+	IF_FREE(md5s);
+	return status;
+}
+
+
+int cs___update_manber(struct t_manber_data *mb_f,
+		const unsigned char *data, apr_size_t len)
+{
+	int status;
+	int eob, same;
 
 	status=0;
 	/* We tried to avoid doing this calculation for small files.
@@ -714,6 +2213,7 @@ int cs___update_manber(struct t_manber_data *mb_f,
 	 * As we now check on end-of-stream for the size and remove the file if
 	 * necessary, this is currently deactivated. */
 	DEBUGP("got a block with %llu bytes", (t_ull)len);
+	cs___xxh64_update(& mb_f->fast, data, len);
 	while (1)
 	{
 #if 0
@@ -737,28 +2237,21 @@ int cs___update_manber(struct t_manber_data *mb_f,
 				(unsigned long)(mb_f->fpos - mb_f->last_fpos),
 				eob);
 
-		/* write new line to data file */
-		i=sprintf(buffer, cs___mb_wr_format, 
-				cs__md5tohex_buffered(mb_f->block_md5),
-				mb_f->last_state,
-				(t_ull)mb_f->last_fpos, 
-				(t_ull)(mb_f->fpos - mb_f->last_fpos));
-		BUG_ON(i > sizeof(buffer)-3, "Buffer too small - stack overrun");
+		same=0;
+		if (mb_f->verifying)
+			STOPIF( cs___append_border(mb_f, &same), NULL);
 
-		if (mb_f->manber_fd == -1)
+		/* write new line to data file */
+		if (!same)
 		{
-			/* The file has not been opened yet.
-			 * Do it now.
-			 * */
-			STOPIF( ops__build_path(&filename, mb_f->sts), NULL);
-			STOPIF( waa__open_byext(filename, WAA__FILE_MD5s_EXT, WAA__WRITE,
-						&	cs___manber.manber_fd), NULL );
-			DEBUGP("now doing manber-hashing for %s...", filename);
+			STOPIF( cs___write_block(mb_f, 
+						mb_f->binary ? cs___hash64(mb_f, 0) : mb_f->mnb.last_state,
+						mb_f->last_fpos, mb_f->fpos, mb_f->block_md5), NULL);
+			if (mb_f->binary)
+				cs___md5_save(& mb_f->full_md5_ctx, mb_f->fpos, 
+						& mb_f->border_md5);
 		}
 
-		STOPIF_CODE_ERR( write( mb_f->manber_fd, buffer, i) != i,
-				errno, "writing to manber hash file");
-
 		/* re-init manber state */
 		STOPIF( cs___end_of_block(NULL, 0, NULL, mb_f), NULL );
 		mb_f->last_fpos = mb_f->fpos;
@@ -769,6 +2262,31 @@ ex:
 }
 
 
+/** Writes the record for the data after the last border into a binary 
+ * \ref md5s file; see \ref md5s_last.
+ * A tail with only zeroes gets a zero MD5, like a zero block. */
+static int cs___write_tail(struct t_manber_data *mb_f)
+{
+	int status;
+	struct cs__md5s_record_t rec;
+
+
+	status=0;
+	memset(&rec, 0, sizeof(rec));
+	rec.hash=cs___hash64(mb_f, 1);
+	rec.end=mb_f->fpos;
+	if (mb_f->data_bits)
+		STOPIF( apr_md5_final(rec.md5, & mb_f->block_md5_ctx),
+				"apr_md5_final failed");
+
+	STOPIF_CODE_ERR( write( mb_f->manber_fd, &rec, sizeof(rec)) != 
+			sizeof(rec), errno, "writing to manber hash file");
+
+ex:
+	return status;
+}
+
+
 svn_error_t *cs___mnbs_close(void *baton);
 
 
@@ -784,7 +2302,10 @@ svn_error_t *cs___mnbs_read(void *baton,
 	STOPIF_SVNERR( svn_stream_read,
 			(mb_f->input, data, len) );
 	if (*len && data)
+	{
+		cs___throttle(*len);
 		STOPIF( cs___update_manber(mb_f, (unsigned char*)data, *len), NULL);
+	}
 	else
 		STOPIF_SVNERR( cs___mnbs_close, (baton));
 ex:
@@ -807,7 +2328,10 @@ svn_error_t *cs___mnbs_write(void *baton,
 	STOPIF_SVNERR( svn_stream_write,
 			(mb_f->input, data, len) );
 	if (*len && data)
+	{
+		cs___throttle(*len);
 		STOPIF( cs___update_manber(mb_f, (unsigned char*)data, *len), NULL);
+	}
 	else
 		STOPIF_SVNERR( cs___mnbs_close, (baton));
 ex:
@@ -817,22 +2341,53 @@ ex:
 
 svn_error_t *cs___mnbs_close(void *baton)
 {
-	int status;
+	int status, i;
 	svn_error_t *status_svn;
 	struct t_manber_data *mb_f=baton;
+	struct cs__md5s_head_t head;
 
 	status=0;
 
 	/* If there have been less than CS__MIN_FILE_SIZE bytes, we
 	 * don't keep that file. */
+	/* The file got shorter, or is the same up to the tail. */
+	if (mb_f->verifying)
+		STOPIF( cs___append_fail(mb_f), NULL);
+
 	if (mb_f->manber_fd != -1)
 	{
-		STOPIF( waa__close(mb_f->manber_fd, 
-					mb_f->fpos < CS__MIN_FILE_SIZE ? ECANCELED : 
-					status != 0), NULL );
+		if (mb_f->binary)
+		{
+			STOPIF( cs___write_tail(mb_f), NULL);
+			STOPIF_CODE_ERR( pwrite(mb_f->manber_fd, & mb_f->border_md5, 
+						sizeof(mb_f->border_md5), 
+						offsetof(struct cs__md5s_head_t, border_md5)) != 
+					sizeof(mb_f->border_md5),
+					errno, "writing to manber hash file");
+
+			/* The fast hash and its flag are next to each other. */
+			memset(&head, 0, sizeof(head));
+			head.fast_hash=cs___xxh64_digest(& mb_f->fast);
+			head.has_fast_hash=1;
+			i=offsetof(struct cs__md5s_head_t, chunker) - 
+				offsetof(struct cs__md5s_head_t, fast_hash);
+			STOPIF_CODE_ERR( pwrite(mb_f->manber_fd, & head.fast_hash, i,
+						offsetof(struct cs__md5s_head_t, fast_hash)) != i,
+					errno, "writing to manber hash file");
+		}
+
+		if (mb_f->in_place)
+			STOPIF_CODE_ERR( close(mb_f->manber_fd) == -1, errno,
+					"closing manber hash file");
+		else
+			STOPIF( waa__close(mb_f->manber_fd, 
+						mb_f->fpos < CS__MIN_FILE_SIZE ? ECANCELED : 
+						status != 0), NULL );
 		mb_f->manber_fd=-1;
 	}
 
+	cs__free_manber_hashes(& mb_f->old);
+
 	if (mb_f->input)
 	{
 		STOPIF_SVNERR( svn_stream_close,
@@ -852,6 +2407,12 @@ ex:
  * manber-hash data (see \ref md5s) on the fly. 
  *
  * \note
+ * If the data is read from the local file \a local_path, and there's a 
+ * binary \ref md5s file for it, the blocks are compared to the stored 
+ * ones, so that a file that was only appended to needs just the new data 
+ * hashed; see \ref md5s_append.
+ *
+ * \note
  * We currently give the caller no chance to say whether he wants the
  * full MD5 or not.
  * If we ever need to let him decide, he must either 
@@ -859,7 +2420,7 @@ ex:
  * - or (better!) says where the MD5 should be stored - this pointer
  *   would replace \c mb_f->full_md5 .
  *   */
-int cs__new_manber_filter(struct estat *sts,
+int cs__new_manber_filter(struct estat *sts, const char *local_path,
 		svn_stream_t *stream_input, 
 		svn_stream_t **filter_stream,
 		apr_pool_t *pool)
@@ -867,15 +2428,44 @@ int cs__new_manber_filter(struct estat *sts,
 	int status;
 	svn_stream_t *new_str;
 	char *filename;
+	struct t_manber_data *mb_f;
 
 
 	status=0;
-	STOPIF( cs___manber_data_init(&cs___manber, sts),
+	/* The context lives as long as the stream. */
+	mb_f=apr_palloc(pool, sizeof(*mb_f));
+	STOPIF_ENOMEM( !mb_f );
+
+	STOPIF( cs___manber_data_init(mb_f, sts),
 			"manber-data-init failed");
 
-	cs___manber.input=stream_input;
+	mb_f->input=stream_input;
+	/* Older versions can only read the text format. */
+	mb_f->binary= opt__get_int(OPT__DIR_FORMAT) == DIR_FORMAT_BINARY;
+	/* The text format has no place to say which one is used. */
+	mb_f->chunker= mb_f->binary ? CDC__GEAR : CDC__MANBER;
+
+	if (mb_f->binary && local_path)
+	{
+		status=cs__read_manber_hashes(sts, & mb_f->old);
+		if (status == ENOENT)
+			status=0;
+		STOPIF( status, NULL);
+
+		if (mb_f->old.has_midstate && mb_f->old.count)
+		{
+			mb_f->local_path=apr_pstrdup(pool, local_path);
+			STOPIF_ENOMEM( !mb_f->local_path );
+			mb_f->verifying=1;
+			mb_f->no_full_md5=1;
+			/* The blocks have to be the same. */
+			mb_f->chunker=mb_f->old.chunker;
+		}
+		else
+			cs__free_manber_hashes(& mb_f->old);
+	}
 
-	new_str=svn_stream_create(&cs___manber, pool);
+	new_str=svn_stream_create(mb_f, pool);
 	STOPIF_ENOMEM( !new_str );
 
 	svn_stream_set_read(new_str, cs___mnbs_read);
@@ -945,15 +2535,11 @@ ex:
  * will lead to 2MB read - and on average we'll find a difference after
  * 2GB more reading. 
  * 
- * A better way than read()/lseek() would be mmap of binary files. 
- * But that wouldn't allow to have the data compressed. 
- * I don't know if that matters; the 1TB file has
- * 8M lines * 60 Bytes => 480MB on ASCII-data.
- *
- * If we assume that the CRCs and lengths can be compressed away,
- * we still need the offsets and MD5s, so we would still end with 
- * 8M * 24 Bytes, ie. at least 196MB.
- * I don't think that's a necessity. 
+ * The file is \c mmap()ed now; the text format is parsed from memory, 
+ * and the binary format (see struct \ref cs__md5s_head_t; written if \ref 
+ * o_dir_format says so) has fixed-size records that are just copied. 
+ * The 1TB file has 8M lines * 60 Bytes => 480MB on ASCII-data, vs. 8M * 
+ * 32 Bytes => 256MB binary.
  *
  *
  * \section Hash-collisions on big files
@@ -965,12 +2551,76 @@ ex:
  * the second might be easier and better, esp. as files this big should
  * be on a 64bit platform, where a 64bit hash won't be slow.
  *
+ * So the binary format stores a 64bit rolling hash per block. (It uses 
+ * another function for the block borders, too, see \ref md5s_gear.)
  *
- * \section The last block
+ *
+ * \section md5s_last The last block
  *
  * The last block in a file ends per definition *not* on a manber-block-
- * border (or only per chance). This block is not written into the md5s file.
- * The data is verified by the full-file MD5 that we've been calculating.
+ * border (or only per chance). In the text format this block is not 
+ * written into the md5s file; the data is verified by the full-file MD5 
+ * that we've been calculating.
+ *
+ * The binary format has a record for it, too (possibly for 0 bytes); so 
+ * every byte of the file is covered by a block MD5, and the blocks can be 
+ * verified independently of each other, by several threads.
+ * If they all match, the full-file MD5 needn't be calculated.
+ *
+ *
+ * \section md5s_append Appended data
+ *
+ * Log files and similar only get data appended. The binary format stores 
+ * the state of the full-file MD5 at the last border in the header (struct 
+ * \ref cs__md5s_midstate_t); the manber hashing starts anew at each 
+ * border, so the calculation can be resumed there.
+ *
+ * On commit the data is compared block by block with the stored blocks; 
+ * while they're the same, only the block MD5s are calculated. If all 
+ * blocks are found, the MD5 state is taken from the header, and the new 
+ * blocks are appended to the existing \ref md5s file, replacing the old 
+ * tail record. Else the skipped data is read again for the full-file MD5, 
+ * and the file is written anew.
+ *
+ * When checking for changes a file that got bigger is changed anyway; if 
+ * its old blocks are still there (verified like in cs___par_verify()), 
+ * only the new data is hashed for the MD5.
+ *
+ * 
+ * \section md5s_fast Fast hash
+ *
+ * The binary format stores a fast hash of the whole file in the header; 
+ * it's calculated alongside whenever the \ref md5s file is written, and 
+ * can be used instead of the block MD5s to check for changes, see \ref 
+ * o_change_hash.
+ *
+ *
+ * \section md5s_gear Gear hash
+ *
+ * The manber hash needs a modulo and the backtrack buffer for every byte, 
+ * which gives only a few hundred MB per second and core; that's slower 
+ * than current disks.
+ *
+ * So the binary format uses a gear hash (like FastCDC), with the function 
+ * given in cs__md5s_head_t::chunker:
+ * - The hash is shifted left by one bit per byte, and a random 64bit 
+ *   value from a table is added for the byte; so it depends only on the 
+ *   last 64 bytes, and needs no backtrack buffer.
+ * - A border is where the upper \c CS__APPROX_BLOCKSIZE_BITS bits of the 
+ *   hash are zero; after the normal block size one bit less, so that the 
+ *   block sizes are closer together.
+ * - The first \c CS__GEAR_MIN_SIZE bytes of a block can't have a border; 
+ *   only the last 64 of them are hashed, the others are just checked for 
+ *   being zero (see the zero blocks in cs___end_of_block()).
+ * - A block ends at \c CS__GEAR_MAX_SIZE in any case.
+ *
+ * The functions are in cdc.c; \c dev/chunker-bench.c measures both of 
+ * them, and can be built via <tt>make dev/chunker-bench</tt>.
+ *
+ * The text format can't say which function was used, so it stays with 
+ * the manber hash. When appending to a binary file (see \ref 
+ * md5s_append) the blocks have to be the same, so the function in its 
+ * header is used again.
  *
  * \todo When we do a rsync-copy from the repository, we'll have to look at
  * that again! Either we write the last block too, or we'll have to ask for
@@ -987,36 +2637,173 @@ ex:
 int cs__read_manber_hashes(struct estat *sts, struct cs__manber_hashes *data)
 {
 	int status;
-	char *filename;
+	char *filename, *md5s;
+
+
+	md5s=NULL;
+	STOPIF( ops__build_path(&filename, sts), NULL);
+	STOPIF( waa__get_byext_path(filename, WAA__FILE_MD5s_EXT, &md5s), NULL);
+
+	/* It's ok if there's no md5s file. simply return ENOENT. */
+	status=cs__read_manber_file(md5s, data);
+	if (status == ENOENT) goto ex;
+	STOPIF( status, "reading md5s-file for %s", filename);
+
+ex:
+	IF_FREE(md5s);
+	return status;
+}
+
+
+/** -. */
+void cs__free_manber_hashes(struct cs__manber_hashes *data)
+{
+	IF_FREE(data->hash);
+	IF_FREE(data->md5);
+	IF_FREE(data->end);
+	IF_FREE(data->index);
+}
+
+
+/** Takes the blocks of a binary \ref md5s file, mapped at \a map.
+ * Files made with other manber parameters can't be used; \c ENOENT is 
+ * returned for them. */
+static int cs___read_md5s_binary(const char *filename, 
+		const char *map, t_ull length,
+		struct cs__manber_hashes *data)
+{
+	int status;
+	const struct cs__md5s_head_t *head;
+	const struct cs__md5s_record_t *rec;
+	unsigned count, i;
+	size_t head_len;
+
+
+	status=0;
+	head=(const struct cs__md5s_head_t*)map;
+	if (length < sizeof(*head) || head->version != CS__MD5S_VERSION)
+	{
+		DEBUGP("other version");
+		status=ENOENT;
+		goto ex;
+	}
+
+	head_len=sizeof(*head);
+	STOPIF_CODE_ERR( length <= head_len ||
+			head->byte_order != WAA_BYTE_ORDER ||
+			head->record_size != sizeof(*rec) ||
+			(length - head_len) % sizeof(*rec), EINVAL,
+			"md5s-file %s has an invalid header", filename);
+
+	data->chunker=head->chunker;
+	if (head->blocksize_bits != CS__APPROX_BLOCKSIZE_BITS ||
+			(data->chunker == CDC__MANBER ?
+			 (head->prime != CS__MANBER_PRIME ||
+				head->backtrack != CS__MANBER_BACKTRACK) :
+			 (data->chunker != CDC__GEAR || head->prime || head->backtrack)))
+	{
+		DEBUGP("other manber parameters");
+		status=ENOENT;
+		goto ex;
+	}
+
+	/* The last record is the tail, see \ref md5s_last; it's stored after 
+	 * the others, but not counted. */
+	count=(length - head_len) / sizeof(*rec) - 1;
+	DEBUGP("%u binary entries", count);
+
+	/* The data is copied into separate arrays, see \ref md5s_alloc. */
+	STOPIF( hlp__alloc( &data->hash, (count+1)*sizeof(*data->hash)), NULL);
+	STOPIF( hlp__alloc( & data->md5, (count+1)*sizeof( *data->md5)), NULL);
+	STOPIF( hlp__alloc( & data->end, (count+1)*sizeof( *data->end)), NULL);
+
+	rec=(const struct cs__md5s_record_t*)(map+head_len);
+	for(i=0; i<=count; i++, rec++)
+	{
+		data->hash[i]=rec->hash;
+		data->end[i]=rec->end;
+		memcpy(data->md5[i], rec->md5, sizeof(data->md5[i]));
+	}
+
+	data->count=count;
+	data->wide_hash=1;
+	data->has_tail=1;
+
+	/* The state is only valid if it was written after the last block. */
+	data->midstate=head->border_md5;
+	data->has_midstate= 
+		head->border_md5.pos == (count ? (uint64_t)data->end[count-1] : 0);
+
+	if (head->has_fast_hash)
+	{
+		data->has_fast_hash=1;
+		data->fast_hash=head->fast_hash;
+	}
+
+ex:
+	return status;
+}
+
+
+/** -.
+ * Doesn't use any static data, so it can be called from other threads.
+ *
+ * The file is \c mmap()ed, and either taken as binary (see struct \ref 
+ * cs__md5s_head_t), or parsed line by line in the old text format.
+ *
+ * \c ENOENT is returned without an error message. */
+int cs__read_manber_file(const char *filename, 
+		struct cs__manber_hashes *data)
+{
+	int status;
 	int fh, i, spp;
 	unsigned estimated, count;
-	t_ull length, start;
-	char buffer[MANBER_LINELEN+10], *cp;
+	t_ull length, start, len;
+	char buffer[MANBER_LINELEN+10], *cp, *map, *pos, *map_end;
 	uint32_t value;
 
 
 	status=0;
+	map=MAP_FAILED;
+	length=0;
 	memset(data, 0, sizeof(*data));
-	fh=-1;
 
-	STOPIF( ops__build_path(&filename, sts), NULL);
-	/* It's ok if there's no md5s file. simply return ENOENT. */
-	status=waa__open_byext(filename, WAA__FILE_MD5s_EXT, WAA__READ, &fh);
-	if (status == ENOENT) goto ex;
-	STOPIF( status, "reading md5s-file for %s", filename);
+	fh=open(filename, O_RDONLY);
+	if (fh == -1)
+	{
+		status=errno;
+		if (status == ENOENT) goto ex;
+		STOPIF( status, "reading md5s-file %s", filename);
+	}
 
 	DEBUGP("reading manber-hashes for %s", filename);
 
+	length=lseek(fh, 0, SEEK_END);
+	STOPIF_CODE_ERR( length==(t_ull)-1, errno, 
+			"Cannot get length of file %s", filename);
+	if (!length) goto ex;
+
+	map=mmap(NULL, length, PROT_READ, MAP_SHARED, fh, 0);
+	STOPIF_CODE_ERR( map == MAP_FAILED, errno, 
+			"Cannot map file %s", filename);
+	map_end=map+length;
+
+	if (length >= offsetof(struct cs__md5s_head_t, byte_order) &&
+			memcmp(map, CS__MD5S_MAGIC, 
+				sizeof(((struct cs__md5s_head_t*)0)->magic)) == 0)
+	{
+		status=cs___read_md5s_binary(filename, map, length, data);
+		if (status == ENOENT) goto ex;
+		STOPIF( status, NULL);
+		goto ex;
+	}
+
+
 	/* We don't know in advance how many lines (i.e. manber-hashes)
 	 * there will be.
 	 * So we just interpolate from the file size and the (near-constant)
 	 * line-length and add a bit for good measure.
 	 * The rest is freed as soon as we've got all entries. */
-	length=lseek(fh, 0, SEEK_END);
-	STOPIF_CODE_ERR( length==-1, errno, 
-			"Cannot get length of file %s", filename);
-	STOPIF_CODE_ERR( lseek(fh, 0, SEEK_SET), errno, 
-			"Cannot seek in file %s", filename);
 	/* We add 5%; due to integer arithmetic the factors have to be separated */
 	estimated = length*21/(MANBER_LINELEN*20)+4;
 	DEBUGP("estimated %u manber-hashes from filelen %llu", 
@@ -1029,35 +2816,25 @@ int cs__read_manber_hashes(struct estat *sts, struct cs__manber_hashes *data)
 
 
 	count=0;
-	while (1)
+	pos=map;
+	while (pos < map_end)
 	{
-		i=read(fh, buffer, sizeof(buffer)-1);
-		STOPIF_CODE_ERR( i==-1, errno,
-				"reading manber-hash data");
-		if (i==0) break;
-
-		/* ensure strchr() stops */
-		buffer[i]=0;
-		cp=strchr(buffer, '\n');
-		STOPIF_CODE_ERR(!cp, EINVAL, 
+		cp=memchr(pos, '\n', map_end-pos);
+		STOPIF_CODE_ERR(!cp || cp-pos >= sizeof(buffer), EINVAL, 
 				"line %u is invalid", count+1 );
 
-		/* reposition to start of next line */
-		STOPIF_CODE_ERR( lseek(fh, 
-					-i								// start of this line
-					+ (cp-buffer)			// end of this line
-					+ 1,							// over \n
-					SEEK_CUR) == -1, errno, 
-				"lseek back failed");
-		*cp=0;
+		/* sscanf() needs a terminated string. */
+		memcpy(buffer, pos, cp-pos);
+		buffer[cp-pos]=0;
+		pos=cp+1;
 
 		i=sscanf(buffer, cs___mb_rd_format,
-				&spp, &value, &start, &length);
+				&spp, &value, &start, &len);
 		STOPIF_CODE_ERR( i != 3, EINVAL,
 				"cannot parse line %u for %s", count+1, filename);
 
 		data->hash[count]=value;
-		data->end[count]=start+length;
+		data->end[count]=start+len;
 		buffer[spp]=0;
 		STOPIF( cs__char2md5(buffer, NULL, data->md5[count]), NULL);
 		count++;
@@ -1080,15 +2857,12 @@ int cs__read_manber_hashes(struct estat *sts, struct cs__manber_hashes *data)
 
 ex:
 	if (status)
-	{
-		IF_FREE(data->hash);
-		IF_FREE(data->md5);
-		IF_FREE(data->end);
-	}
+		cs__free_manber_hashes(data);
 
+	if (map != MAP_FAILED)
+		munmap(map, length);
 	if (fh != -1)
 		STOPIF_CODE_ERR( close(fh) == -1, errno, 
 				"Cannot close manber hash file (fd=%d)", fh);
 	return status;
 }
-
@@ -11,18 +11,33 @@
 
 #include "global.h"
 #include "interface.h"
+#include "cdc.h"
 #include <subversion-1/svn_delta.h>
 
 /** \file
  * CRC, manber function header file. */
 
 
+/** The state of a MD5 calculation, as stored in a binary \ref md5s file.
+ * These are the fields of \c apr_md5_ctx_t, without the \c xlate 
+ * pointer. */
+struct cs__md5s_midstate_t
+{
+	/** The position the state is for; \c -1 if it's not valid. */
+	uint64_t pos;
+	uint32_t state[4];
+	uint32_t count[2];
+	unsigned char buffer[64];
+};
+
+
 /** This structure is used for one big file.
  * It stores the CRCs and MD5s of the manber-blocks of this file. */
 struct cs__manber_hashes 
 {
-	/** The manber-hashes */
-	uint32_t *hash;
+	/** The manber-hashes; 64bit values if \c wide_hash is set, else the 
+	 * 32bit values of the text format. */
+	uint64_t *hash;
 	/** The MD5-digests */
 	md5_digest_t *md5;
 	/** The position of the first byte of the next block, ie.
@@ -33,11 +48,112 @@ struct cs__manber_hashes
 
 	/** Number of manber-hash-entries stored */
 	unsigned count;
+	/** Whether the data came from a binary \ref md5s file. */
+	int wide_hash;
+	/** Whether there's a record for the data after the last border, at 
+	 * index \c count; see \ref md5s_last. */
+	int has_tail;
+	/** Whether \c midstate is valid for the last border. */
+	int has_midstate;
+	/** The full-file MD5 state at the last border, see \ref md5s_append. */
+	struct cs__md5s_midstate_t midstate;
+	/** Whether \c fast_hash is valid. */
+	int has_fast_hash;
+	/** The fast hash of the whole file, see \ref o_change_hash. */
+	uint64_t fast_hash;
+	/** Which function gave the block borders. */
+	enum cdc__type_e chunker;
+};
+
+
+/** \name Binary format of the \ref md5s files.
+ * A struct \ref cs__md5s_head_t, followed by one struct \ref 
+ * cs__md5s_record_t per block, in native byte order; the last record is 
+ * for the data after the last border (see \ref md5s_last).
+ * @{ */
+/** The header. */
+struct cs__md5s_head_t
+{
+	/** \c CS__MD5S_MAGIC. */
+	char magic[8];
+	/** \c CS__MD5S_VERSION. */
+	uint32_t version;
+	/** \c WAA_BYTE_ORDER. */
+	uint32_t byte_order;
+	/** Size of a record. */
+	uint32_t record_size;
+	/** The manber parameters the blocks were made with; if they're 
+	 * different, the file can't be used. With the gear hash \c prime and \c 
+	 * backtrack are \c 0. */
+	uint32_t blocksize_bits, prime, backtrack;
+	/** The full-file MD5 state at the last border; see \ref md5s_append. 
+	 * */
+	struct cs__md5s_midstate_t border_md5;
+	/** The fast hash of the whole file, see \ref o_change_hash; only 
+	 * valid if \c has_fast_hash is set. */
+	uint64_t fast_hash;
+	uint32_t has_fast_hash;
+	/** The function that gave the block borders, see \ref cdc__type_e. */
+	uint32_t chunker;
+};
+/** A manber block. */
+struct cs__md5s_record_t
+{
+	/** The 64bit rolling hash at the end of the block. */
+	uint64_t hash;
+	/** The position of the first byte after the block. */
+	uint64_t end;
+	/** The MD5 of the block. */
+	md5_digest_t md5;
+};
+#define CS__MD5S_MAGIC "FSVSmd5s"
+#define CS__MD5S_VERSION (1)
+/** @} */
+
+
+/** The data needed to compare a file with its last known state.
+ *
+ * This is filled by cs__compare_init(), and can then be given to 
+ * cs__compare_data() in another thread; it doesn't reference the struct 
+ * \ref estat. The results are stored with cs__compare_finish(). */
+struct cs__compare_t
+{
+	/** Path of the file. */
+	char *path;
+	/** The directory \a path is relative to; \c AT_FDCWD, unless 
+	 * changed after cs__compare_init(). */
+	int dir_fd;
+	/** Path of the \ref md5s file, or \c NULL. Allocated. */
+	char *md5s_path;
+	/** The current size of the file. */
+	off_t size;
+	/** The MD5 from the last commit/update. */
+	md5_digest_t old_md5;
+	/** The MD5 of the current data. */
+	md5_digest_t md5;
+	/** Whether a different manber block was found. */
+	int block_changed;
+	/** Set if the file couldn't be read because of \c EACCES. */
+	int unreadable;
 };
 
 
 /** Checks whether a file has changed. */
 int cs__compare_file(struct estat *sts, char *fullpath, int *result);
+/** Prepares \a cmp for comparing the file \a sts. */
+int cs__compare_init(struct cs__compare_t *cmp, struct estat *sts,
+		char *fullpath, off_t size);
+/** Reads the file and calculates the checksums; reentrant. */
+int cs__compare_data(struct cs__compare_t *cmp);
+/** How many files cs__compare_small() takes at once. */
+#define CS__SMALL_BATCH (16)
+/** Like cs__compare_data(), but for several files; small files are hashed 
+ * together. */
+void cs__compare_small(struct cs__compare_t *cmp[], int result[], 
+		unsigned count);
+/** Stores the results of cs__compare_data() in \a sts. */
+int cs__compare_finish(struct cs__compare_t *cmp, struct estat *sts, 
+		int *result);
 /** Puts the hex string of \a md5 into \a dest, and returns \a dest. */
 char* cs__md5tohex(const md5_digest_t md5, char *dest);
 /** Converts an MD5 digest to an ASCII string in a self-managed buffer. */
@@ -50,7 +166,7 @@ int cs__set_file_committed(struct estat *sts);
 
 /** Creates a \c svn_stream_t pipe, which writes the checksums of the 
  * manber hash blocks to the \ref md5s file. */
-int cs__new_manber_filter(struct estat *sts,
+int cs__new_manber_filter(struct estat *sts, const char *local_path,
 		svn_stream_t *stream_input, 
 		svn_stream_t **filter_stream,
 		apr_pool_t *pool);
@@ -58,6 +174,19 @@ int cs__new_manber_filter(struct estat *sts,
 /** Reads the \ref md5s file into memory. */
 int cs__read_manber_hashes(struct estat *sts, 
 		struct cs__manber_hashes *data);
+/** Reads the \ref md5s file given by \a filename into memory. */
+int cs__read_manber_file(const char *filename, 
+		struct cs__manber_hashes *data);
+/** Frees the arrays in \a data. */
+void cs__free_manber_hashes(struct cs__manber_hashes *data);
+
+/** Prints the hashing statistics, see \ref o_hash_stats. */
+int cs__print_stats(FILE *output);
+
+/** Switches the read throttling on or off, see \ref o_io_limit. */
+void cs__throttle_toggle(void);
+/** Lets \c SIGHUP switch the throttling, if a limit is configured. */
+void cs__throttle_signal(void);
 
 /** Hex-character pair to ascii. */
 int cs__two_ch2bin(char *stg);
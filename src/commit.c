@@ -94,6 +94,8 @@
 #include "racallback.h"
 #include "url.h"
 #include "helper.h"
+#include "pristine.h"
+#include "prefetch.h"
 
 
 
@@ -432,12 +434,16 @@ svn_error_t *ci__nondir(const svn_delta_editor_t *editor,
 	struct encoder_t *encoder;
 	int transfer_text, has_manber;
 	hash_t db;
+	svn_stream_t *base;
+	svn_txdelta_stream_t *txdelta;
+	md5_digest_t base_md5;
 
 
 	str=NULL;
 	a_stream=NULL;
 	s_stream=NULL;
 	encoder=NULL;
+	base=NULL;
 
 	STOPIF( ops__build_path(&filename, sts), NULL);
 
@@ -491,6 +497,9 @@ svn_error_t *ci__nondir(const svn_delta_editor_t *editor,
 	if (!transfer_text && !(sts->flags & RF___IS_COPY))
 	{
 		DEBUGP("hasn't changed, and no copy.");
+		/* The revision changes, but the base text stays the same. */
+		if (url__current_has_precedence(sts->url))
+			STOPIF( pst__keep_base(sts), NULL);
 	}
 	else
 	{
@@ -513,16 +522,40 @@ svn_error_t *ci__nondir(const svn_delta_editor_t *editor,
 						ops__dev_to_filedata(sts), pool);
 				break;
 			case S_IFREG:
+				STOPIF( pf__read_ahead_at(sts), NULL);
 				STOPIF( apr_file_open(&a_stream, filename, APR_READ, 0, pool),
 						"open file \"%s\" for reading", filename);
 
 				s_stream=svn_stream_from_aprfile (a_stream, pool);
+				STOPIF( pf__read_ahead_stream(a_stream, sts->st.size, 
+							s_stream, &s_stream, pool), NULL);
 
 				/* We need the local manber hashes and MD5s to detect changes;
 				 * the remote values would be needed for delta transfers. */
 				has_manber= (sts->st.size >= CS__MIN_FILE_SIZE);
 				if (has_manber)
-					STOPIF( cs__new_manber_filter(sts, s_stream, &s_stream, pool), NULL );
+					STOPIF( cs__new_manber_filter(sts, filename, 
+								s_stream, &s_stream, pool), NULL );
+
+				/* The text is kept as base for the next commit; and if we have the 
+				 * current base, only the differences to it need to be sent.  
+				 * Both only if the repository gets the data unchanged, and the 
+				 * entry will belong to this URL. */
+				if (transfer_text && !sts->decoder &&
+						url__current_has_precedence(sts->url))
+				{
+					if (sts->url == current_url &&
+							!(sts->entry_status & FS_NEW) &&
+							!(sts->flags & RF___IS_COPY))
+					{
+						status=pst__get_base(sts, &base, base_md5, NULL, pool);
+						if (status == ENOENT)
+							status=0;
+						STOPIF( status, NULL);
+					}
+
+					STOPIF( pst__filter(sts, s_stream, &s_stream, pool), NULL);
+				}
 
 				/* That's needed only for actually putting the data in the 
 				 * repository - for local re-calculating it isn't. */
@@ -552,17 +585,31 @@ svn_error_t *ci__nondir(const svn_delta_editor_t *editor,
 			DEBUGP("really sending ...");
 			STOPIF_SVNERR( editor->apply_textdelta,
 					(baton, 
-					 NULL, // checksum of old file,
+					 base ? apr_pstrdup(pool, cs__md5tohex_buffered(base_md5)) :
+					 NULL,
 					 pool,
 					 &delta_handler,
 					 &delta_baton));
 
 			/* If we're transferring the data, we always get an MD5 here. We can 
 			 * take the local value, if it had to be encoded. */
-			STOPIF_SVNERR( svn_txdelta_send_stream,
-					(s_stream, delta_handler,
-					 delta_baton,
-					 sts->md5, pool) );
+			if (base)
+			{
+				DEBUGP("delta against %s", cs__md5tohex_buffered(base_md5));
+				svn_txdelta(&txdelta, base, s_stream, pool);
+				STOPIF_SVNERR( svn_txdelta_send_txstream,
+						(txdelta, delta_handler, delta_baton, pool) );
+				memcpy(sts->md5, svn_txdelta_md5_digest(txdelta), 
+						sizeof(sts->md5));
+
+				STOPIF_SVNERR( svn_stream_close, (base) );
+				base=NULL;
+			}
+			else
+				STOPIF_SVNERR( svn_txdelta_send_stream,
+						(s_stream, delta_handler,
+						 delta_baton,
+						 sts->md5, pool) );
 			DEBUGP("after sending encoder=%p", encoder);
 		}
 		else
@@ -725,6 +772,7 @@ svn_error_t *ci__directory(const svn_delta_editor_t *editor,
 						NULL);
 				STOPIF( waa__delete_byext(filename, WAA__FILE_MD5s_EXT, 1), NULL);
 				STOPIF( waa__delete_byext(filename, WAA__PROP_EXT, 1), NULL);
+				STOPIF( pst__drop_base(filename), NULL);
 				i--;
 				continue;
 			}
@@ -950,6 +998,41 @@ ex:
 }
 
 
+/** Queues the files below \a dir that ci__directory() will read, in the 
+ * same order, for pf__read_ahead_start().
+ * Files that are not read after all are simply skipped. */
+int ci___read_ahead(struct estat *dir)
+{
+	int status;
+	uint32_t i;
+	struct estat *sts;
+
+
+	status=0;
+	for(i=0; i<dir->entry_count; i++)
+	{
+		sts=dir->by_inode[i];
+
+		if (!( ((sts->flags & RF___COMMIT_MASK) && sts->do_this_entry) ||
+					sts->entry_status))
+			continue;
+		if ((sts->flags & RF_UNVERSION) || 
+				(sts->entry_status & FS_REMOVED))
+			continue;
+
+		if (S_ISDIR(sts->st.mode))
+			STOPIF( ci___read_ahead(sts), NULL);
+		else if (S_ISREG(sts->st.mode) &&
+				((sts->entry_status & (FS_CHANGED | FS_NEW | FS_LIKELY)) ||
+				 (sts->flags & (RF_ADD | RF___IS_COPY))))
+			STOPIF( pf__read_ahead_add(sts), NULL);
+	}
+
+ex:
+	return status;
+}
+
+
 /** Start an editor, to get a commit message. 
  *
  * We look for \c $EDITOR and \c $VISUAL -- to fall back on good ol' vi. */
@@ -1235,9 +1318,14 @@ int ci__work(struct estat *root, int argc, char *argv[])
 	}
 
 
+	/* While one file is sent, the next ones can be read. */
+	STOPIF( ci___read_ahead(root), NULL);
+	STOPIF( pf__read_ahead_start(), NULL);
+
 	/* This is the second step that takes time. */
 	STOPIF_SVNERR( ci___base_dirs,
 			(missing_path_utf8, editor, root, root_baton));
+	STOPIF( pf__stop(), "stopping the read-ahead threads");
 
 
 	/* If an error occurred, abort the commit. */
@@ -1272,6 +1360,7 @@ int ci__work(struct estat *root, int argc, char *argv[])
 			 * Just use unionfs - that's easier. */
 			STOPIF( waa__output_tree(root), NULL);
 			STOPIF( url__output_list(), NULL);
+			STOPIF( pst__write_refs(), NULL);
 		}
 
 		/* We do the delay here ... here we've got a chance that the second 
@@ -1291,6 +1380,9 @@ abort_commit:
 		editor->abort_edit(edit_baton, global_pool);
 	}
 
+	/* In case of an error the threads might still be running. */
+	pf__stop();
+
 	return status;
 }
 
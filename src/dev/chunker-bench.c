@@ -0,0 +1,173 @@
+/************************************************************************
+ * Copyright (C) 2026 Philipp Marek.
+ *
+ * This program is free software;  you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ ************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "cdc.h"
+
+
+/** \file
+ * Microbenchmark for the block border functions in cdc.c; see \ref
+ * md5s_gear.
+ *
+ * Build it in \c src with <tt>make dev/chunker-bench</tt>, and call it
+ * with the size of the test data in MB (default 256) and the size of the
+ * pieces it's given in (default 4MB, like \c CS___READSIZE).
+ *
+ * The data is random; for each function the bytes per cycle, MB per
+ * second, and the number and average size of the blocks are printed.
+ * On x86 the cycles are those of the time stamp counter, ie. at the
+ * nominal frequency. */
+
+
+/** The cycle counter, or nanoseconds if there's none. */
+static uint64_t now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+
+static double seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+
+/** Runs the \a data through a function, like cs___end_of_block() does
+ * (without the MD5s and zero blocks); returns the number of blocks. */
+static unsigned run(enum cdc__type_e type, const unsigned char *data,
+		size_t size, size_t piece)
+{
+	static struct cdc__manber_t mnb;
+	struct cdc__gear_t gear;
+	size_t pos, end;
+	unsigned blocks;
+	int i, len, border, bits;
+
+
+	blocks=0;
+	bits=0;
+	cdc__manber_reset(&mnb);
+	cdc__gear_reset(&gear);
+	for(pos=0; pos<size; pos=end)
+	{
+		end= pos+piece < size ? pos+piece : size;
+		while (pos < end)
+		{
+			len=end-pos;
+			if (type == CDC__GEAR)
+			{
+				i=cdc__gear_fill(&gear, data+pos, len, &bits);
+				i+=cdc__gear_roll(&gear, data+pos+i, len-i, &border);
+			}
+			else
+			{
+				i=cdc__manber_fill(&mnb, data+pos, len, &bits);
+				i+=cdc__manber_roll(&mnb, data+pos+i, len-i, &border);
+			}
+			pos+=i;
+
+			if (border)
+			{
+				blocks++;
+				cdc__manber_reset(&mnb);
+				cdc__gear_reset(&gear);
+			}
+		}
+	}
+
+	return blocks;
+}
+
+
+int main(int argc, char *argv[])
+{
+	static const struct {
+		enum cdc__type_e type;
+		const char *name;
+	} types[] = {
+		{ CDC__MANBER, "manber" },
+		{ CDC__GEAR, "gear" },
+	};
+	unsigned char *data;
+	size_t size, piece, i;
+	uint64_t x, cycles;
+	double start, secs;
+	unsigned blocks, t;
+
+
+	size=(argc > 1 ? atol(argv[1]) : 256) << 20;
+	piece=(argc > 2 ? atol(argv[2]) : 4) << 20;
+	if (!size || !piece)
+	{
+		fprintf(stderr, "Usage: %s [MB of data [MB per piece]]\n", argv[0]);
+		return 1;
+	}
+
+	data=malloc(size);
+	if (!data)
+	{
+		perror("malloc");
+		return 1;
+	}
+
+	/* xorshift64 */
+	x=88172645463325252ULL;
+	for(i=0; i<size; i++)
+	{
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		data[i]=x >> 32;
+	}
+
+	cdc__init();
+	/* Get the data into the cache, and the CPU up to speed. */
+	run(CDC__GEAR, data, size, piece);
+
+	printf("%llu MB in pieces of %llu MB\n",
+			(unsigned long long)size >> 20, (unsigned long long)piece >> 20);
+	for(t=0; t<sizeof(types)/sizeof(types[0]); t++)
+	{
+		start=seconds();
+		cycles=now();
+		blocks=run(types[t].type, data, size, piece);
+		cycles=now()-cycles;
+		secs=seconds()-start;
+
+		printf("%-8s %6.3f bytes/%s  %8.1f MB/s  %6u blocks of %7.0f bytes\n",
+				types[t].name,
+#if defined(__x86_64__) || defined(__i386__)
+				(double)size/cycles, "cycle",
+#else
+				(double)size/cycles, "ns",
+#endif
+				size/secs/(1 << 20),
+				blocks, blocks ? (double)size/blocks : 0.0);
+	}
+
+	free(data);
+	return 0;
+}
@@ -28,6 +28,7 @@
 #include "cp_mv.h"
 #include "warnings.h"
 #include "diff.h"
+#include "pristine.h"
 
 
 /** \file
@@ -179,6 +180,9 @@ int df__do_diff(struct estat *sts,
 	int is_copy;
 	int fdflags;
 	apr_hash_t *props_r1, *props_r2;
+	svn_stream_t *base;
+	struct sstat_t base_st;
+	apr_file_t *apr_f;
 
 
 	status=0;
@@ -252,8 +256,20 @@ int df__do_diff(struct estat *sts,
 	current_url = sts->url;
 
 
+	/* The base text may be in the pristine store; then no session is 
+	 * needed. */
+	base=NULL;
+	if (!is_copy && rev2 == 0 && rev1 == sts->repos_rev)
+	{
+		status=pst__get_base(sts, &base, NULL, &base_st, current_url->pool);
+		if (status == ENOENT)
+			status=0;
+		STOPIF( status, NULL);
+	}
+
 	/* We have to fetch a file and do the diff, so open a session. */
-	STOPIF( url__open_session(NULL, NULL), NULL);
+	if (!base)
+		STOPIF( url__open_session(NULL, NULL), NULL);
 
 	/* The function rev__get_file() overwrites the data in \c *sts with 
 	 * the repository values - mtime, ctime, etc.
@@ -282,11 +298,29 @@ int df__do_diff(struct estat *sts,
 	}
 
 	/* Now fetch the \e old version. */
-	STOPIF( url__canonical_rev(current_url, &rev1), NULL);
-	STOPIF( rev__get_text_to_tmpfile(url_to_fetch, rev1, DECODER_UNKNOWN,
-				NULL, &last_tmp_file, 
-				NULL, sts, &props_r1, 
-				current_url->pool), NULL);
+	if (base)
+	{
+		/* Like rev__get_text_to_tmpfile(), put the meta-data of the base 
+		 * in \c *sts. */
+		sts->st.mode=(sts->st.mode & S_IFMT) | (base_st.mode & 07777);
+		sts->st.mtim=base_st.mtim;
+		sts->st.uid=base_st.uid;
+		sts->st.gid=base_st.gid;
+
+		STOPIF( waa__get_tmp_name( NULL, &last_tmp_file, &apr_f, 
+					current_url->pool), NULL);
+		STOPIF( hlp__stream_copy(base, 
+					svn_stream_from_aprfile2(apr_f, FALSE, current_url->pool)), 
+				NULL);
+	}
+	else
+	{
+		STOPIF( url__canonical_rev(current_url, &rev1), NULL);
+		STOPIF( rev__get_text_to_tmpfile(url_to_fetch, rev1, DECODER_UNKNOWN,
+					NULL, &last_tmp_file, 
+					NULL, sts, &props_r1, 
+					current_url->pool), NULL);
+	}
 
 	/* If we didn't flush the stdio buffers here, we'd risk getting them 
 	 * printed a second time from the child. */
@@ -21,6 +21,8 @@
 #include "warnings.h"
 #include "global.h"
 #include "helper.h"
+#include "options.h"
+#include "ignore.h"
 
 
 /** \file
@@ -68,6 +70,19 @@
 #include <linux/types.h>
 #include <linux/unistd.h>
 
+#ifdef HAVE_LINUX_IO_URING_H
+#ifdef STATX_BASIC_STATS
+#ifdef __NR_io_uring_setup
+/** Whether \c io_uring can be used for \c statx(); see \ref o_io_uring.  
+ * */
+#define ENABLE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#endif
+#endif
+#endif
+
 /** The type of handle.  */
 typedef int dir__handle;
 /** A compatibility structure.
@@ -76,17 +91,19 @@ typedef int dir__handle;
 typedef struct dirent64 fsvs_dirent;
 
 
-/** Starts enumeration of the given \a path. The directory handle is returned
- * in \a *dirp.
+/** Starts enumeration of the directory \a dir_fd. The directory handle 
+ * is returned in \a *dirp.
+ * A new handle is opened, so that reading doesn't change the position of 
+ * \a dir_fd.
  * \return 0 for success, or an error code. */
-int dir__start_enum(dir__handle *dh, char *path)
+int dir__start_enum(dir__handle *dh, int dir_fd)
 {	
 	int status;
 
 	status=0;
-	*dh=open(path, O_RDONLY | O_DIRECTORY);
+	*dh=openat(dir_fd, ".", O_RDONLY | O_DIRECTORY);
 	STOPIF_CODE_ERR( *dh <= 0, errno,
-			"open directory %s for reading", path);
+			"open directory for reading");
 
 ex:
 	return status;
@@ -142,6 +159,7 @@ ex:
 struct fsvs_dirent_t {
 	uint64_t	d_ino;
 	int 		d_reclen;
+	unsigned char d_type;
 	char		d_name[NAME_MAX+1];
 };
 
@@ -150,13 +168,21 @@ typedef struct fsvs_dirent_t fsvs_dirent;
 typedef DIR* dir__handle;
 
 
-int dir__start_enum(dir__handle *dh, char *path)
+int dir__start_enum(dir__handle *dh, int dir_fd)
 {
-	int status;
+	int status, fd;
 
 	status=0;
-	STOPIF_CODE_ERR( (*dh=opendir(path)) == NULL, errno,
-			"Error opening directory %s", path);
+	fd=openat(dir_fd, ".", O_RDONLY | O_DIRECTORY);
+	STOPIF_CODE_ERR( fd == -1, errno,
+			"Error opening directory");
+	*dh=fdopendir(fd);
+	if (!*dh)
+	{
+		status=errno;
+		close(fd);
+		STOPIF( status, "Error opening directory");
+	}
 ex:
 	return status;
 }
@@ -172,6 +198,11 @@ int dir__enum(dir__handle dh, fsvs_dirent *dirp, unsigned int count)
 	if (!de) return 0; 
 
 	dirp[0].d_ino = de->d_ino;
+#ifdef _DIRENT_HAVE_D_TYPE
+	dirp[0].d_type = de->d_type;
+#else
+	dirp[0].d_type = 0;
+#endif
 	strcpy( dirp[0].d_name, de->d_name);
 
 	dirp[0].d_reclen = sizeof(dirp[0])-sizeof(dirp[0].d_name) +
@@ -209,6 +240,15 @@ ex:
 
 #endif
 
+
+/** Converts the \c d_type of a directory entry into the \c S_IFMT bits 
+ * of a mode; \c 0 means unknown. */
+#ifdef DTTOIF
+#define DIR___TYPE2MODE(t) (DTTOIF(t))
+#else
+#define DIR___TYPE2MODE(t) (0)
+#endif
+
 /** @} */
 
 
@@ -333,16 +373,357 @@ int dir__sortbyinode(struct estat *sts)
 }
 
 
+/** Handles the result \a status of the \c lstat() for \a sts.
+ * Entries that don't exist anymore (or are FIFOs or sockets) are marked 
+ * as to be ignored. */
+static int dir___stat_done(struct estat *sts, int status)
+{
+	if (abs(status) == ENOENT)
+	{
+		DEBUGP("entry \"%s\" not interesting - maybe a fifo or socket?", 
+				sts->name);
+		sts->to_be_ignored=1;
+	}
+	else
+		STOPIF( status, "lstat(%s)", sts->name);
+
+	/* New entries get that set, because they're "updated". */
+	sts->old_rev_mode_packed = sts->local_mode_packed= 
+		MODE_T_to_PACKED(sts->st.mode);
+	status=0;
+
+ex:
+	return status;
+}
+
+
+#ifdef ENABLE_IO_URING
+/** \addtogroup getdents
+ * \section getdents_uring io_uring
+ *
+ * For big directories the single \c lstat() calls in dir__enumerator() 
+ * take most of the time; with \ref o_io_uring set they're given to the 
+ * kernel as \c IORING_OP_STATX in batches of \ref DIR___URING_SIZE.
+ *
+ * We don't want to depend on \c liburing, so the few syscalls are done 
+ * directly. The ring is set up once, and kept until the process exits.
+ * If that doesn't work (old kernel, seccomp, ...) the synchronous path is 
+ * taken.
+ *
+ * The \c statx results are converted into a <tt>struct stat</tt>, and go 
+ * through hlp__stat_result() - so the data in the \c sstat_t is the same 
+ * as with hlp__lstat(). Failed requests are simply repeated via 
+ * hlp__lstat(), to get the same error handling.
+ * */
+/** @{ */
+
+/** How many requests are submitted at once. */
+#define DIR___URING_SIZE (256)
+/** Directories with fewer entries are done synchronously. */
+#define DIR___URING_MIN (64)
+
+/** The io_uring and its mappings. */
+static struct {
+	/** The ring file descriptor; \c -1 if not set up. */
+	int fd;
+	/** Set if the ring is not usable. */
+	int unusable;
+
+	/** Submission queue pointers. */
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	/** Completion queue pointers. */
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	/** The submission entries. */
+	struct io_uring_sqe *sqes;
+	/** The completion entries. */
+	struct io_uring_cqe *cqes;
+
+	/** The mappings, for dir___uring_close(). \c cq_map is \c NULL if it's 
+	 * the same as \c sq_map. */
+	void *sq_map, *cq_map, *sqe_map;
+	/** The lengths of the mappings. */
+	size_t sq_len, cq_len, sqe_len;
+
+	/** The results of the current batch. */
+	struct statx *stx;
+	/** The return values of the current batch. */
+	int *res;
+} dir___ring = { .fd = -1 };
+
+
+/** Unmaps the rings and closes the \c io_uring file descriptor.
+ * Closing it cancels any outstanding requests. */
+static void dir___uring_close(void)
+{
+	if (dir___ring.sqe_map)
+		munmap(dir___ring.sqe_map, dir___ring.sqe_len);
+	if (dir___ring.cq_map)
+		munmap(dir___ring.cq_map, dir___ring.cq_len);
+	if (dir___ring.sq_map)
+		munmap(dir___ring.sq_map, dir___ring.sq_len);
+	dir___ring.sqe_map=dir___ring.cq_map=dir___ring.sq_map=NULL;
+
+	close(dir___ring.fd);
+	dir___ring.fd=-1;
+}
+
+
+/** Sets up \c dir___ring.
+ * Returns an error if \c io_uring can't be used; as that simply means 
+ * taking the other code path no message is printed. */
+static int dir___uring_init(void)
+{
+	int status;
+	struct io_uring_params p;
+	size_t sq_len, cq_len;
+	char *sq_ptr, *cq_ptr;
+	void *sqe_ptr;
+
+	status=0;
+	memset(&p, 0, sizeof(p));
+	dir___ring.fd=syscall(__NR_io_uring_setup, DIR___URING_SIZE, &p);
+	if (dir___ring.fd == -1) 
+		return errno;
+
+	sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (cq_len > sq_len) sq_len=cq_len;
+		cq_len=sq_len;
+	}
+
+	sq_ptr=mmap(NULL, sq_len, PROT_READ | PROT_WRITE, 
+			MAP_SHARED | MAP_POPULATE, dir___ring.fd, IORING_OFF_SQ_RING);
+	if (sq_ptr == MAP_FAILED) goto failed;
+	dir___ring.sq_map=sq_ptr;
+	dir___ring.sq_len=sq_len;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		cq_ptr=sq_ptr;
+	else
+	{
+		cq_ptr=mmap(NULL, cq_len, PROT_READ | PROT_WRITE, 
+				MAP_SHARED | MAP_POPULATE, dir___ring.fd, IORING_OFF_CQ_RING);
+		if (cq_ptr == MAP_FAILED) goto failed;
+		dir___ring.cq_map=cq_ptr;
+		dir___ring.cq_len=cq_len;
+	}
+
+	dir___ring.sqe_len=p.sq_entries * sizeof(struct io_uring_sqe);
+	sqe_ptr=mmap(NULL, dir___ring.sqe_len, 
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+			dir___ring.fd, IORING_OFF_SQES);
+	if (sqe_ptr == MAP_FAILED) goto failed;
+	dir___ring.sqe_map=sqe_ptr;
+
+	dir___ring.sq_head = (unsigned*)(sq_ptr + p.sq_off.head);
+	dir___ring.sq_tail = (unsigned*)(sq_ptr + p.sq_off.tail);
+	dir___ring.sq_mask = (unsigned*)(sq_ptr + p.sq_off.ring_mask);
+	dir___ring.sq_array = (unsigned*)(sq_ptr + p.sq_off.array);
+	dir___ring.cq_head = (unsigned*)(cq_ptr + p.cq_off.head);
+	dir___ring.cq_tail = (unsigned*)(cq_ptr + p.cq_off.tail);
+	dir___ring.cq_mask = (unsigned*)(cq_ptr + p.cq_off.ring_mask);
+	dir___ring.cqes = (struct io_uring_cqe*)(cq_ptr + p.cq_off.cqes);
+	dir___ring.sqes = sqe_ptr;
+
+	STOPIF( hlp__alloc( &dir___ring.stx, 
+				DIR___URING_SIZE * sizeof(*dir___ring.stx)), NULL);
+	STOPIF( hlp__alloc( &dir___ring.res, 
+				DIR___URING_SIZE * sizeof(*dir___ring.res)), NULL);
+
+ex:
+	return status;
+
+failed:
+	status=errno;
+	dir___uring_close();
+	return status;
+}
+
+
+/** Submits the \c statx() requests for \a count entries in \a list, 
+ * relative to \a dir_fd, and waits for all of them.
+ * If \c io_uring_enter() fails, the ring is closed via 
+ * dir___uring_close() and marked as unusable; the caller has to do the 
+ * whole batch another way then. */
+static int dir___uring_batch(int dir_fd, struct estat **list, int count)
+{
+	int status;
+	int i, ret;
+	unsigned tail, head, to_submit, done;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+
+	status=0;
+	tail=*dir___ring.sq_tail;
+	for(i=0; i<count; i++)
+	{
+		head=tail & *dir___ring.sq_mask;
+		sqe=dir___ring.sqes + head;
+
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode=IORING_OP_STATX;
+		sqe->fd=dir_fd;
+		sqe->addr=(unsigned long)list[i]->name;
+		sqe->len=STATX_BASIC_STATS;
+		sqe->off=(unsigned long)(dir___ring.stx+i);
+		sqe->statx_flags=AT_SYMLINK_NOFOLLOW;
+		sqe->user_data=i;
+
+		dir___ring.sq_array[head]=head;
+		tail++;
+	}
+	__atomic_store_n(dir___ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+	done=0;
+	while (done < count)
+	{
+		to_submit=tail - __atomic_load_n(dir___ring.sq_head, __ATOMIC_ACQUIRE);
+		ret=syscall(__NR_io_uring_enter, dir___ring.fd, to_submit, 
+				count-done, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret == -1 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (ret == -1)
+		{
+			/* Eg. ENOMEM, EBUSY, or EPERM by a seccomp filter; the normal path 
+			 * still works. */
+			DEBUGP("io_uring_enter: %d, not used anymore", errno);
+			dir___uring_close();
+			dir___ring.unusable=1;
+			goto ex;
+		}
+
+		head=*dir___ring.cq_head;
+		while (head != __atomic_load_n(dir___ring.cq_tail, __ATOMIC_ACQUIRE))
+		{
+			cqe=dir___ring.cqes + (head & *dir___ring.cq_mask);
+			BUG_ON(cqe->user_data >= count);
+			dir___ring.res[cqe->user_data]=cqe->res;
+			head++;
+			done++;
+		}
+		__atomic_store_n(dir___ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+ex:
+	return status;
+}
+
+
+/** Converts a \c statx() result into a <tt>struct stat</tt>, with all 
+ * fields that hlp__copy_stats() uses. */
+static void dir___statx2stat(struct statx *stx, struct stat *st64)
+{
+	memset(st64, 0, sizeof(*st64));
+	st64->st_mode=stx->stx_mode;
+	st64->st_ino=stx->stx_ino;
+	st64->st_dev=makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	st64->st_rdev=makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+	st64->st_uid=stx->stx_uid;
+	st64->st_gid=stx->stx_gid;
+	st64->st_size=stx->stx_size;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+	st64->st_mtim.tv_sec=stx->stx_mtime.tv_sec;
+	st64->st_mtim.tv_nsec=stx->stx_mtime.tv_nsec;
+	st64->st_ctim.tv_sec=stx->stx_ctime.tv_sec;
+	st64->st_ctim.tv_nsec=stx->stx_ctime.tv_nsec;
+#else
+	st64->st_mtime=stx->stx_mtime.tv_sec;
+	st64->st_ctime=stx->stx_ctime.tv_sec;
+#endif
+}
+
+
+/** Does the \c lstat() for the \a count entries in \a list via \c 
+ * io_uring.
+ * The number of finished entries is returned in \a done; if that's less 
+ * than \a count, the rest has to be done by the caller. */
+static int dir___uring_stat(int dir_fd, struct estat **list, 
+		int count, int *done)
+{
+	int status;
+	int i, j, n;
+	struct estat *sts;
+	struct stat st64;
+
+	status=0;
+	*done=0;
+	if (dir___ring.unusable) goto ex;
+
+	if (dir___ring.fd == -1)
+	{
+		status=dir___uring_init();
+		if (status)
+		{
+			DEBUGP("no io_uring: %d", status);
+			dir___ring.unusable=1;
+			status=0;
+			goto ex;
+		}
+	}
+
+	for(i=0; i<count; i+=n)
+	{
+		n=count - i;
+		if (n > DIR___URING_SIZE) n=DIR___URING_SIZE;
+
+		STOPIF( dir___uring_batch(dir_fd, list+i, n), NULL);
+		if (dir___ring.unusable) goto ex;
+
+		/* An old kernel doesn't know IORING_OP_STATX; then we'd get EINVAL 
+		 * for everything. */
+		if (i == 0 && dir___ring.res[0] == -EINVAL)
+		{
+			DEBUGP("io_uring doesn't do statx");
+			dir___ring.unusable=1;
+			goto ex;
+		}
+
+		for(j=0; j<n; j++)
+		{
+			sts=list[i+j];
+			if (dir___ring.res[j] == 0)
+			{
+				dir___statx2stat(dir___ring.stx+j, &st64);
+				status=hlp__stat_result(&st64, &(sts->st));
+			}
+			else
+				status=hlp__lstat_at(dir_fd, sts->name, &(sts->st));
+
+			STOPIF( dir___stat_done(sts, status), NULL);
+		}
+
+		*done=i+n;
+	}
+
+ex:
+	return status;
+}
+
+/** @} */
+#endif
+
+
 /** -.
  * The entries are sorted by inode number and stat()ed.
  *
+ * Entries that are ignored by name (see ign__is_ignore_by_name()) are not 
+ * stat()ed; they only get estat::to_be_ignored set, and have just the 
+ * file type (if \c getdents() gives it) in their estat::st.
+ *
  * \param this a pointer to this directory's stat - for estimating
  * the number of entries. Only this->st.st_size is used for that - 
  * it may have to be zeroed before calling.
+ * \param dir_fd The handle of the directory; the names are stat()ed 
+ * relative to that, so the working directory doesn't matter.
  * \param est_count is used to give an approximate number of entries, to
  * avoid many realloc()s.
  * \param give_by_name simply tells whether the ->by_name array should be
  * created, too.
+ * \param known If not \c NULL, names that are already in the estat::by_name 
+ * list of this directory are skipped - neither stat()ed nor allocated. 
+ * That's used by waa__update_dir(), which only wants new entries.
  *
  * The result is written back into the sub-entry array in \a this.
  *
@@ -358,8 +739,10 @@ int dir__sortbyinode(struct estat *sts)
  * \return 0 for success, else an errorcode.
  */ 
 int dir__enumerator(struct estat *this,
+		int dir_fd,
 		int est_count,
-		int give_by_name)
+		int give_by_name,
+		struct estat *known)
 {
 	dir__handle dirhandle;
 	int size;
@@ -395,9 +778,17 @@ int dir__enumerator(struct estat *this,
 	struct estat **sts_array=NULL;
 	/* Array of inodes. */
 	ino_t *inode_numbers=NULL; 
+	/* Array of the \c d_type values. */
+	unsigned char *d_types=NULL;
+	/* The entries that have to be stat()ed. */
+	struct estat **to_stat=NULL;
+	int stat_count;
+
 
+	if (known && !known->by_name)
+		STOPIF( dir__sortbyname(known), NULL);
 
-	STOPIF( dir__start_enum(&dirhandle, "."), NULL);
+	STOPIF( dir__start_enum(&dirhandle, dir_fd), NULL);
 	if (!this->st.size)
 		STOPIF( dir__get_dir_size(dirhandle, &(this->st)), NULL);
 
@@ -454,6 +845,8 @@ int dir__enumerator(struct estat *this,
 				 * space; that changes when we've sorted them. */
 				STOPIF( hlp__realloc( &inode_numbers, 
 							alloc_count*sizeof(*inode_numbers)), NULL);
+				STOPIF( hlp__realloc( &d_types, 
+							alloc_count*sizeof(*d_types)), NULL);
 			}
 
 			p_de=(fsvs_dirent*)(buffer+j);
@@ -467,10 +860,17 @@ int dir__enumerator(struct estat *this,
 			{
 				/* just ignore . and .. */
 			}
+			else if (known && 
+					bsearch(p_de->d_name, known->by_name, known->entry_count, 
+						sizeof(*known->by_name), dir___f_sort_by_nameCS))
+			{
+				/* Already in the tree. */
+			}
 			else
 			{
 				/* store inode for sorting */
 				inode_numbers[count] = p_de->d_ino;
+				d_types[count] = p_de->d_type;
 
 				/* Store pointer to name.
 				 * In case of a realloc all pointers to the strings would get 
@@ -554,6 +954,8 @@ int dir__enumerator(struct estat *this,
 		 * So put correct values there. */
 		sts->name=this->strings + names[i];
 		sts->st.ino=inode_numbers[i];
+		/* Only the type, until the entry is stat()ed. */
+		sts->st.mode=DIR___TYPE2MODE(d_types[i]);
 
 		/* now the data is copied, we store the pointer. */
 		sts_array[i] = sts;
@@ -572,25 +974,39 @@ int dir__enumerator(struct estat *this,
 	STOPIF( dir__sortbyinode(this), NULL);
 
 
+	/* Entries that get ignored because of their name (and type) don't need 
+	 * to be stat()ed; they're freed by the caller. */
+	STOPIF( hlp__alloc( &to_stat, (count+1)*sizeof(*to_stat)), NULL);
+	stat_count=0;
 	//	for(i=0; i<count; i++) printf("%5ld %s\n",de[i]->d_ino, de[i]->d_name);
 	for(i=0; i<count; i++)
 	{
 		sts=this->by_inode[i];
 		sts->parent=this;
 		sts->repos_rev=SVN_INVALID_REVNUM;
-		status=hlp__lstat(sts->name, &(sts->st));
-		if (abs(status) == ENOENT)
+
+		STOPIF( ign__is_ignore_by_name(sts, &j), NULL);
+		if (j > 0)
 		{
-			DEBUGP("entry \"%s\" not interesting - maybe a fifo or socket?", 
-					sts->name);
 			sts->to_be_ignored=1;
+			sts->old_rev_mode_packed = sts->local_mode_packed= 
+				MODE_T_to_PACKED(sts->st.mode);
 		}
 		else
-			STOPIF( status, "lstat(%s)", sts->name);
+			to_stat[stat_count++]=sts;
+	}
 
-		/* New entries get that set, because they're "updated". */
-		sts->old_rev_mode_packed = sts->local_mode_packed= 
-			MODE_T_to_PACKED(sts->st.mode);
+	i=0;
+#ifdef ENABLE_IO_URING
+	if (opt__get_int(OPT__IO_URING) && stat_count >= DIR___URING_MIN)
+		STOPIF( dir___uring_stat(dir_fd, to_stat, stat_count, &i), NULL);
+#endif
+
+	for(; i<stat_count; i++)
+	{
+		sts=to_stat[i];
+		STOPIF( dir___stat_done(sts, 
+					hlp__lstat_at(dir_fd, sts->name, &(sts->st))), NULL);
 	}
 
 
@@ -607,6 +1023,8 @@ ex:
 	IF_FREE(strings);
 	IF_FREE(names);
 	IF_FREE(inode_numbers);
+	IF_FREE(d_types);
+	IF_FREE(to_stat);
 	IF_FREE(sts_array);
 
 	if (dirhandle>=0) dir__close(dirhandle);
@@ -19,8 +19,10 @@
 
 /** This function reads a directory into a self-allocated memory area. */
 int dir__enumerator(struct estat *this,
+		int dir_fd,
 		int est_count,
-		int by_name) ;
+		int by_name,
+		struct estat *known) ;
 
 /** Sorts the entries of the directory \a sts by name into the
  * estat::by_name array, which is reallocated and NULL-terminated. */
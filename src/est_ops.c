@@ -25,6 +25,7 @@
 #include "helper.h"
 #include "checksum.h"
 #include "url.h"
+#include "prefetch.h"
 
 /** \file
  * Handling of single struct \a estat s.
@@ -71,6 +72,8 @@ const char link_spec[]="link ",
 
 static struct free_estat *free_list = NULL;
 
+static void ops___dir_fd_forget(struct estat *dir);
+
 
 
 /** -.
@@ -217,6 +220,7 @@ int ops__stat_to_action(struct estat *sts, struct sstat_t *new)
 	struct sstat_t *old;
 	int ft_old, ft_new;
 	int file_status;
+	int nsec_known;
 
 
 	old=&(sts->st);
@@ -237,9 +241,14 @@ int ops__stat_to_action(struct estat *sts, struct sstat_t *new)
 	 * There's a long thread on dev@subversion.tigris.org about the
 	 * granularity of timestamps - auto detecting vs. setting, etc.
 	 * UPDATE 20240720: tigris is no more, see archives like
-	 *   https://svn.haxx.se/users/archive-2008-03/0462.shtml */
-	file_status = 
-		old->mtim.tv_sec != new->mtim.tv_sec ? FS_META_MTIME : 0;
+	 *   https://svn.haxx.se/users/archive-2008-03/0462.shtml
+	 *
+	 * Now the binary \ref dir file keeps the nanoseconds; they're compared 
+	 * if both sides have them, so that changes within the same second are 
+	 * seen, too. See ops__time_changed(). */
+	nsec_known=old->nsec_known && new->nsec_known;
+	file_status = ops__time_changed(&old->mtim, &new->mtim, nsec_known) ? 
+		FS_META_MTIME : 0;
 	/* We don't show a changed ctime as "t" any more. On commit nothing 
 	 * would change in the repository, and it looks a bit silly.
 	 * A changed ctime is now only used as an indicator for changes. */
@@ -281,12 +290,8 @@ int ops__stat_to_action(struct estat *sts, struct sstat_t *new)
 			else
 				/* The changed flag can be set or cleared by cs__compare_file().
 				 * We don't set it until we *know* the entry has changed. */
-				/* If the entry is copied, the ctime *must* be different (unless 
-				 * it's a hardlink); here we assume that it's not changed, if the 
-				 * mtime is the same. */
-				if ((file_status & FS_META_MTIME) ||
-						(old->ctim.tv_sec != new->ctim.tv_sec && 
-						 !(sts->flags & RF___IS_COPY)) )
+				if (ops__stat_likely_changed(old, new, 
+							sts->flags & RF___IS_COPY))
 					file_status |= FS_LIKELY;
 			break;
 
@@ -296,7 +301,7 @@ int ops__stat_to_action(struct estat *sts, struct sstat_t *new)
 			 * or if new entries are found, but never cleared, we don't set 
 			 * it here. */
 			if ( (file_status & FS_META_MTIME) ||
-					old->ctim.tv_sec != new->ctim.tv_sec )
+					ops__time_changed(&old->ctim, &new->ctim, nsec_known) )
 				file_status |= FS_LIKELY;
 			break;
 
@@ -315,6 +320,37 @@ ex:
 }
 
 
+/** Sets the URL of \a sts from the stored \a internal_number.
+ * Only the root entry has \a parent_inode \c ==0; the others start 
+ * counting with 1. */
+static int ops___load_url(struct estat *sts, unsigned internal_number,
+		ino_t parent_inode)
+{
+	int status;
+
+
+	status=0;
+	if (parent_inode)
+	{
+		/* There may be entries without an URL associated - eg. entries which
+		 * were just added, but not committed. */
+		if (internal_number)
+			STOPIF( url__find_by_intnum(internal_number, &(sts->url)), NULL);
+	}
+	else
+	{
+		/* The root entry gets the highest priority url.
+		 * There may be no URLs defined! */
+		sts->url= urllist_count ? 
+			urllist[urllist_count-1] : 
+			NULL;
+	}
+
+ex:
+	return status;
+}
+
+
 /** -.
  * 
  * The \a filename still points into the buffer (\c mmap()ed area) and must 
@@ -367,6 +403,9 @@ int ops__load_1entry(char **mem_pos, struct estat *sts, char **filename,
 	/* Base 16. */
 	sts->st.ctim.tv_sec= strtoul(buffer, &buffer, 16);
 	sts->st.mtim.tv_sec= strtoul(buffer, &buffer, 16);
+	/* Not stored in this format; see ops__time_changed(). */
+	sts->st.ctim.tv_nsec=sts->st.mtim.tv_nsec=0;
+	sts->st.nsec_known=0;
 	before=hlp__skip_ws(buffer);
 	sts->flags= strtoul(before, &buffer, 16);
 	if (before == buffer) goto inval;
@@ -417,23 +456,7 @@ int ops__load_1entry(char **mem_pos, struct estat *sts, char **filename,
 	*filename=buffer+1;
 
 
-	/* Only the root entry has parent_inode==0; the others start counting 
-	 * with 1. */
-	if (parent_inode)
-	{
-		/* There may be entries without an URL associated - eg. entries which
-		 * were just added, but not committed. */
-		if (internal_number)
-			STOPIF( url__find_by_intnum(internal_number, &(sts->url)), NULL);
-	}
-	else
-	{
-		/* The root entry gets the highest priority url.
-		 * There may be no URLs defined! */
-		sts->url= urllist_count ? 
-			urllist[urllist_count-1] : 
-			NULL;
-	}
+	STOPIF( ops___load_url(sts, internal_number, parent_inode), NULL);
 
 	if (parent_i) *parent_i=parent_inode;
 
@@ -480,6 +503,37 @@ int ops___entries_to_write(struct estat *dir)
 }
 
 
+/** Applies the group (if needed), and returns the revision and URL number 
+ * to store for \a sts. */
+static int ops___save_prepare(struct estat *sts,
+		svn_revnum_t *revision, int *intnum)
+{
+	int status;
+
+
+	status=0;
+	if (sts->match_pattern)
+		STOPIF( ops__apply_group(sts, NULL, NULL), NULL);
+
+
+	*revision = sts->repos_rev;
+	if (sts->url) {
+		*intnum=sts->url->internal_number;
+		if (*revision == SET_REVNUM)
+			*revision = sts->url->current_rev;
+	} else {
+		/* A non-root entry has no url. May happen with _build_list, when
+		 * there are no urls. */
+		if (sts->parent)
+			DEBUGP("Non-root entry %s has no URL", sts->name);
+		*intnum=0;
+	}
+
+ex:
+	return status;
+}
+
+
 /** -.
  * The parameter \a parent_ino is a(n integer) reference to the parent 
  * directory - the line number in which it was written.
@@ -488,10 +542,12 @@ int ops___entries_to_write(struct estat *dir)
  * 
  * Any other characters that are allowed in a filename can be written - 
  * even control characters like \c \\n, \c \\r, \c \\f and so on.
+ *
+ * The line is returned in a static buffer, to be written by the caller.
  * */
 int ops__save_1entry(struct estat *sts,
 		ino_t parent_ino,
-		int filehandle)
+		char **line, int *length)
 {
 	int len;
 	static char buffer[WAA_MAX_DIR_INFO_CHARS+2] = 
@@ -522,22 +578,7 @@ int ops__save_1entry(struct estat *sts,
 	is_dev = S_ISBLK(sts->st.mode) || S_ISCHR(sts->st.mode);
 
 
-	if (sts->match_pattern)
-		STOPIF( ops__apply_group(sts, NULL, NULL), NULL);
-
-
-	revision = sts->repos_rev;
-	if (sts->url) {
-		intnum=sts->url->internal_number;
-		if (revision == SET_REVNUM)
-			revision = sts->url->current_rev;
-	} else {
-		/* A non-root entry has no url. May happen with _build_list, when
-		 * there are no urls. */
-		if (sts->parent)
-			DEBUGP("Non-root entry %s has no URL", sts->name);
-		intnum=0;
-	}
+	STOPIF( ops___save_prepare(sts, &revision, &intnum), NULL);
 
 	len=sprintf(buffer, ops__dir_info_format_p,
 			(t_ull)sts->st.mode,
@@ -567,11 +608,99 @@ int ops__save_1entry(struct estat *sts,
 	BUG_ON(buffer[sizeof(buffer)-1]!=0xff || 
 			buffer[sizeof(buffer)-2]!=0x0);
 
-	is_dir=write(filehandle, buffer, len);
-	STOPIF_CODE_ERR(is_dir != len, errno, 
-			"write entry");
+	*line=buffer;
+	*length=len;
+	status=0;
+
+ex:
+	return status;
+}
+
+
+/** -.
+ * Like ops__save_1entry(), but fills the binary record \a rec; the name 
+ * has to be stored by the caller, at \a name_offset. */
+int ops__save_1record(struct estat *sts,
+		ino_t parent_ino, unsigned name_offset,
+		struct waa__dir_record_t *rec)
+{
+	int status;
+	int intnum;
+	svn_revnum_t revision;
+
+
+	STOPIF( ops___save_prepare(sts, &revision, &intnum), NULL);
+
+	/* Clear the padding, too; the file should only depend on the data. */
+	memset(rec, 0, sizeof(*rec));
+	rec->size=sts->st.size;
+	rec->dev=sts->st.dev;
+	rec->ino=sts->st.ino;
+	rec->ctime=sts->st.ctim.tv_sec;
+	rec->mtime=sts->st.mtim.tv_sec;
+	rec->ctime_nsec=sts->st.ctim.tv_nsec;
+	rec->mtime_nsec=sts->st.mtim.tv_nsec;
+	rec->nsec_known=sts->st.nsec_known;
+	rec->revision=revision;
+	rec->mode=sts->st.mode;
+	rec->flags=sts->flags & RF___SAVE_MASK;
+	rec->uid=sts->st.uid;
+	rec->gid=sts->st.gid;
+	rec->url_intnum=intnum;
+	rec->parent=parent_ino;
+	rec->name_offset=name_offset;
+
+	/* The MD5 and the entry count share memory. */
+	if (S_ISDIR(sts->st.mode))
+		rec->entry_count=ops___entries_to_write(sts);
+	else
+		memcpy(rec->md5, sts->md5, sizeof(rec->md5));
+
+ex:
+	return status;
+}
+
+
+/** -.
+ * The name is not set; \a parent_i gets the stored parent index, like in 
+ * ops__load_1entry(). */
+int ops__load_1record(const struct waa__dir_record_t *rec, 
+		struct estat *sts, ino_t *parent_i)
+{
+	int status;
+
 
 	status=0;
+	sts->st.mode = rec->mode;
+	sts->old_rev_mode_packed = 
+		sts->new_rev_mode_packed = 
+		sts->local_mode_packed = MODE_T_to_PACKED(sts->st.mode);
+
+	sts->st.ctim.tv_sec=rec->ctime;
+	sts->st.ctim.tv_nsec=rec->ctime_nsec;
+	sts->st.mtim.tv_sec=rec->mtime;
+	sts->st.mtim.tv_nsec=rec->mtime_nsec;
+	sts->st.nsec_known=rec->nsec_known;
+	sts->flags=rec->flags;
+	sts->st.size=rec->size;
+	sts->st.dev=rec->dev;
+	sts->st.ino=rec->ino;
+	sts->st.uid=rec->uid;
+	sts->st.gid=rec->gid;
+	sts->old_rev = sts->repos_rev = rec->revision;
+
+	if (S_ISDIR(sts->st.mode))
+		sts->entry_count=rec->entry_count;
+	else
+	{
+		STOPIF_CODE_ERR( rec->entry_count, EINVAL,
+				"Non-directory entry with children found");
+		memcpy(sts->md5, rec->md5, sizeof(sts->md5));
+	}
+
+	STOPIF( ops___load_url(sts, rec->url_intnum, rec->parent), NULL);
+
+	if (parent_i) *parent_i=rec->parent;
 
 ex:
 	return status;
@@ -969,6 +1098,8 @@ int ops__free_entry(struct estat **sts_p)
 	status=0;
 	if (sts->old)
 		STOPIF( ops__free_entry(& sts->old), NULL);
+	/* The mode might have changed, so always check the handle cache. */
+	ops___dir_fd_forget(sts);
 	if (S_ISDIR(sts->st.mode))
 	{
 		BUG_ON(sts->entry_count && !sts->by_inode);
@@ -1319,6 +1450,135 @@ ex:
 }
 
 
+/** \name Directory handles
+ *
+ * To avoid having the kernel walk the full path from the working copy 
+ * root for every entry, we keep a few directory handles open, and \c 
+ * lstat() relative to them.
+ *
+ * The handles are opened relative to the parent's handle, so even getting 
+ * a new one is only a single lookup; the root is the current working 
+ * directory.
+ *
+ * They're kept in a small cache indexed by the address of the struct \a 
+ * estat; ops__free_entry() removes an entry, and ops__dir_fd_flush() 
+ * closes all of them. As nothing here changes the working directory 
+ * anymore, the handles stay valid.
+ * @{ */
+/** How many directory handles are kept. Must be a power of 2. */
+#define OPS___DIR_FDS (32)
+
+/** Flags for opening the directory handles. \c O_PATH doesn't need read 
+ * permissions, like a path lookup. */
+#ifdef O_PATH
+#define OPS___DIR_FLAGS (O_PATH | O_DIRECTORY | O_NOFOLLOW)
+#else
+#define OPS___DIR_FLAGS (O_RDONLY | O_DIRECTORY | O_NOFOLLOW)
+#endif
+
+/** The cached handles. */
+static struct {
+	struct estat *dir;
+	int fd;
+} ops___dir_fds[OPS___DIR_FDS];
+
+
+/** Returns the cache slot for \a dir. */
+static inline int ops___dir_fd_slot(struct estat *dir)
+{
+	/* The estats are allocated in arrays, so the lower bits are mostly 
+	 * the same. */
+	return (((unsigned long)dir) / sizeof(*dir)) & (OPS___DIR_FDS-1);
+}
+
+
+/** Closes the handle cached for \a dir, if any. */
+static void ops___dir_fd_forget(struct estat *dir)
+{
+	int i;
+
+	i=ops___dir_fd_slot(dir);
+	if (ops___dir_fds[i].dir == dir)
+	{
+		close(ops___dir_fds[i].fd);
+		ops___dir_fds[i].dir=NULL;
+	}
+}
+
+
+/** -.
+ * The handle stays owned by the cache; it is valid until the next call of 
+ * a function from this group. */
+int ops__dir_fd(struct estat *dir, int *fd)
+{
+	int status, i, parent_fd;
+
+
+	status=0;
+	if (!dir->parent)
+	{
+		*fd=AT_FDCWD;
+		goto ex;
+	}
+
+	i=ops___dir_fd_slot(dir);
+	if (ops___dir_fds[i].dir == dir)
+	{
+		*fd=ops___dir_fds[i].fd;
+		goto ex;
+	}
+
+	/* No STOPIF here - the caller can use the full path instead. */
+	status=ops__dir_fd(dir->parent, &parent_fd);
+	if (status) goto ex;
+
+	*fd=openat(parent_fd, dir->name, OPS___DIR_FLAGS);
+	if (*fd == -1)
+	{
+		status=errno;
+		DEBUGP("openat(%s): %d", dir->name, status);
+		goto ex;
+	}
+
+	/* The parent's handle might be in the same slot; it's not needed 
+	 * anymore. */
+	if (ops___dir_fds[i].dir)
+		close(ops___dir_fds[i].fd);
+	ops___dir_fds[i].dir=dir;
+	ops___dir_fds[i].fd=*fd;
+
+ex:
+	return status;
+}
+
+
+/** -.
+ * */
+void ops__dir_fd_flush(void)
+{
+	int i;
+
+	for(i=0; i<OPS___DIR_FDS; i++)
+		if (ops___dir_fds[i].dir)
+			ops___dir_fd_forget(ops___dir_fds[i].dir);
+}
+
+
+/** -.
+ * If the parent directory has a handle we use that; else \a fullpath is 
+ * taken, which gives the same results and error codes. */
+int ops__lstat(struct estat *sts, char *fullpath, struct sstat_t *st)
+{
+	int fd;
+
+	if (sts->parent && ops__dir_fd(sts->parent, &fd) == 0)
+		return hlp__lstat_at(fd, sts->name, st);
+
+	return hlp__lstat(fullpath, st);
+}
+/** @} */
+
+
 /** -.
  *
  * The parent directory should already be done, so that removal of whole 
@@ -1352,8 +1612,8 @@ int ops__update_single_entry(struct estat *sts, struct sstat_t *output)
 			goto removed_memset;
 		}
 
-	/* Check for current status */
-	status=hlp__lstat(fullpath, &st);
+	/* Check for current status; possibly already fetched by a thread. */
+	status=pf__lstat(sts, fullpath, &st);
 
 	if (status)
 	{
@@ -1389,8 +1649,8 @@ removed_memset:
 			 * So if we get here, we can check either type - st or sts->st. */
 			if (S_ISREG(st.mode) || S_ISLNK(st.mode))
 			{
-				/* make sure, one way or another */
-				STOPIF( cs__compare_file(sts, fullpath, &i), NULL);
+				/* make sure, one way or another; maybe a thread did it already. */
+				STOPIF( pf__compare_file(sts, fullpath, &i), NULL);
 
 				if (i>0)
 					sts->entry_status= (sts->entry_status & ~ FS_LIKELY) | FS_CHANGED;
@@ -22,6 +22,10 @@
 /** Return the path of this entry. */
 int ops__build_path(char **path, 
 		struct estat *sts);
+/** Writes the path of this entry into the given buffer, with a trailing 
+ * \c PATH_SEPARATOR; returns the number of characters, or \c 0 if \a max 
+ * is too small. */
+int ops__build_path2(char *path, int max, struct estat *sts);
 /** Calculate the length of the path for this entry. */
 int ops__calc_path_len(struct estat *sts);
 /** Compare the \c struct \c sstat_t , and set the \c entry_status. */
@@ -60,16 +64,28 @@ int ops__new_entries(struct estat *dir,
 		int count,
 		struct estat **new_entries);
 
-/** Writes a textual description of the given \a sts to the \a filehandle.  
- * */
+/** Returns a textual description of the given \a sts in \a line. */
 int ops__save_1entry(struct estat *sts,
 		ino_t parent_ino,
-		int filehandle);
+		char **line, int *length);
 /** Fills \a sts from a buffer \a where. */
 int ops__load_1entry(char **where, struct estat *sts, char **filename,
 		ino_t *parent_i);
+/** Fills the binary \ref dir record \a rec from \a sts. */
+int ops__save_1record(struct estat *sts,
+		ino_t parent_ino, unsigned name_offset,
+		struct waa__dir_record_t *rec);
+/** Fills \a sts from the binary record \a rec. */
+int ops__load_1record(const struct waa__dir_record_t *rec, 
+		struct estat *sts, ino_t *parent_i);
 /** Does a \c lstat() on the given entry, and sets the \c entry_status. */
 int ops__update_single_entry(struct estat *sts, struct sstat_t *output);
+/** Returns a (cached) handle for the directory \a dir. */
+int ops__dir_fd(struct estat *dir, int *fd);
+/** Closes all cached directory handles. */
+void ops__dir_fd_flush(void);
+/** Does a \c lstat() of \a sts, relative to the parent's handle. */
+int ops__lstat(struct estat *sts, char *fullpath, struct sstat_t *st);
 /** Wrapper for \c ops__update_single_entry and some more. */
 int ops__update_filter_set_bits(struct estat *sts);
 
@@ -204,5 +220,36 @@ static inline int ops__has_children(struct estat *sts)
 	return S_ISDIR(sts->st.mode) && sts->entry_count;
 }
 
+/** Whether the timestamp \a new differs from \a old.
+ *
+ * The nanoseconds are only compared if \a nsec_known is set, ie. if both 
+ * \c sstat_t::nsec_known are; the text format of the \ref dir file 
+ * doesn't store them. */
+static inline int ops__time_changed(const struct timespec *old, 
+		const struct timespec *new, int nsec_known)
+{
+	return old->tv_sec != new->tv_sec ||
+		(nsec_known && old->tv_nsec != new->tv_nsec);
+}
+
+/** Whether a file or symlink with unchanged size is likely to be changed, 
+ * ie. whether ops__stat_to_action() would give \c FS_LIKELY.
+ *
+ * Doesn't look at the struct \ref estat, so it can be used in other 
+ * threads, too; \a is_copy should be <tt>(sts->flags & 
+ * RF___IS_COPY)</tt>.
+ *
+ * If the entry is copied, the ctime \b must be different (unless it's a 
+ * hardlink); here we assume that it's not changed, if the mtime is the 
+ * same. */
+static inline int ops__stat_likely_changed(const struct sstat_t *old, 
+		const struct sstat_t *new, int is_copy)
+{
+	int nsec_known=old->nsec_known && new->nsec_known;
+
+	return ops__time_changed(&old->mtim, &new->mtim, nsec_known) ||
+		(ops__time_changed(&old->ctim, &new->ctim, nsec_known) && !is_copy);
+}
+
 
 #endif
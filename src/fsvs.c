@@ -309,6 +309,11 @@
  * If you have a running FSVS, and you want to change its verbosity, you can send the process either
  * \c SIGUSR1 (to make it more verbose) or \c SIGUSR2 (more quiet). 
  *
+ * If a read limit is configured (see \ref o_io_limit), \c SIGHUP 
+ * switches the throttling of file reads on or off; \b note that FSVS then 
+ * doesn't terminate on a hangup anymore. Without a limit \c SIGHUP keeps 
+ * its default action.
+ *
  */
 
 
@@ -698,6 +703,9 @@ const char* Version(FILE *output)
 #ifdef HAVE_LUTIMES
 				STRINGIFY(HAVE_LUTIMES)
 #endif
+#ifdef HAVE_UTIMENSAT
+				STRINGIFY(HAVE_UTIMENSAT)
+#endif
 #ifdef HAVE_LCHOWN
 				STRINGIFY(HAVE_LCHOWN)
 #endif
@@ -849,7 +857,6 @@ void sigUSR2(int num)
 		opt__set_int(OPT__VERBOSE, PRIO_MUSTHAVE, VERBOSITY_QUIET);
 }
 
-
 /** Handler for SIGPIPE.
  * We give the running action a single chance to catch an \c EPIPE, to 
  * clean up on open files and similar; if it doesn't take this chance, the 
@@ -1383,6 +1390,7 @@ int main(int argc, char *args[], char *env[])
 	 * environment. */
 	strcpy(conf_tmp_fn, "config");
 	STOPIF( opt__load_settings(conf_tmp_path, NULL, PRIO_ETC_FILE ), NULL);
+	cs__throttle_signal();
 
 
 #ifdef ENABLE_DEBUG
@@ -1409,6 +1417,9 @@ int main(int argc, char *args[], char *env[])
 	STOPIF( action->work(&root, argc-optind, args+optind), 
 			"action %s failed", action->name[0]);
 
+	if (opt__get_int(OPT__HASH_STATS))
+		STOPIF( cs__print_stats(stdout), NULL);
+
 	/* Remove copyfrom records in the database, if any to do. */
 	STOPIF( cm__get_source(NULL, NULL, NULL, NULL, status), 
 			NULL);
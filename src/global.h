@@ -282,6 +282,11 @@ struct sstat_t {
 	uid_t uid;
 	/** The group number. */
 	gid_t gid;
+
+	/** Whether the nanoseconds of \c mtim and \c ctim are known; they're 
+	 * not stored in the text format of the \ref dir file, and the system 
+	 * might not have them. See ops__time_changed(). */
+	unsigned nsec_known:1;
 };
 
 
@@ -433,6 +438,10 @@ struct estat {
 
 	/** Flags for this entry. See \ref EntFlags "Various flags for entries" for constant definitions. */
 	uint32_t flags;
+	/** Number of this entry in the \ref dir file (and its \ref dirlog 
+	 * "journal"), as loaded by waa__input_tree(); \c 0 for entries that 
+	 * aren't stored yet. */
+	uint32_t waa_index;
 
 
 	/** Packed representations of the file type; see \c preproc.h for 
@@ -312,11 +312,13 @@ hlp__copy_stats(struct stat *src, struct sstat_t *dest)
 #ifdef HAVE_STRUCT_STAT_ST_MTIM
 	dest->mtim=src->st_mtim;
 	dest->ctim=src->st_ctim;
+	dest->nsec_known=1;
 #else
 	dest->mtim.tv_sec=src->st_mtime;
 	dest->mtim.tv_nsec=0;
 	dest->ctim.tv_sec=src->st_ctime;
 	dest->ctim.tv_nsec=0;
+	dest->nsec_known=0;
 #endif
 }
 
@@ -336,13 +338,47 @@ hlp__copy_stats(struct stat *src, struct sstat_t *dest)
  * these would follow the symlinks and return the wrong meta-data. 
  * */
 /** @{ */
+/** -.
+ * Used for the results of \a lstat() and similar calls, so that all of 
+ * them give the same data. */
+int hlp__stat_result(struct stat *st64, struct sstat_t *st)
+{
+	int status;
+
+	status=0;
+	/* FIFOs or sockets are never interesting; they get filtered out by 
+	 * pretending that they don't exist. */
+	/* We should return -ENOENT here, so that higher levels can give 
+	 * different error messages ... it might be confusing if "fsvs info 
+	 * socket" denies some existing entry. */
+	if (S_ISFIFO(st64->st_mode) || S_ISSOCK(st64->st_mode) || S_ISDOOR(st64->st_mode))
+	{
+		st64->st_mode = (st64->st_mode & ~S_IFMT) | S_IFGARBAGE;
+		status=-ENOENT;
+	}
+
+	if (st)
+		hlp__copy_stats(st64, st);
+
+	return status;
+}
+
+
 /** A wrapper for \a lstat(). */
 int hlp__lstat(const char *fn, struct sstat_t *st)
+{
+	return hlp__lstat_at(AT_FDCWD, fn, st);
+}
+
+
+/** A wrapper for \a fstatat(), with \a fn relative to the directory \a 
+ * dir_fd; like \a lstat() the last component is never followed. */
+int hlp__lstat_at(int dir_fd, const char *fn, struct sstat_t *st)
 {
 	int status;
 	struct stat st64;
 
-	status=lstat(fn, &st64);
+	status=fstatat(dir_fd, fn, &st64, AT_SYMLINK_NOFOLLOW);
 	if (status == 0) 
 	{
 		DEBUGP("%s: uid=%llu gid=%llu mode=0%llo dev=0x%llx "
@@ -352,19 +388,7 @@ int hlp__lstat(const char *fn, struct sstat_t *st)
 				(t_ull)st64.st_dev, (t_ull)st64.st_ino, 
 				(t_ull)st64.st_rdev, (t_ull)st64.st_size);
 
-		/* FIFOs or sockets are never interesting; they get filtered out by 
-		 * pretending that they don't exist. */
-		/* We should return -ENOENT here, so that higher levels can give 
-		 * different error messages ... it might be confusing if "fsvs info 
-		 * socket" denies some existing entry. */
-		if (S_ISFIFO(st64.st_mode) || S_ISSOCK(st64.st_mode) || S_ISDOOR(st64.st_mode))
-		{
-			st64.st_mode = (st64.st_mode & ~S_IFMT) | S_IFGARBAGE;
-			status=-ENOENT;
-		}
-
-		if (st)
-			hlp__copy_stats(&st64, st);
+		status=hlp__stat_result(&st64, st);
 	}
 	else
 	{
@@ -1841,9 +1865,41 @@ ex:
 }
 
 
+/** -. */
+int hlp__stream_copy(svn_stream_t *from, svn_stream_t *to)
+{
+	int status;
+	svn_error_t *status_svn;
+	const int buffer_size=16384;
+	char *buffer;
+	apr_size_t len, written;
+
+
+	status=0;
+	buffer=NULL;
+	STOPIF( hlp__alloc( &buffer, buffer_size), NULL);
+
+	len=buffer_size;
+	while (len == buffer_size)
+	{
+		STOPIF_SVNERR( svn_stream_read, (from, buffer, &len));
+		written=len;
+		STOPIF_SVNERR( svn_stream_write, (to, buffer, &written));
+		STOPIF_CODE_ERR( written != len, EIO, "Short write");
+	}
+
+	STOPIF_SVNERR( svn_stream_close, (from));
+	STOPIF_SVNERR( svn_stream_close, (to));
+
+ex:
+	IF_FREE(buffer);
+	return status;
+}
+
+
 /** Delays execution until the next second.
- * Needed because of filesystem granularities; FSVS only stores seconds, 
- * not more. */
+ * Needed because of filesystem granularities; the text format of the \ref 
+ * dir file stores only seconds, and not all filesystems have more. */
 int hlp__delay(time_t start, enum opt__delay_e which)
 {
 	if (opt__get_int(OPT__DELAY) & which)
@@ -2106,6 +2162,44 @@ int hlp__compare_string_pointers(const void *a, const void *b)
 }
 
 
+/** -.
+ * This is a Fletcher-like sum over 64bit words, without the modulo; it's 
+ * not cryptographically strong, but fast enough to be used on every load 
+ * of big files, and catches truncation, zeroed blocks and similar damage.
+ *
+ * \a sum has to be zeroed before the first call; all calls for a stream, 
+ * except the last, must have a multiple of 8 bytes, as the last partial 
+ * word is padded with zeroes. */
+void hlp__checksum(struct hlp__checksum_t *sum, const void *data, size_t len)
+{
+	const unsigned char *cp=data;
+	uint64_t a, b, word;
+
+
+	a=sum->a;
+	b=sum->b;
+	while (len >= sizeof(word))
+	{
+		memcpy(&word, cp, sizeof(word));
+		a += word;
+		b += a;
+		cp += sizeof(word);
+		len -= sizeof(word);
+	}
+
+	if (len)
+	{
+		word=0;
+		memcpy(&word, cp, len);
+		a += word;
+		b += a;
+	}
+
+	sum->a=a;
+	sum->b=b;
+}
+
+
 int hlp__only_dir_mtime_changed(struct estat *sts) 
 {
 	int st;
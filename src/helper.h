@@ -55,6 +55,10 @@ int hlp__utf82local(const char* utf8_string, char** local_string, int len);
 
 void hlp__copy_stats(struct stat *src, struct sstat_t *dest);
 int hlp__lstat(const char *fn, struct sstat_t *st);
+/** \a lstat() relative to a directory handle. */
+int hlp__lstat_at(int dir_fd, const char *fn, struct sstat_t *st);
+/** Converts a \c struct \c stat like hlp__lstat() does. */
+int hlp__stat_result(struct stat *st64, struct sstat_t *st);
 int hlp__fstat(int fd, struct sstat_t *st);
 
 /** A function like \a strcpy, but cleaning up paths. */
@@ -166,6 +170,8 @@ int hlp__is_special_property_name(const char *name);
 /** Reads all data from \a stream and drops it. */
 int hlp__stream_md5(svn_stream_t *stream, 
 		unsigned char md5[APR_MD5_DIGESTSIZE]);
+/** Copies all data from \a from to \a to, and closes both. */
+int hlp__stream_copy(svn_stream_t *from, svn_stream_t *to);
 
 /** Delay until time wraps. */
 int hlp__delay(time_t start, enum opt__delay_e which);
@@ -234,4 +240,11 @@ int hlp__compare_string_pointers(const void *a, const void *b);
 
 int hlp__only_dir_mtime_changed(struct estat *sts);
 
+/** State of hlp__checksum(). */
+struct hlp__checksum_t {
+	uint64_t a, b;
+};
+/** Adds \a len bytes at \a data to the checksum \a sum. */
+void hlp__checksum(struct hlp__checksum_t *sum, const void *data, size_t len);
+
 #endif
@@ -1613,6 +1613,76 @@ ex:
 }
 
 
+/** Matches the path \a cp (with length \a len) against the shell or 
+ * PCRE pattern \a ign.
+ * Returns \c 0 for a match, \c PCRE2_ERROR_NOMATCH if it doesn't; the 
+ * \a mode is used for the \c dir_only and mode checks.  */
+static int ign___match_pcre(struct ignore_t *ign, char *cp, int len,
+		mode_t mode)
+{
+	int status;
+	static int pcre2_match_data_size = 2;
+	static pcre2_match_data *match_data = NULL;
+
+
+	if (!match_data) {
+		match_data = pcre2_match_data_create(pcre2_match_data_size, NULL);
+		STOPIF_ENOMEM(!match_data);
+	}
+
+	DEBUGP("matching %s(0%o) against \"%s\" "
+			"(dir_only=%d; and=0%o, cmp=0%o)",
+			cp, mode, ign->pattern, ign->dir_only,
+			ign->mode_match_and, ign->mode_match_cmp);
+	if (ign->dir_only && !S_ISDIR(mode))
+	{
+		status=PCRE2_ERROR_NOMATCH;
+	}
+	else if (ign->mode_match_and && 
+			((mode & ign->mode_match_and) != ign->mode_match_cmp))
+	{
+		status=PCRE2_ERROR_NOMATCH;
+	}
+	else if (ign->compiled)
+	{
+		while (1) {
+			status=pcre2_match(ign->compiled,
+					(unsigned char*)cp, len,
+					0, 0,
+					match_data, 0);
+			DEBUGP("match %s against %s: %d", cp, ign->pattern, status);
+
+			if (status > 0) {
+				/* Matched. */
+				status = 0;
+				break;
+			} else if (status == 0) {
+				/* Too small */
+				pcre2_match_data_free(match_data);
+				pcre2_match_data_size += 5;
+
+				DEBUGP("match_data too small, realloc with %d", pcre2_match_data_size);
+				match_data = pcre2_match_data_create(pcre2_match_data_size, NULL);
+				if (!match_data)
+					STOPIF_ENOMEM(!match_data);
+				/* Try again. */
+			} else if (status == PCRE2_ERROR_NOMATCH) {
+				/* OK */
+				break;
+			} else {
+				STOPIF(status, "cannot match pattern %s on data %s",
+						ign->pattern, cp);
+			}
+		}
+	}
+	else
+		status=PCRE2_ERROR_NOMATCH;
+
+ex:
+	return status;
+}
+
+
 /** -.
  *
  * Searches this entry for a take/ignore pattern.
@@ -1639,8 +1709,6 @@ int ign__is_ignore(struct estat *sts,
 	struct ignore_t *ign;
 	struct sstat_t *st;
 	struct estat sts_cmp;
-	static int pcre2_match_data_size = 2;
-	static pcre2_match_data *match_data = NULL;
 
 
 	*is_ignored=0;
@@ -1655,11 +1723,6 @@ int ign__is_ignore(struct estat *sts,
 		goto ex;
 	}
 
-	if (!match_data) {
-		match_data = pcre2_match_data_create(pcre2_match_data_size, NULL);
-		STOPIF_ENOMEM(!match_data);
-	}
-
 	/* TODO - see ign__set_ignorelist() */ 
 	/* currently all entries are checked against the full ignore list -
 	 * not good performance-wise! */
@@ -1679,51 +1742,9 @@ int ign__is_ignore(struct estat *sts,
 		if (ign->type == PT_SHELL || ign->type == PT_PCRE ||
 				ign->type == PT_SHELL_ABS)
 		{
-			DEBUGP("matching %s(0%o) against \"%s\" "
-					"(dir_only=%d; and=0%o, cmp=0%o)",
-					cp, sts->st.mode, ign->pattern, ign->dir_only,
-					ign->mode_match_and, ign->mode_match_cmp);
-			if (ign->dir_only && !S_ISDIR(sts->st.mode))
-			{
-				status=PCRE2_ERROR_NOMATCH;
-			}
-			else if (ign->mode_match_and && 
-					((sts->st.mode & ign->mode_match_and) != ign->mode_match_cmp))
-			{
-				status=PCRE2_ERROR_NOMATCH;
-			}
-			else if (ign->compiled)
-			{
-				while (1) {
-					status=pcre2_match(ign->compiled,
-							(unsigned char*)cp, len,
-							0, 0,
-							match_data, 0);
-					DEBUGP("match %s against %s: %d", cp, ign->pattern, status);
-
-					if (status > 0) {
-						/* Matched. */
-						status = 0;
-						break;
-					} else if (status == 0) {
-						/* Too small */
-						pcre2_match_data_free(match_data);
-						pcre2_match_data_size += 5;
-
-						DEBUGP("match_data too small, realloc with %d", pcre2_match_data_size);
-						match_data = pcre2_match_data_create(pcre2_match_data_size, NULL);
-						if (!match_data)
-							STOPIF_ENOMEM(!match_data);
-						/* Try again. */
-					} else if (status == PCRE2_ERROR_NOMATCH) {
-						/* OK */
-						break;
-					} else {
-						STOPIF(status, "cannot match pattern %s on data %s",
-								ign->pattern, cp);
-					}
-				}
-			}
+			status=ign___match_pcre(ign, cp, len, sts->st.mode);
+			if (status != PCRE2_ERROR_NOMATCH)
+				STOPIF( status, NULL);
 		}
 		else if (ign->type == PT_DEVICE)
 		{
@@ -1783,6 +1804,73 @@ ex:
 }
 
 
+/** -.
+ *
+ * Used by dir__enumerator() before the entry is \c lstat()ed; only the 
+ * name and the file type from \c getdents() (in \c sts->st.mode, \c 0 if 
+ * unknown) are available.
+ *
+ * The patterns are checked in order, like in ign__is_ignore(); as soon as 
+ * a pattern needs more data (device, inode, permission bits, or the type 
+ * of an entry of unknown type) we stop, and \a is_ignored is \c 0.
+ * Only if an \e ignore pattern matches first is \a is_ignored set to \c 
+ * +1; a \e take pattern returns \c 0, too, as the entry needs its 
+ * meta-data anyway.
+ *
+ * The statistics are only changed for ignored entries; all others go 
+ * through ign__is_ignore() later, which counts them. */
+int ign__is_ignore_by_name(struct estat *sts, int *is_ignored)
+{
+	int status, len, i, j;
+	char *cp;
+	struct ignore_t *ign;
+
+
+	*is_ignored=0;
+	status=0;
+	if (!sts->parent) goto ex;
+
+	STOPIF( ops__build_path(&cp, sts), NULL);
+	len=strlen(cp);
+
+	for(i=0; i<used_ignore_entries; i++)
+	{
+		ign=ignore_list+i;
+
+		if (ign->type != PT_SHELL && ign->type != PT_PCRE &&
+				ign->type != PT_SHELL_ABS)
+			goto ex;
+		if (ign->mode_match_and & ~S_IFMT)
+			goto ex;
+		if ((ign->dir_only || ign->mode_match_and) && 
+				!(sts->st.mode & S_IFMT))
+			goto ex;
+
+		if (!ign->group_def)
+			STOPIF( ign___load_group(ign), NULL);
+
+		status=ign___match_pcre(ign, cp, len, sts->st.mode);
+		if (status == PCRE2_ERROR_NOMATCH) continue;
+		STOPIF( status, NULL);
+
+		if (ign->group_def->is_ignore)
+		{
+			DEBUGP("%s ignored by name", cp);
+			for(j=0; j<=i; j++)
+				ignore_list[j].stats_tested++;
+			ign->stats_matches++;
+
+			*is_ignored=1;
+			sts->match_pattern=ign;
+		}
+		goto ex;
+	}
+
+ex:
+	return status;
+}
+
+
 /** Writes the ignore list back to disk storage.
  * */
 int ign__save_ignorelist(char *basedir)
@@ -48,6 +48,8 @@ int ign__new_pattern(unsigned count,
 		int user_pattern, int position);
 /** Tells whether the given entry is to be ignored. */
 int ign__is_ignore(struct estat *sts, int *is_ignored);
+/** Tells whether the entry is ignored, without needing its meta-data. */
+int ign__is_ignore_by_name(struct estat *sts, int *is_ignored);
 /** Loads the ignore list from the WAA. */
 int ign__load_list(char *dir);
 
@@ -120,12 +120,19 @@
 #define CS__MANBER_MODULUS (-1)
 /** The prime number used for generation of the hash. */
 #define CS__MANBER_PRIME (31)
+/** The multiplier for the 64bit hash that's stored in the binary \ref 
+ * md5s files; the block borders are still found by the 32bit one. */
+#define CS__MANBER_PRIME64 (0x100000001b3ULL)
 /** The number of bytes for the block comparison.
  * Must be a power of 2 for performance reasons. */
 #define CS__MANBER_BACKTRACK (2*1024)
 #if (CS__MANBER_BACKTRACK-1) & CS__MANBER_BACKTRACK
 #error CS__MANBER_BACKTRACK must be a power of 2!
 #endif
+/** The minimum and maximum size of the blocks found by the gear hash, 
+ * see \ref md5s_gear. */
+#define CS__GEAR_MIN_SIZE (1 << (CS__APPROX_BLOCKSIZE_BITS-2))
+#define CS__GEAR_MAX_SIZE (1 << (CS__APPROX_BLOCKSIZE_BITS+3))
 
 /** The minimum filesize, at or above which files get
  * tested in blocks.
@@ -142,7 +149,10 @@
 #define CHOWN_BOOL 0
 #endif
 
-#ifdef HAVE_LUTIMES
+#if defined(HAVE_UTIMENSAT)
+/* utimensat() is called directly, as it takes a \c timespec. */
+#define UTIMES_BOOL 1
+#elif defined(HAVE_LUTIMES)
 #define UTIMES_FUNC lutimes
 #define UTIMES_BOOL 1
 #else
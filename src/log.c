@@ -299,7 +299,7 @@ int log__work(struct estat *root, int argc, char *argv[])
 
 	STOPIF( waa__find_common_base( argc, argv, &normalized), NULL);
 	STOPIF( url__load_nonempty_list(NULL, 0), NULL);
-	STOPIF( waa__input_tree(root, NULL, NULL), NULL);
+	STOPIF( waa__input_subtrees(root, argc, normalized, NULL, NULL), NULL);
 
 	if (argc)
 	{
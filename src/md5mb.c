@@ -0,0 +1,345 @@
+/************************************************************************
+ * Copyright (C) 2026 Philipp Marek.
+ *
+ * This program is free software;  you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ ************************************************************************/
+
+#include <stdint.h>
+#include <string.h>
+#include <apr_md5.h>
+
+#include "global.h"
+#include "md5mb.h"
+
+
+/** \file
+ * Multi-buffer MD5.
+ * */
+
+/** \defgroup md5mb Hashing several small files at once
+ * \ingroup perf
+ *
+ * For small files the time for a change check goes mostly into the
+ * per-file setup and the scalar MD5; the MD5 of a single buffer can't be
+ * done in parallel, as every step depends on the one before.
+ *
+ * But the MD5s of different buffers are independent; so here
+ * #MD5MB__LANES buffers are hashed at once, each in one 32bit lane of
+ * the vector registers. When a buffer is done, the next one is started in
+ * its lane, so that buffers of different lengths can be mixed.
+ *
+ * The code uses the GCC vector extensions; it's compiled twice, once for
+ * the base instruction set (on x86_64 that's SSE2, where a vector is
+ * split into two registers), and once for AVX2. Which one is used is
+ * decided at runtime by asking the CPU.
+ * Other compilers get the scalar \c apr_md5().
+ *
+ * See cs__compare_small() for the users.
+ * @{ */
+
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__))
+#define MD5MB___VECTOR 1
+#if defined(__x86_64__) || defined(__i386__)
+#define MD5MB___X86 1
+#endif
+#endif
+
+
+#ifdef MD5MB___VECTOR
+/** One vector, with a 32bit value per lane. */
+typedef uint32_t md5mb___v __attribute__((vector_size(4*MD5MB__LANES)));
+
+/** The state of one lane. */
+struct md5mb___lane_t
+{
+	/** The job, or \c NULL if the lane is idle. */
+	struct md5mb__job_t *job;
+	/** The next full block of the data. */
+	const unsigned char *data;
+	/** How many full blocks are left. */
+	size_t full;
+	/** The last (partial) block with the padding and the length; 1 or 2
+	 * blocks. */
+	unsigned char tail[128];
+	unsigned tail_blocks, tail_done;
+};
+
+
+/** The initial values. */
+static const uint32_t md5mb___iv[4] = {
+	0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476
+};
+
+/** Input for an idle lane. */
+static const unsigned char md5mb___zero_block[64];
+
+
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) ((y) ^ ((z) & ((x) ^ (y))))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define I(x, y, z) ((y) ^ ((x) | ~(z)))
+#define STEP(f, a, b, c, d, x, t, s) \
+	do { \
+		(a) += f((b), (c), (d)) + (x) + (uint32_t)(t); \
+		(a) = ((a) << (s)) | ((a) >> (32 - (s))); \
+		(a) += (b); \
+	} while (0)
+
+
+static inline uint32_t md5mb___le32(const unsigned char *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+		((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+/** Starts \a job in \a lane. */
+static void md5mb___load(struct md5mb___lane_t *lane,
+		struct md5mb__job_t *job)
+{
+	size_t rest;
+	uint64_t bits;
+	int i;
+
+
+	lane->job=job;
+	lane->data=job->data;
+	lane->full=job->len / 64;
+	rest=job->len % 64;
+
+	memset(lane->tail, 0, sizeof(lane->tail));
+	memcpy(lane->tail, job->data + lane->full*64, rest);
+	lane->tail[rest]=0x80;
+	lane->tail_blocks= rest < 56 ? 1 : 2;
+	lane->tail_done=0;
+
+	bits=(uint64_t)job->len * 8;
+	for(i=0; i<8; i++)
+		lane->tail[lane->tail_blocks*64 - 8 + i]=bits >> (8*i);
+}
+
+
+/** Returns the next block for \a lane. */
+static inline const unsigned char *md5mb___next(struct md5mb___lane_t *lane)
+{
+	const unsigned char *p;
+
+	if (!lane->job) return md5mb___zero_block;
+
+	if (lane->full)
+	{
+		p=lane->data;
+		lane->data+=64;
+		lane->full--;
+		return p;
+	}
+
+	return lane->tail + 64 * lane->tail_done++;
+}
+
+
+/** The MD5 transformation, for a block in each lane. */
+static inline __attribute__((always_inline))
+void md5mb___transform(md5mb___v *state, const md5mb___v *x)
+{
+	md5mb___v a=state[0], b=state[1], c=state[2], d=state[3];
+
+	STEP(F, a, b, c, d, x[ 0], 0xd76aa478,  7);
+	STEP(F, d, a, b, c, x[ 1], 0xe8c7b756, 12);
+	STEP(F, c, d, a, b, x[ 2], 0x242070db, 17);
+	STEP(F, b, c, d, a, x[ 3], 0xc1bdceee, 22);
+	STEP(F, a, b, c, d, x[ 4], 0xf57c0faf,  7);
+	STEP(F, d, a, b, c, x[ 5], 0x4787c62a, 12);
+	STEP(F, c, d, a, b, x[ 6], 0xa8304613, 17);
+	STEP(F, b, c, d, a, x[ 7], 0xfd469501, 22);
+	STEP(F, a, b, c, d, x[ 8], 0x698098d8,  7);
+	STEP(F, d, a, b, c, x[ 9], 0x8b44f7af, 12);
+	STEP(F, c, d, a, b, x[10], 0xffff5bb1, 17);
+	STEP(F, b, c, d, a, x[11], 0x895cd7be, 22);
+	STEP(F, a, b, c, d, x[12], 0x6b901122,  7);
+	STEP(F, d, a, b, c, x[13], 0xfd987193, 12);
+	STEP(F, c, d, a, b, x[14], 0xa679438e, 17);
+	STEP(F, b, c, d, a, x[15], 0x49b40821, 22);
+
+	STEP(G, a, b, c, d, x[ 1], 0xf61e2562,  5);
+	STEP(G, d, a, b, c, x[ 6], 0xc040b340,  9);
+	STEP(G, c, d, a, b, x[11], 0x265e5a51, 14);
+	STEP(G, b, c, d, a, x[ 0], 0xe9b6c7aa, 20);
+	STEP(G, a, b, c, d, x[ 5], 0xd62f105d,  5);
+	STEP(G, d, a, b, c, x[10], 0x02441453,  9);
+	STEP(G, c, d, a, b, x[15], 0xd8a1e681, 14);
+	STEP(G, b, c, d, a, x[ 4], 0xe7d3fbc8, 20);
+	STEP(G, a, b, c, d, x[ 9], 0x21e1cde6,  5);
+	STEP(G, d, a, b, c, x[14], 0xc33707d6,  9);
+	STEP(G, c, d, a, b, x[ 3], 0xf4d50d87, 14);
+	STEP(G, b, c, d, a, x[ 8], 0x455a14ed, 20);
+	STEP(G, a, b, c, d, x[13], 0xa9e3e905,  5);
+	STEP(G, d, a, b, c, x[ 2], 0xfcefa3f8,  9);
+	STEP(G, c, d, a, b, x[ 7], 0x676f02d9, 14);
+	STEP(G, b, c, d, a, x[12], 0x8d2a4c8a, 20);
+
+	STEP(H, a, b, c, d, x[ 5], 0xfffa3942,  4);
+	STEP(H, d, a, b, c, x[ 8], 0x8771f681, 11);
+	STEP(H, c, d, a, b, x[11], 0x6d9d6122, 16);
+	STEP(H, b, c, d, a, x[14], 0xfde5380c, 23);
+	STEP(H, a, b, c, d, x[ 1], 0xa4beea44,  4);
+	STEP(H, d, a, b, c, x[ 4], 0x4bdecfa9, 11);
+	STEP(H, c, d, a, b, x[ 7], 0xf6bb4b60, 16);
+	STEP(H, b, c, d, a, x[10], 0xbebfbc70, 23);
+	STEP(H, a, b, c, d, x[13], 0x289b7ec6,  4);
+	STEP(H, d, a, b, c, x[ 0], 0xeaa127fa, 11);
+	STEP(H, c, d, a, b, x[ 3], 0xd4ef3085, 16);
+	STEP(H, b, c, d, a, x[ 6], 0x04881d05, 23);
+	STEP(H, a, b, c, d, x[ 9], 0xd9d4d039,  4);
+	STEP(H, d, a, b, c, x[12], 0xe6db99e5, 11);
+	STEP(H, c, d, a, b, x[15], 0x1fa27cf8, 16);
+	STEP(H, b, c, d, a, x[ 2], 0xc4ac5665, 23);
+
+	STEP(I, a, b, c, d, x[ 0], 0xf4292244,  6);
+	STEP(I, d, a, b, c, x[ 7], 0x432aff97, 10);
+	STEP(I, c, d, a, b, x[14], 0xab9423a7, 15);
+	STEP(I, b, c, d, a, x[ 5], 0xfc93a039, 21);
+	STEP(I, a, b, c, d, x[12], 0x655b59c3,  6);
+	STEP(I, d, a, b, c, x[ 3], 0x8f0ccc92, 10);
+	STEP(I, c, d, a, b, x[10], 0xffeff47d, 15);
+	STEP(I, b, c, d, a, x[ 1], 0x85845dd1, 21);
+	STEP(I, a, b, c, d, x[ 8], 0x6fa87e4f,  6);
+	STEP(I, d, a, b, c, x[15], 0xfe2ce6e0, 10);
+	STEP(I, c, d, a, b, x[ 6], 0xa3014314, 15);
+	STEP(I, b, c, d, a, x[13], 0x4e0811a1, 21);
+	STEP(I, a, b, c, d, x[ 4], 0xf7537e82,  6);
+	STEP(I, d, a, b, c, x[11], 0xbd3af235, 10);
+	STEP(I, c, d, a, b, x[ 2], 0x2ad7d2bb, 15);
+	STEP(I, b, c, d, a, x[ 9], 0xeb86d391, 21);
+
+	state[0]+=a;
+	state[1]+=b;
+	state[2]+=c;
+	state[3]+=d;
+}
+
+
+/** Runs the jobs through the lanes; compiled once per instruction set.
+ * */
+static inline __attribute__((always_inline))
+void md5mb___run(struct md5mb__job_t *jobs, unsigned count)
+{
+	struct md5mb___lane_t lanes[MD5MB__LANES];
+	const unsigned char *blocks[MD5MB__LANES];
+	md5mb___v state[4], x[16];
+	unsigned next, active;
+	int i, j;
+	uint32_t w;
+
+
+	next=active=0;
+	for(i=0; i<MD5MB__LANES; i++)
+	{
+		for(j=0; j<4; j++)
+			state[j][i]=md5mb___iv[j];
+
+		if (next < count)
+		{
+			md5mb___load(lanes+i, jobs + next++);
+			active++;
+		}
+		else
+			lanes[i].job=NULL;
+	}
+
+	while (active)
+	{
+		for(i=0; i<MD5MB__LANES; i++)
+			blocks[i]=md5mb___next(lanes+i);
+
+		/* Transpose, so that each vector has one word of every block. */
+		for(j=0; j<16; j++)
+			for(i=0; i<MD5MB__LANES; i++)
+				x[j][i]=md5mb___le32(blocks[i] + 4*j);
+
+		md5mb___transform(state, x);
+
+		for(i=0; i<MD5MB__LANES; i++)
+		{
+			if (!lanes[i].job || lanes[i].tail_done < lanes[i].tail_blocks)
+				continue;
+
+			for(j=0; j<4; j++)
+			{
+				w=state[j][i];
+				lanes[i].job->digest[4*j+0]=w;
+				lanes[i].job->digest[4*j+1]=w >> 8;
+				lanes[i].job->digest[4*j+2]=w >> 16;
+				lanes[i].job->digest[4*j+3]=w >> 24;
+				state[j][i]=md5mb___iv[j];
+			}
+
+			if (next < count)
+				md5mb___load(lanes+i, jobs + next++);
+			else
+			{
+				lanes[i].job=NULL;
+				active--;
+			}
+		}
+	}
+}
+
+
+static void md5mb___run_base(struct md5mb__job_t *jobs, unsigned count)
+{
+	md5mb___run(jobs, count);
+}
+
+#ifdef MD5MB___X86
+__attribute__((target("avx2")))
+static void md5mb___run_avx2(struct md5mb__job_t *jobs, unsigned count)
+{
+	md5mb___run(jobs, count);
+}
+#endif
+
+#endif
+
+
+/** -. */
+const char *md5mb__engine(void)
+{
+#ifdef MD5MB___VECTOR
+#ifdef MD5MB___X86
+	if (__builtin_cpu_supports("avx2"))
+		return "avx2";
+	return "sse2";
+#else
+	return "vector";
+#endif
+#else
+	return "scalar";
+#endif
+}
+
+
+/** -.
+ * A single job is given to \c apr_md5(), as the lanes wouldn't help. */
+void md5mb__digest(struct md5mb__job_t *jobs, unsigned count)
+{
+#ifdef MD5MB___VECTOR
+	if (count > 1)
+	{
+#ifdef MD5MB___X86
+		if (__builtin_cpu_supports("avx2"))
+			md5mb___run_avx2(jobs, count);
+		else
+#endif
+			md5mb___run_base(jobs, count);
+		return;
+	}
+#endif
+
+	for(; count; count--, jobs++)
+		apr_md5(jobs->digest, jobs->data, jobs->len);
+}
+
+/** @} */
@@ -0,0 +1,36 @@
+/************************************************************************
+ * Copyright (C) 2026 Philipp Marek.
+ *
+ * This program is free software;  you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ ************************************************************************/
+
+#ifndef __MD5MB_H__
+#define __MD5MB_H__
+
+#include <stddef.h>
+
+/** \file
+ * Multi-buffer MD5 header file. */
+
+/** How many buffers are hashed at once. */
+#define MD5MB__LANES (8)
+
+/** A buffer to hash. */
+struct md5mb__job_t
+{
+	/** The data. */
+	const unsigned char *data;
+	/** Its length. */
+	size_t len;
+	/** Where the digest is stored; \c APR_MD5_DIGESTSIZE bytes. */
+	unsigned char *digest;
+};
+
+/** Calculates the MD5 digests of the \a count \a jobs. */
+void md5mb__digest(struct md5mb__job_t *jobs, unsigned count);
+/** Returns the name of the implementation that is used. */
+const char *md5mb__engine(void);
+
+#endif
@@ -7,6 +7,7 @@
  ************************************************************************/
 #include <ctype.h>
 #include <stdlib.h>
+#include <limits.h>
 
 #include "global.h"
 #include "log.h"
@@ -169,6 +170,43 @@ const struct opt___val_str_t opt___conflict_strings[]= {
 };
 
 
+/** Entry list formats.
+ * See \ref o_dir_format. */
+const struct opt___val_str_t opt___dir_format_strings[]= {
+	{ .val=DIR_FORMAT_BINARY,			.string="binary" },
+	{ .val=DIR_FORMAT_TEXT,				.string="text" },
+	{ .string=NULL, }
+};
+
+
+/** Ways to read files for hashing.
+ * See \ref o_hash_read. */
+const struct opt___val_str_t opt___hash_read_strings[]= {
+	{ .val=HASH_READ_MMAP,				.string="mmap" },
+	{ .val=HASH_READ_READ,				.string="read" },
+	{ .val=HASH_READ_DIRECT,			.string="direct" },
+	{ .string=NULL, }
+};
+
+
+/** Orders for hashing files.
+ * See \ref o_hash_order. */
+const struct opt___val_str_t opt___hash_order_strings[]= {
+	{ .val=HASH_ORDER_TREE,				.string="tree" },
+	{ .val=HASH_ORDER_DISK,				.string="disk" },
+	{ .string=NULL, }
+};
+
+
+/** Hashes for the local change check.
+ * See \ref o_change_hash. */
+const struct opt___val_str_t opt___change_hash_strings[]= {
+	{ .val=CHANGE_HASH_MD5,				.string="md5" },
+	{ .val=CHANGE_HASH_FAST,			.string="fast" },
+	{ .string=NULL, }
+};
+
+
 
 /** \name Predeclare some functions.
  * @{ */
@@ -180,6 +218,7 @@ opt___parse_t opt___store_env_noempty;
 opt___parse_t opt___normalized_path;
 opt___parse_t opt___parse_warnings;
 opt___parse_t opt___atoi;
+opt___parse_t opt___atoi_size;
 opt___parse_t opt___debug_buffer;
 /** @} */
 
@@ -326,6 +365,46 @@ struct opt__list_t opt__list[OPT__COUNT]=
 		.name="copyfrom_exp", .i_val=OPT__YES,
 		.parse=opt___string2val, .parm=opt___yes_no,
 	},
+	[OPT__THREADS] = {
+		.name="threads", .i_val=1, .parse=opt___atoi,
+	},
+	[OPT__IO_URING] = {
+		.name="io_uring", .i_val=OPT__NO,
+		.parse=opt___string2val, .parm=opt___yes_no,
+	},
+	[OPT__DIR_FORMAT] = {
+		.name="dir_format", .i_val=DIR_FORMAT_TEXT,
+		.parse=opt___string2val, .parm=opt___dir_format_strings,
+	},
+	[OPT__DIR_JOURNAL] = {
+		.name="dir_journal", .i_val=10, .parse=opt___atoi,
+	},
+	[OPT__HASH_READ] = {
+		.name="hash_read", .i_val=HASH_READ_MMAP,
+		.parse=opt___string2val, .parm=opt___hash_read_strings,
+	},
+	[OPT__HASH_STATS] = {
+		.name="hash_stats", .i_val=OPT__NO,
+		.parse=opt___string2val, .parm=opt___yes_no,
+	},
+	[OPT__IO_LIMIT] = {
+		.name="io_limit", .i_val=0, .parse=opt___atoi_size,
+	},
+	[OPT__IO_OPS] = {
+		.name="io_ops", .i_val=0, .parse=opt___atoi,
+	},
+	[OPT__HASH_ORDER] = {
+		.name="hash_order", .i_val=HASH_ORDER_TREE,
+		.parse=opt___string2val, .parm=opt___hash_order_strings,
+	},
+	[OPT__CHANGE_HASH] = {
+		.name="change_hash", .i_val=CHANGE_HASH_MD5,
+		.parse=opt___string2val, .parm=opt___change_hash_strings,
+	},
+	[OPT__PRISTINE] = {
+		.name="pristine", .i_val=OPT__NO,
+		.parse=opt___string2val, .parm=opt___yes_no,
+	},
 };
 
 
@@ -380,6 +459,32 @@ int opt___atoi(struct opt__list_t *ent, char *string,
 }
 
 
+/** Get a size; a \c k, \c M or \c G suffix multiplies by 1024, 
+ * 1024*1024 resp. 1024*1024*1024. */
+int opt___atoi_size(struct opt__list_t *ent, char *string, 
+		enum opt__prio_e prio UNUSED)
+{
+	char *l;
+	long long v;
+
+	v=strtoll(string, &l, 0);
+	switch (*l)
+	{
+		case 'G': case 'g':
+			v *= 1024;
+		case 'M': case 'm':
+			v *= 1024;
+		case 'K': case 'k':
+			v *= 1024;
+			l++;
+	}
+
+	if (*l || v<0 || v>INT_MAX) return EINVAL;
+	ent->i_val=v;
+	return 0;
+}
+
+
 /** Find an integer value by comparing with predefined strings. */
 int opt___find_string(const struct opt___val_str_t *list, 
 		const char *string, 
@@ -119,6 +119,39 @@ enum opt__settings_e {
 	/** Do expensive copyfrom checks?
 	 * See \ref o_copyfrom_exp */
 	OPT__COPYFROM_EXP,
+	/** How many threads to use for fetching meta-data.
+	 * See \ref o_threads */
+	OPT__THREADS,
+	/** Whether to use \c io_uring for reading directories.
+	 * See \ref o_io_uring */
+	OPT__IO_URING,
+	/** Which format to use for writing the \ref dir file.
+	 * See \ref o_dir_format */
+	OPT__DIR_FORMAT,
+	/** Up to which size the \ref dir file gets only journaled.
+	 * See \ref o_dir_journal */
+	OPT__DIR_JOURNAL,
+	/** How files are read for hashing.
+	 * See \ref o_hash_read */
+	OPT__HASH_READ,
+	/** Show hashing statistics.
+	 * See \ref o_hash_stats */
+	OPT__HASH_STATS,
+	/** Maximum number of bytes read per second.
+	 * See \ref o_io_limit */
+	OPT__IO_LIMIT,
+	/** Maximum number of reads per second.
+	 * See \ref o_io_limit */
+	OPT__IO_OPS,
+	/** In which order files are hashed.
+	 * See \ref o_hash_order */
+	OPT__HASH_ORDER,
+	/** Which hash is used to check for local changes.
+	 * See \ref o_change_hash */
+	OPT__CHANGE_HASH,
+	/** Whether the base texts are kept locally.
+	 * See \ref o_pristine */
+	OPT__PRISTINE,
 
 	/** Set a global password, for anonymous co/ci.
 	 * See \ref o_passwd. */
@@ -375,6 +408,43 @@ enum opt__conflict_e {
 /** @} */
 
 
+/** \name List of constants for \ref o_dir_format option.
+ * @{ */
+enum opt__dir_format_e {
+	DIR_FORMAT_TEXT=0,
+	DIR_FORMAT_BINARY,
+};
+/** @} */
+
+
+/** \name List of constants for \ref o_hash_read option.
+ * @{ */
+enum opt__hash_read_e {
+	HASH_READ_MMAP=0,
+	HASH_READ_READ,
+	HASH_READ_DIRECT,
+};
+/** @} */
+
+
+/** \name List of constants for \ref o_hash_order option.
+ * @{ */
+enum opt__hash_order_e {
+	HASH_ORDER_TREE=0,
+	HASH_ORDER_DISK,
+};
+/** @} */
+
+
+/** \name List of constants for \ref o_change_hash option.
+ * @{ */
+enum opt__change_hash_e {
+	CHANGE_HASH_MD5=0,
+	CHANGE_HASH_FAST,
+};
+/** @} */
+
+
 /** Filter value to print \b all entries. */
 #define FILTER__ALL (-1)
 
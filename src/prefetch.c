@@ -0,0 +1,1197 @@
+/************************************************************************
+ * Copyright (C) 2026 Philipp Marek.
+ *
+ * This program is free software;  you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ ************************************************************************/
+
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <stdint.h>
+#include <apr_portable.h>
+
+#include "global.h"
+#include "est_ops.h"
+#include "helper.h"
+#include "options.h"
+#include "checksum.h"
+#include "prefetch.h"
+
+#ifdef HAVE_LINUX_FIEMAP_H
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+
+
+/** \file
+ * Threaded \c lstat() prefetching, file comparing, and reading ahead on 
+ * commit.
+ * */
+
+/** \defgroup prefetch Parallel meta-data fetching
+ * \ingroup perf
+ *
+ * On big working copies on NFS or fast SSDs the time for \c fsvs \c status
+ * is mostly spent waiting on \c lstat() round-trips; only one is ever
+ * outstanding.
+ *
+ * If \ref o_threads is set to more than \c 1, waa__update_tree() starts a
+ * few worker threads that run \b ahead of it through the same list of
+ * entry blocks, and fetch the meta-data of the next few hundred entries.
+ * When ops__update_single_entry() needs the data, it's normally already
+ * there.
+ *
+ * All the bookkeeping (estat::unfinished, estat::child_index,
+ * waa___finish_directory() and the action callbacks) is still done by the
+ * main thread, in the same order as before; the workers never touch a
+ * struct \ref estat, they only see a copy of the path. So the output is
+ * exactly the same as without threads.
+ *
+ * The workers use \c fstatat() relative to a handle of the working copy 
+ * base directory; the directory handles of ops__dir_fd() are only used by 
+ * the main thread.
+ *
+ * If the \ref o_chcheck settings say that a file has to be checked via 
+ * MD5, the worker does that, too, via cs__compare_small(); the result is 
+ * stored into the struct \ref estat by the main thread, when it gets to 
+ * that entry (see pf__compare_file()). So the number of files that are 
+ * hashed at once is bounded by the number of threads (times \c 
+ * CS__SMALL_BATCH for small files, whose MD5s are calculated side by side 
+ * via md5mb__digest()).
+ * The \ref md5s filename is calculated by the main thread, when the entry 
+ * is queued, as the WAA path functions use static buffers.
+ * The files are opened relative to the working copy base handle, too.
+ * With debugging enabled the compare is done by the main thread only, as 
+ * the debug output isn't thread-safe; that's checked for each batch, as 
+ * debugging can be switched on by a signal.
+ *
+ * Entries that are not looked at (eg. children of removed directories, or
+ * entries not wanted by the user) are simply dropped from the queue.
+ *
+ * On \ref commit the threads are used again, in another way: the data of 
+ * the files that will be sent next is read into the page cache, while the 
+ * main thread gives the current file to the delta editor (see 
+ * pf__read_ahead_start()). The files are still sent one after the other, 
+ * and the \ref md5s data is made in the same pass as before; but that 
+ * pass doesn't have to wait for the disk anymore, so a big commit takes 
+ * about as long as the slower of reading and sending, not the sum.
+ * How much is read ahead is limited to \c PF___AHEAD_PER_THREAD bytes 
+ * per thread, so that the data is still cached when it's needed.
+ * Within the file that's being sent the kernel is asked to keep \c 
+ * PF___AHEAD_IN_FILE bytes ahead of the current position (see 
+ * pf__read_ahead_stream()), so that a single big file gets the same 
+ * overlap.
+ * Only the reading is done ahead; the MD5 and the manber hashes for the 
+ * \ref md5s file are still calculated by the main thread while sending.
+ * */
+/** @{ */
+
+/** How many entries are queued per thread. */
+#define PF___WINDOW_PER_THREAD (32)
+
+/** States of a queue slot. */
+enum pf___state_e {
+	PF___FREE=0,
+	PF___QUEUED,
+	PF___BUSY,
+	PF___DONE,
+};
+
+/** One queued entry. */
+struct pf___slot_t {
+	/** The entry; only used for comparison by the main thread. */
+	struct estat *sts;
+	/** The path, relative to the working copy base. */
+	char *path;
+	/** Allocated length of \a path. */
+	int path_space;
+	/** The result of the \c lstat(). */
+	struct sstat_t st;
+	/** The return value, as for \c hlp__lstat(). */
+	int status;
+	/** See \ref pf___state_e. */
+	enum pf___state_e state;
+
+	/** Whether the file might have to be compared, too. */
+	int do_compare;
+	/** The meta-data from the \ref dir file, and whether the entry is a 
+	 * copy; see ops__stat_likely_changed(). */
+	struct sstat_t old_st;
+	int is_copy;
+	/** The data for cs__compare_data(). */
+	struct cs__compare_t cmp;
+	/** Whether cs__compare_data() was done, and its return value. */
+	int compared, cmp_status;
+};
+
+
+/** The queue, and the position in the entry blocks. */
+static struct {
+	pthread_mutex_t mutex;
+	/** Signalled when new work is queued. */
+	pthread_cond_t work;
+	/** Signalled when a slot is done. */
+	pthread_cond_t done;
+	pthread_t threads[PF__MAX_THREADS];
+	int thread_count;
+
+	struct pf___slot_t *slots;
+	unsigned window;
+	/** Counters for the ring buffer; they only ever increase.
+	 * <tt>head <= next_work <= tail <= head+window</tt>.
+	 * @{ */
+	unsigned head, next_work, tail;
+	/** @} */
+
+	/** Filehandle of the working copy base directory. */
+	int base_fd;
+	/** Whether the workers should exit. */
+	int stop;
+	/** Whether the workers are running. */
+	int active;
+	/** Whether the workers may compare files. */
+	int do_compare;
+
+	/** The compare result of the last entry given to pf__lstat(), for 
+	 * pf__compare_file(). @{ */
+	struct estat *last_sts;
+	struct cs__compare_t last_cmp;
+	int last_compared, last_cmp_status;
+	/** @} */
+
+	/** The next entry to queue. @{ */
+	struct waa__entry_blocks_t *block;
+	struct estat *cur;
+	int left;
+	/** @} */
+} pf___q = {
+	.mutex=PTHREAD_MUTEX_INITIALIZER,
+	.work=PTHREAD_COND_INITIALIZER,
+	.done=PTHREAD_COND_INITIALIZER,
+	.base_fd=-1,
+};
+
+
+/** \name Reading ahead on commit
+ * See pf__read_ahead_start().
+ * @{ */
+/** How many bytes are read ahead per thread. */
+#define PF___AHEAD_PER_THREAD (16*1024*1024)
+/** The size of a single read. */
+#define PF___AHEAD_CHUNK (1024*1024)
+/** How far ahead of the send position the file that's sent is read. */
+#define PF___AHEAD_IN_FILE (8*1024*1024)
+
+/** A file to read ahead. */
+struct pf___ahead_slot_t {
+	/** The path, relative to the working copy base. */
+	char *path;
+	/** Allocated length of \a path. */
+	int path_space;
+	/** The size of the file. */
+	off_t size;
+	/** How many bytes of the budget a worker took for it. */
+	off_t taken;
+};
+
+/** The files to read ahead, in the order they'll be sent.
+ * The slots are a ring buffer of \c pf___q.window entries, indexed by the 
+ * position in \c list; the paths are built by the main thread (as the 
+ * struct \ref estat isn't thread-safe), and copied by a worker when it 
+ * takes the file. */
+static struct {
+	struct estat **list;
+	unsigned count, space;
+	struct pf___ahead_slot_t *slots;
+	/** Counters into \c list.
+	 * <tt>current <= next_work <= filled <= current+window</tt>; \c 
+	 * current is the first file that the main thread hasn't started on.
+	 * @{ */
+	unsigned current, next_work, filled;
+	/** @} */
+	/** How many bytes are read ahead of \c current, and the limit. */
+	off_t bytes, budget;
+} pf___ra;
+/** @} */
+
+
+/** Like hlp__lstat(), but relative to pf___q.base_fd and without debug
+ * output, as that is called in the worker threads. */
+static int pf___lstat(const char *path, struct sstat_t *st)
+{
+	int status;
+	struct stat st64;
+
+#ifdef HAVE_FSTATAT
+	status=fstatat(pf___q.base_fd, path, &st64, AT_SYMLINK_NOFOLLOW);
+#else
+	BUG("fstatat() not available");
+#endif
+	if (status)
+		return errno;
+
+	return hlp__stat_result(&st64, st);
+}
+
+
+/** Whether ops__update_single_entry() would call cs__compare_file() for 
+ * this entry. */
+static int pf___need_compare(struct pf___slot_t *slot)
+{
+	int chk;
+
+	if (!slot->do_compare || !S_ISREG(slot->st.mode)) return 0;
+
+	chk=opt__get_int(OPT__CHANGECHECK);
+	if (chk & CHCHECK_ALLFILES) return 1;
+
+	return (chk & CHCHECK_FILE) &&
+		slot->old_st.size == slot->st.size &&
+		ops__stat_likely_changed(&slot->old_st, &slot->st, slot->is_copy);
+}
+
+
+/** The worker threads' main loop.
+ * Consecutive slots that need a compare are taken together (but not more 
+ * than the share of one thread), so that small files can be hashed at once 
+ * by cs__compare_small(). */
+static void *pf___worker(void *arg UNUSED)
+{
+	struct pf___slot_t *slot, *batch[CS__SMALL_BATCH];
+	struct cs__compare_t *cmp[CS__SMALL_BATCH];
+	int result[CS__SMALL_BATCH];
+	unsigned i, count, n, max;
+	int no_compare;
+
+	pthread_mutex_lock(&pf___q.mutex);
+	while (1)
+	{
+		while (!pf___q.stop && pf___q.next_work == pf___q.tail)
+			pthread_cond_wait(&pf___q.work, &pf___q.mutex);
+		if (pf___q.stop) break;
+
+		max=(pf___q.tail - pf___q.next_work) / 
+			(pf___q.window / PF___WINDOW_PER_THREAD);
+		if (max > CS__SMALL_BATCH) max=CS__SMALL_BATCH;
+		if (max < 1) max=1;
+
+		count=0;
+		while (count < max && pf___q.next_work != pf___q.tail)
+		{
+			slot=pf___q.slots + (pf___q.next_work % pf___q.window);
+			if (count && !slot->do_compare) break;
+
+			pf___q.next_work++;
+			/* Might have been taken by the main thread. */
+			if (slot->state != PF___QUEUED) continue;
+
+			slot->state=PF___BUSY;
+			batch[count++]=slot;
+			if (!slot->do_compare) break;
+		}
+		if (!count) continue;
+		pthread_mutex_unlock(&pf___q.mutex);
+
+		/* Debugging might have been switched on via a signal; the debug 
+		 * output isn't thread-safe, so the main thread does the compare 
+		 * then. */
+		no_compare=debuglevel;
+		n=0;
+		for(i=0; i<count; i++)
+		{
+			slot=batch[i];
+			slot->status=pf___lstat(slot->path, &slot->st);
+			if (slot->status == 0 && !no_compare && pf___need_compare(slot))
+			{
+				/* The path is relative to the working copy base, like for the 
+				 * lstat(). */
+				slot->cmp.dir_fd=pf___q.base_fd;
+				slot->cmp.size=slot->st.size;
+				slot->compared=1;
+				cmp[n++]=&slot->cmp;
+			}
+		}
+
+		cs__compare_small(cmp, result, n);
+		for(i=n=0; i<count; i++)
+			if (batch[i]->compared)
+				batch[i]->cmp_status=result[n++];
+
+		pthread_mutex_lock(&pf___q.mutex);
+		for(i=0; i<count; i++)
+			batch[i]->state=PF___DONE;
+		pthread_cond_broadcast(&pf___q.done);
+	}
+	pthread_mutex_unlock(&pf___q.mutex);
+
+	return NULL;
+}
+
+
+/** Queues entries until the window is full, or there are no more.
+ * Must be called by the main thread, without the mutex held; the slots
+ * between \c tail and \c head+window are owned by the main thread.  */
+static int pf___fill(void)
+{
+	int status;
+	unsigned tail;
+	struct pf___slot_t *slot;
+	struct estat *sts;
+	int len;
+
+
+	status=0;
+	tail=pf___q.tail;
+	while (tail - pf___q.head < pf___q.window)
+	{
+		while (pf___q.left <= 0)
+		{
+			if (!pf___q.block) goto queued;
+			pf___q.block=pf___q.block->next;
+			if (!pf___q.block) goto queued;
+
+			pf___q.cur=pf___q.block->first;
+			pf___q.left=pf___q.block->count;
+		}
+
+		sts=pf___q.cur;
+		pf___q.cur++;
+		pf___q.left--;
+
+		slot=pf___q.slots + (tail % pf___q.window);
+		if (!sts->path_len)
+			ops__calc_path_len(sts);
+		if (sts->path_len+2 > slot->path_space)
+		{
+			slot->path_space=sts->path_len + 2 + 32;
+			STOPIF( hlp__realloc( &slot->path, slot->path_space), NULL);
+		}
+
+		len=ops__build_path2(slot->path, slot->path_space, sts);
+		BUG_ON(!len, "path len counting went wrong");
+		slot->path[len-1]=0;
+
+		/* Might be left over, if the entry wasn't looked at. */
+		IF_FREE(slot->cmp.md5s_path);
+		slot->compared=0;
+		slot->do_compare=pf___q.do_compare &&
+			S_ISREG(sts->st.mode) &&
+			sts->change_flag == CF_UNKNOWN;
+		if (slot->do_compare)
+		{
+			slot->old_st=sts->st;
+			slot->is_copy=sts->flags & RF___IS_COPY;
+			STOPIF( cs__compare_init(&slot->cmp, sts, slot->path, 
+						sts->st.size), NULL);
+		}
+
+		slot->sts=sts;
+		slot->state=PF___QUEUED;
+		tail++;
+	}
+
+queued:
+	if (tail != pf___q.tail)
+	{
+		pthread_mutex_lock(&pf___q.mutex);
+		pf___q.tail=tail;
+		pthread_cond_broadcast(&pf___q.work);
+		pthread_mutex_unlock(&pf___q.mutex);
+	}
+
+ex:
+	return status;
+}
+
+
+/** Returns the number of worker threads to use, or \c 0 if none should 
+ * be started. */
+static int pf___thread_count(void)
+{
+	int count;
+
+	count=opt__get_int(OPT__THREADS);
+	if (count <= 1 || pf___q.active) return 0;
+
+#ifndef HAVE_FSTATAT
+	DEBUGP("no fstatat(), no threads");
+	return 0;
+#endif
+
+	return count > PF__MAX_THREADS ? PF__MAX_THREADS : count;
+}
+
+
+/** Opens the working copy base directory, and starts \a count threads 
+ * running \a worker. */
+static int pf___run(void *(*worker)(void *), int count)
+{
+	int status;
+	int i;
+
+
+	status=0;
+	pf___q.base_fd=open(".", O_RDONLY | O_DIRECTORY);
+	STOPIF_CODE_ERR( pf___q.base_fd == -1, errno,
+			"Cannot open the working copy base directory");
+
+	pf___q.stop=0;
+	for(i=0; i<count; i++)
+	{
+		status=pthread_create(pf___q.threads+i, NULL, worker, NULL);
+		if (status)
+		{
+			/* We can work with fewer threads. */
+			DEBUGP("pthread_create: %d", status);
+			status=0;
+			break;
+		}
+	}
+
+	pf___q.thread_count=i;
+	pf___q.active= i>0;
+	DEBUGP("started %d threads, window %u", i, pf___q.window);
+
+	if (!pf___q.active)
+		STOPIF( pf__stop(), NULL);
+
+ex:
+	return status;
+}
+
+
+/** -.
+ * Has to be called with the current directory being the working copy
+ * base, as all paths are relative to it.
+ *
+ * If the option is not set, no threads are started; pf__lstat() then simply calls \c
+ * hlp__lstat(). */
+int pf__start(struct waa__entry_blocks_t *blocks)
+{
+	int status;
+	int count;
+
+
+	status=0;
+	count=pf___thread_count();
+	if (!count || !blocks) goto ex;
+
+	pf___q.window=count * PF___WINDOW_PER_THREAD;
+	STOPIF( hlp__calloc( &pf___q.slots, pf___q.window, sizeof(*pf___q.slots)),
+			NULL);
+
+	pf___q.head=pf___q.next_work=pf___q.tail=0;
+	pf___q.last_sts=NULL;
+	pf___q.do_compare=
+		opt__get_int(OPT__CHANGECHECK) & (CHCHECK_FILE | CHCHECK_ALLFILES);
+	pf___q.block=blocks;
+	pf___q.cur=blocks->first;
+	pf___q.left=blocks->count;
+
+	STOPIF( pf___fill(), NULL);
+
+	STOPIF( pf___run(pf___worker, count), NULL);
+
+ex:
+	return status;
+}
+
+
+/** -. */
+int pf__stop(void)
+{
+	int status;
+	int i;
+
+
+	status=0;
+	if (pf___q.thread_count)
+	{
+		pthread_mutex_lock(&pf___q.mutex);
+		pf___q.stop=1;
+		pthread_cond_broadcast(&pf___q.work);
+		pthread_mutex_unlock(&pf___q.mutex);
+
+		for(i=0; i<pf___q.thread_count; i++)
+			pthread_join(pf___q.threads[i], NULL);
+		pf___q.thread_count=0;
+	}
+
+	pf___q.active=0;
+
+	if (pf___q.slots)
+	{
+		for(i=0; i<pf___q.window; i++)
+		{
+			IF_FREE(pf___q.slots[i].path);
+			IF_FREE(pf___q.slots[i].cmp.md5s_path);
+		}
+		IF_FREE(pf___q.slots);
+	}
+	IF_FREE(pf___q.last_cmp.md5s_path);
+	pf___q.last_sts=NULL;
+
+	if (pf___ra.slots)
+	{
+		for(i=0; i<pf___q.window; i++)
+			IF_FREE(pf___ra.slots[i].path);
+		IF_FREE(pf___ra.slots);
+	}
+	IF_FREE(pf___ra.list);
+	pf___ra.count=pf___ra.space=0;
+
+	if (pf___q.base_fd != -1)
+	{
+		STOPIF_CODE_ERR( close(pf___q.base_fd) == -1, errno,
+				"closing the working copy base directory");
+		pf___q.base_fd=-1;
+	}
+
+ex:
+	return status;
+}
+
+
+/** -.
+ * Entries that were queued before \a sts are dropped; they weren't
+ * needed.
+ *
+ * If \a sts is not in the queue (eg. because it was added during the run,
+ * or we're not in waa__update_tree() at all), the \c lstat() is done
+ * directly. */
+int pf__lstat(struct estat *sts, const char *fullpath, struct sstat_t *st)
+{
+	int status, ret;
+	unsigned pos;
+	struct pf___slot_t *slot;
+
+
+	if (!pf___q.active)
+		return ops__lstat(sts, (char*)fullpath, st);
+
+	pthread_mutex_lock(&pf___q.mutex);
+	for(pos=pf___q.head; pos != pf___q.tail; pos++)
+		if (pf___q.slots[pos % pf___q.window].sts == sts)
+			break;
+
+	if (pos == pf___q.tail)
+	{
+		pthread_mutex_unlock(&pf___q.mutex);
+		DEBUGP("%s not prefetched", fullpath);
+		return ops__lstat(sts, (char*)fullpath, st);
+	}
+
+	/* Drop the entries before; we must wait for the ones being worked on,
+	 * as their slots get re-used. */
+	for(; pf___q.head != pos; pf___q.head++)
+	{
+		slot=pf___q.slots + (pf___q.head % pf___q.window);
+		if (slot->state == PF___QUEUED)
+			slot->state=PF___DONE;
+		while (slot->state != PF___DONE)
+			pthread_cond_wait(&pf___q.done, &pf___q.mutex);
+	}
+
+	slot=pf___q.slots + (pos % pf___q.window);
+	if (slot->state == PF___QUEUED)
+	{
+		/* The workers didn't get to it yet, so we do it ourselves. */
+		slot->state=PF___BUSY;
+		pthread_mutex_unlock(&pf___q.mutex);
+		slot->status=pf___lstat(slot->path, &slot->st);
+		pthread_mutex_lock(&pf___q.mutex);
+	}
+	else
+	{
+		while (slot->state != PF___DONE)
+			pthread_cond_wait(&pf___q.done, &pf___q.mutex);
+	}
+
+	slot->state=PF___DONE;
+	pf___q.head=pos+1;
+	if ((int)(pf___q.next_work - pf___q.head) < 0)
+		pf___q.next_work=pf___q.head;
+	pthread_mutex_unlock(&pf___q.mutex);
+
+	ret=slot->status;
+	if (ret == 0 || ret == -ENOENT)
+		*st=slot->st;
+	DEBUGP("%s prefetched: %d", fullpath, ret);
+
+	/* Keep the compare result for pf__compare_file(). */
+	IF_FREE(pf___q.last_cmp.md5s_path);
+	pf___q.last_sts=sts;
+	pf___q.last_cmp=slot->cmp;
+	pf___q.last_compared=slot->compared;
+	pf___q.last_cmp_status=slot->cmp_status;
+	slot->cmp.md5s_path=NULL;
+	slot->compared=0;
+
+	STOPIF( pf___fill(), NULL);
+	status=ret;
+
+ex:
+	return status;
+}
+
+/** -.
+ * If a worker thread has already compared \a sts, its result is taken; 
+ * else cs__compare_file() is called. */
+int pf__compare_file(struct estat *sts, char *fullpath, int *result)
+{
+	int status;
+
+
+	status=0;
+	if (pf___q.last_sts == sts && pf___q.last_compared &&
+			sts->change_flag == CF_UNKNOWN)
+	{
+		pf___q.last_sts=NULL;
+		/* The slot might have been re-used. */
+		pf___q.last_cmp.path=fullpath;
+
+		if (result) *result=-1;
+		STOPIF( pf___q.last_cmp_status, "comparing %s", fullpath);
+		STOPIF( cs__compare_finish(&pf___q.last_cmp, sts, result), NULL);
+	}
+	else
+		STOPIF( cs__compare_file(sts, fullpath, result), NULL);
+
+ex:
+	return status;
+}
+
+
+/** \name Reading ahead on commit
+ * @{ */
+/** Builds the paths for the next files, up to the window size.
+ * Must be called by the main thread, without the mutex held. */
+static int pf___ahead_fill(void)
+{
+	int status;
+	unsigned filled;
+	struct pf___ahead_slot_t *slot;
+	struct estat *sts;
+	int len;
+
+
+	status=0;
+	filled=pf___ra.filled;
+	while (filled < pf___ra.count && 
+			filled - pf___ra.current < pf___q.window)
+	{
+		sts=pf___ra.list[filled];
+		slot=pf___ra.slots + (filled % pf___q.window);
+
+		if (!sts->path_len)
+			ops__calc_path_len(sts);
+		if (sts->path_len+2 > slot->path_space)
+		{
+			slot->path_space=sts->path_len + 2 + 32;
+			STOPIF( hlp__realloc( &slot->path, slot->path_space), NULL);
+		}
+
+		len=ops__build_path2(slot->path, slot->path_space, sts);
+		BUG_ON(!len, "path len counting went wrong");
+		slot->path[len-1]=0;
+
+		slot->size=sts->st.size;
+		slot->taken=0;
+		filled++;
+	}
+
+	if (filled != pf___ra.filled)
+	{
+		pthread_mutex_lock(&pf___q.mutex);
+		pf___ra.filled=filled;
+		pthread_cond_broadcast(&pf___q.work);
+		pthread_mutex_unlock(&pf___q.mutex);
+	}
+
+ex:
+	return status;
+}
+
+
+/** The read-ahead threads' main loop.
+ * The data is only read, to get it into the page cache; a file is given 
+ * up when the main thread gets to it. */
+static void *pf___ahead_worker(void *arg UNUSED)
+{
+	unsigned char *buffer;
+	char *path, *new_path;
+	int path_space, len, fh;
+	unsigned nr;
+	off_t pos, end;
+	ssize_t got;
+	struct pf___ahead_slot_t *slot;
+
+
+	buffer=malloc(PF___AHEAD_CHUNK);
+	if (!buffer) return NULL;
+	path=NULL;
+	path_space=0;
+
+	pthread_mutex_lock(&pf___q.mutex);
+	while (1)
+	{
+		while (!pf___q.stop && 
+				(pf___ra.next_work == pf___ra.filled ||
+				 pf___ra.bytes >= pf___ra.budget))
+			pthread_cond_wait(&pf___q.work, &pf___q.mutex);
+		if (pf___q.stop) break;
+
+		nr=pf___ra.next_work++;
+		slot=pf___ra.slots + (nr % pf___q.window);
+
+		len=strlen(slot->path)+1;
+		if (len > path_space)
+		{
+			new_path=realloc(path, len);
+			if (!new_path) break;
+			path=new_path;
+			path_space=len;
+		}
+		memcpy(path, slot->path, len);
+
+		end=slot->size;
+		if (end > pf___ra.budget) end=pf___ra.budget;
+		slot->taken=end;
+		pf___ra.bytes+=end;
+		pthread_mutex_unlock(&pf___q.mutex);
+
+		/* Errors are reported by the main thread, when it reads the file. */
+		fh=openat(pf___q.base_fd, path, O_RDONLY | O_NOFOLLOW | O_NOCTTY);
+		pos=0;
+		while (fh != -1 && pos < end)
+		{
+			got=pread(fh, buffer, PF___AHEAD_CHUNK, pos);
+			if (got <= 0) break;
+			pos+=got;
+
+			pthread_mutex_lock(&pf___q.mutex);
+			if (pf___q.stop || (int)(pf___ra.current - nr) > 0)
+				end=pos;
+			pthread_mutex_unlock(&pf___q.mutex);
+		}
+		if (fh != -1) close(fh);
+
+		pthread_mutex_lock(&pf___q.mutex);
+	}
+	pthread_mutex_unlock(&pf___q.mutex);
+
+	IF_FREE(path);
+	IF_FREE(buffer);
+	return NULL;
+}
+
+
+/** -.
+ * Nothing is queued if no threads would be started, or if the reads are 
+ * limited via \ref o_io_limit; the worker threads would only use up the 
+ * allowance for the files that are sent. */
+int pf__read_ahead_add(struct estat *sts)
+{
+	int status;
+
+
+	status=0;
+	if (!pf___thread_count() ||
+			opt__get_int(OPT__IO_LIMIT) || opt__get_int(OPT__IO_OPS))
+		goto ex;
+
+	if (pf___ra.count == pf___ra.space)
+	{
+		pf___ra.space= pf___ra.space ? pf___ra.space*2 : 1024;
+		STOPIF( hlp__realloc( &pf___ra.list, 
+					pf___ra.space*sizeof(*pf___ra.list)), NULL);
+	}
+
+	pf___ra.list[pf___ra.count++]=sts;
+
+ex:
+	return status;
+}
+
+
+/** -.
+ * Has to be called in the working copy base directory. */
+int pf__read_ahead_start(void)
+{
+	int status;
+	int count;
+
+
+	status=0;
+	count=pf___thread_count();
+	if (!count || !pf___ra.count) goto ex;
+
+	pf___q.window=count * PF___WINDOW_PER_THREAD;
+	STOPIF( hlp__calloc( &pf___ra.slots, pf___q.window, 
+				sizeof(*pf___ra.slots)), NULL);
+
+	pf___ra.current=pf___ra.next_work=pf___ra.filled=0;
+	pf___ra.bytes=0;
+	pf___ra.budget=(off_t)count * PF___AHEAD_PER_THREAD;
+	DEBUGP("%u files to read ahead", pf___ra.count);
+
+	STOPIF( pf___ahead_fill(), NULL);
+
+	STOPIF( pf___run(pf___ahead_worker, count), NULL);
+
+ex:
+	return status;
+}
+
+
+/** -.
+ * The files that were queued before \a sts are skipped; they weren't 
+ * sent after all. If \a sts isn't in the window, nothing changes. */
+int pf__read_ahead_at(struct estat *sts)
+{
+	int status;
+	unsigned nr;
+	struct pf___ahead_slot_t *slot;
+
+
+	status=0;
+	if (!pf___q.active || !pf___ra.slots) goto ex;
+
+	for(nr=pf___ra.current; nr != pf___ra.filled; nr++)
+		if (pf___ra.list[nr] == sts)
+			break;
+	if (nr == pf___ra.filled) 
+	{
+		DEBUGP("%s not read ahead", sts->name);
+		goto ex;
+	}
+
+	/* The data of this file is used now, so its budget can be given to 
+	 * the next ones. */
+	pthread_mutex_lock(&pf___q.mutex);
+	for(; pf___ra.current != nr+1; pf___ra.current++)
+	{
+		slot=pf___ra.slots + (pf___ra.current % pf___q.window);
+		pf___ra.bytes-=slot->taken;
+		slot->taken=0;
+	}
+	if ((int)(pf___ra.next_work - pf___ra.current) < 0)
+		pf___ra.next_work=pf___ra.current;
+	pthread_cond_broadcast(&pf___q.work);
+	pthread_mutex_unlock(&pf___q.mutex);
+
+	STOPIF( pf___ahead_fill(), NULL);
+
+ex:
+	return status;
+}
+
+
+/** The file that's sent now, see pf__read_ahead_stream(). */
+struct pf___ahead_stream_t {
+	svn_stream_t *input;
+	int fd;
+	/** How much was read, how much the kernel was asked to read, and the 
+	 * size of the file. */
+	off_t pos, advised, size;
+};
+
+
+/** Asks the kernel to read the next part of the file, if the window has 
+ * moved on far enough. */
+static void pf___advise(struct pf___ahead_stream_t *ahead)
+{
+	off_t end;
+
+
+	end=ahead->pos + PF___AHEAD_IN_FILE;
+	if (end > ahead->size) end=ahead->size;
+	if (end - ahead->advised < PF___AHEAD_CHUNK && end != ahead->size)
+		return;
+	if (end <= ahead->advised) return;
+
+	posix_fadvise(ahead->fd, ahead->advised, end - ahead->advised, 
+			POSIX_FADV_WILLNEED);
+	ahead->advised=end;
+}
+
+
+svn_error_t *pf___ahead_read(void *baton, char *data, apr_size_t *len)
+{
+	int status;
+	svn_error_t *status_svn;
+	struct pf___ahead_stream_t *ahead=baton;
+
+
+	status=0;
+	STOPIF_SVNERR( svn_stream_read, (ahead->input, data, len) );
+	ahead->pos += *len;
+	pf___advise(ahead);
+
+ex:
+	RETURN_SVNERR(status);
+}
+
+
+svn_error_t *pf___ahead_close(void *baton)
+{
+	struct pf___ahead_stream_t *ahead=baton;
+
+	return svn_stream_close(ahead->input);
+}
+
+
+/** -.
+ * The threads only read the files after the current one; this keeps \c 
+ * PF___AHEAD_IN_FILE bytes of the \a size bytes of \a file ahead of the 
+ * position \a input was read to, via \c posix_fadvise().
+ *
+ * That's only done if the threads read ahead, too, and the file is 
+ * bigger than the window; else \a output is just \a input. */
+int pf__read_ahead_stream(apr_file_t *file, off_t size,
+		svn_stream_t *input, svn_stream_t **output,
+		apr_pool_t *pool)
+{
+	int status;
+	struct pf___ahead_stream_t *ahead;
+	apr_os_file_t fd;
+	svn_stream_t *new_str;
+
+
+	status=0;
+	*output=input;
+	if (!pf___q.active || !pf___ra.slots || size <= PF___AHEAD_IN_FILE) 
+		goto ex;
+
+	STOPIF( apr_os_file_get(&fd, file), NULL);
+
+	ahead=apr_pcalloc(pool, sizeof(*ahead));
+	STOPIF_ENOMEM( !ahead );
+	ahead->input=input;
+	ahead->fd=fd;
+	ahead->size=size;
+	pf___advise(ahead);
+
+	new_str=svn_stream_create(ahead, pool);
+	STOPIF_ENOMEM( !new_str );
+	svn_stream_set_read(new_str, pf___ahead_read);
+	svn_stream_set_close(new_str, pf___ahead_close);
+
+	*output=new_str;
+
+ex:
+	return status;
+}
+/** @} */
+
+
+/** \name Hashing in disk order
+ * See \ref o_hash_order.
+ * @{ */
+/** A file to hash. */
+struct pf___order_t {
+	struct estat *sts;
+	off_t size;
+	dev_t dev;
+	ino_t ino;
+	/** Physical position of the first extent; or the inode number, if the 
+	 * filesystem can't tell. */
+	t_ull pos;
+};
+
+
+/** Gets the physical position of the start of \a path via \c FIEMAP.
+ * Empty files are at \c 0; so are files that can't be opened (they're 
+ * reported by the tree walk). An error is only returned if the 
+ * filesystem doesn't support \c FIEMAP.
+ *
+ * The entry could have been replaced by a symlink or a fifo since the 
+ * \c lstat(), so these are not followed or waited for. */
+static int pf___physical(const char *path, t_ull *physical)
+{
+#ifdef HAVE_LINUX_FIEMAP_H
+	int fh, status;
+	/* Room for the header and a single extent. */
+	uint64_t buffer[ (sizeof(struct fiemap) + 
+			sizeof(struct fiemap_extent)) / sizeof(uint64_t) + 1];
+	struct fiemap *fm=(struct fiemap*)buffer;
+
+
+	*physical=0;
+	fh=open(path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY);
+	if (fh == -1) return 0;
+
+	memset(buffer, 0, sizeof(buffer));
+	fm->fm_start=0;
+	fm->fm_length=FIEMAP_MAX_OFFSET;
+	fm->fm_extent_count=1;
+	status= ioctl(fh, FS_IOC_FIEMAP, fm) == -1 ? errno : 0;
+	close(fh);
+
+	if (!status)
+		*physical= fm->fm_mapped_extents ? fm->fm_extents[0].fe_physical : 0;
+	return status;
+#else
+	return ENOTSUP;
+#endif
+}
+
+
+static int pf___cmp_pos(const void *_a, const void *_b)
+{
+	const struct pf___order_t *a=_a, *b=_b;
+
+	if (a->dev != b->dev) return a->dev < b->dev ? -1 : +1;
+	if (a->pos != b->pos) return a->pos < b->pos ? -1 : +1;
+	return 0;
+}
+
+
+/** Returns whether \a dev is one of the \a count devices in \a list. */
+static int pf___dev_in(dev_t dev, const dev_t *list, unsigned count)
+{
+	unsigned i;
+
+	for(i=0; i<count; i++)
+		if (list[i] == dev) return 1;
+	return 0;
+}
+
+
+/** -.
+ * The files in \a blocks that would be given to cs__compare_file() by 
+ * ops__update_single_entry() are collected, sorted by the physical 
+ * position of their data (or by inode number, on devices whose filesystem 
+ * can't tell via \c FIEMAP), and hashed in that order; so on a cold cache the disk 
+ * heads move across the disk only once.
+ *
+ * The results are only stored in the struct \ref estat; the tree walk 
+ * then finds estat::change_flag set, and reports the entries in the 
+ * normal order.
+ *
+ * Has to be called in the working copy base directory. */
+int pf__hash_in_disk_order(struct waa__entry_blocks_t *blocks)
+{
+	int status, i, chk;
+	unsigned count, space, n;
+	dev_t *no_fiemap;
+	unsigned no_fiemap_count;
+	struct waa__entry_blocks_t *block;
+	struct pf___order_t *list;
+	struct cs__compare_t cmp[CS__SMALL_BATCH], *cmps[CS__SMALL_BATCH];
+	int result[CS__SMALL_BATCH];
+	unsigned j, batch;
+	struct estat *sts;
+	struct sstat_t st;
+	char *path;
+
+
+	status=0;
+	list=NULL;
+	no_fiemap=NULL;
+	no_fiemap_count=0;
+	memset(cmp, 0, sizeof(cmp));
+	count=space=0;
+
+	chk=opt__get_int(OPT__CHANGECHECK);
+	if (!(chk & (CHCHECK_FILE | CHCHECK_ALLFILES))) goto ex;
+
+	for(block=blocks; block; block=block->next)
+		for(i=0, sts=block->first; i<block->count; i++, sts++)
+		{
+			if (!S_ISREG(sts->st.mode) || (sts->flags & RF_ISNEW) ||
+					sts->change_flag != CF_UNKNOWN)
+				continue;
+
+			/* Errors are reported by the tree walk. */
+			STOPIF( ops__build_path(&path, sts), NULL);
+			if (hlp__lstat(path, &st) || !S_ISREG(st.mode))
+				continue;
+
+			/* Same test as in ops__update_single_entry(). */
+			if (!(chk & CHCHECK_ALLFILES) &&
+					!(st.size == sts->st.size &&
+						ops__stat_likely_changed(&sts->st, &st, 
+							sts->flags & RF___IS_COPY)))
+				continue;
+
+			if (count == space)
+			{
+				space= space ? space*2 : 1024;
+				STOPIF( hlp__realloc( &list, space*sizeof(*list)), NULL);
+			}
+
+			list[count].sts=sts;
+			list[count].size=st.size;
+			list[count].dev=st.dev;
+			list[count].ino=st.ino;
+			list[count].pos=0;
+			if (!pf___dev_in(st.dev, no_fiemap, no_fiemap_count) &&
+					pf___physical(path, & list[count].pos))
+			{
+				DEBUGP("no FIEMAP on device 0x%llx (%s)", (t_ull)st.dev, path);
+				STOPIF( hlp__realloc( &no_fiemap, 
+							(no_fiemap_count+1)*sizeof(*no_fiemap)), NULL);
+				no_fiemap[no_fiemap_count++]=st.dev;
+			}
+
+			count++;
+		}
+
+	DEBUGP("%u files to hash, %u devices sorted by inode", 
+			count, no_fiemap_count);
+	if (!count) goto ex;
+
+	/* The files on these devices are sorted by inode number; the positions 
+	 * of the ones seen before the first failure are overwritten, too. */
+	if (no_fiemap_count)
+		for(n=0; n<count; n++)
+			if (pf___dev_in(list[n].dev, no_fiemap, no_fiemap_count))
+				list[n].pos=list[n].ino;
+
+	qsort(list, count, sizeof(*list), pf___cmp_pos);
+
+	/* The files are still read in this order; only the small ones are 
+	 * hashed together afterwards. */
+	for(n=0; n<count; n+=batch)
+	{
+		batch= count-n < CS__SMALL_BATCH ? count-n : CS__SMALL_BATCH;
+		for(j=0; j<batch; j++)
+		{
+			STOPIF( ops__build_path(&path, list[n+j].sts), NULL);
+			STOPIF( cs__compare_init(cmp+j, list[n+j].sts, path, 
+						list[n+j].size), NULL);
+			cmps[j]=cmp+j;
+		}
+
+		cs__compare_small(cmps, result, batch);
+
+		for(j=0; j<batch; j++)
+		{
+			STOPIF( result[j], "comparing %s", cmp[j].path);
+			/* Unreadable files are tried again in the tree walk, which 
+			 * reports them. */
+			if (!cmp[j].unreadable)
+				STOPIF( cs__compare_finish(cmp+j, list[n+j].sts, NULL), NULL);
+			IF_FREE(cmp[j].md5s_path);
+		}
+	}
+
+ex:
+	IF_FREE(list);
+	IF_FREE(no_fiemap);
+	for(j=0; j<CS__SMALL_BATCH; j++)
+		IF_FREE(cmp[j].md5s_path);
+	return status;
+}
+/** @} */
+
+/** @} */
@@ -0,0 +1,53 @@
+/************************************************************************
+ * Copyright (C) 2026 Philipp Marek.
+ *
+ * This program is free software;  you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ ************************************************************************/
+
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#include <apr_file_io.h>
+#include <subversion-1/svn_io.h>
+
+#include "global.h"
+#include "waa.h"
+
+/** \file
+ * Threaded \c lstat() prefetching, file comparing and commit read-ahead 
+ * header file. */
+
+/** Upper limit for \ref o_threads. */
+#define PF__MAX_THREADS (64)
+
+/** Starts the worker threads, if \ref o_threads asks for them; they begin
+ * fetching the meta-data of the entries in \a blocks. */
+int pf__start(struct waa__entry_blocks_t *blocks);
+/** Stops the worker threads, and frees the associated resources. */
+int pf__stop(void);
+
+/** Returns the meta-data for \a sts, located at \a fullpath; uses the
+ * prefetched values if possible, else does a \c hlp__lstat(). */
+int pf__lstat(struct estat *sts, const char *fullpath, struct sstat_t *st);
+/** Like cs__compare_file(), but takes the result of a worker thread if 
+ * there is one. */
+int pf__compare_file(struct estat *sts, char *fullpath, int *result);
+
+/** Remembers \a sts as a file that will be sent on commit. */
+int pf__read_ahead_add(struct estat *sts);
+/** Starts the threads that read the remembered files in advance. */
+int pf__read_ahead_start(void);
+/** Tells the read-ahead threads that the data of \a sts is read now. */
+int pf__read_ahead_at(struct estat *sts);
+/** Reads ahead in \a file, while it's read via the returned stream. */
+int pf__read_ahead_stream(apr_file_t *file, off_t size,
+		svn_stream_t *input, svn_stream_t **output,
+		apr_pool_t *pool);
+
+/** Hashes the files in \a blocks that need it sorted by their position on 
+ * disk, see \ref o_hash_order. */
+int pf__hash_in_disk_order(struct waa__entry_blocks_t *blocks);
+
+#endif
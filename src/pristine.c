@@ -0,0 +1,678 @@
+/************************************************************************
+ * Copyright (C) 2026 Philipp Marek.
+ *
+ * This program is free software;  you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ ************************************************************************/
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <apr_md5.h>
+#include <apr_pools.h>
+#include <apr_file_io.h>
+#include <subversion-1/svn_io.h>
+
+#include "global.h"
+#include "pristine.h"
+#include "checksum.h"
+#include "options.h"
+#include "est_ops.h"
+#include "update.h"
+#include "helper.h"
+#include "waa.h"
+
+
+/** \file
+ * Local store of base texts.
+ *
+ * See \ref o_pristine for the user side.
+ *
+ * The texts are stored compressed, named by their MD5, in the \c
+ * PST___DIR directory of the working copy in the WAA; as with \c git, two
+ * hex characters of the name are taken as subdirectory. Identical texts
+ * (copies, files that got reverted to an older text) are stored only once.
+ *
+ * Which text is the base of an entry is written in a small \ref pbase
+ * file per entry, together with the revision and URL it's the text of, 
+ * and the meta-data of the entry in that revision (for \ref diff).
+ * It's only used if these are still the entry's ones; so a stale \ref
+ * pbase file (after an update that fetched no text, a commit to another
+ * URL, a crash in between, ...) just means that the repository is asked
+ * again.
+ *
+ * Each text has a count of the \ref pbase files that name it, in a file 
+ * with \c PST___REFS_EXT appended; when that gets to zero, the text is 
+ * removed. Texts that got stored, but never referenced (because the 
+ * command failed) aren't found that way; they're left until the store 
+ * is removed.
+ *
+ * The \ref pbase files must only be written when the revision is known,
+ * and (for commit) when the data really is in the repository; so the
+ * texts that went through pst__filter() are remembered, and the files
+ * are written by pst__write_refs() at the end of the action. */
+
+
+/** The directory below the working copy's directory in the WAA. */
+#define PST___DIR "pristine"
+/** Appended to the name of a text for its reference count. */
+#define PST___REFS_EXT ".refs"
+
+
+/** The data for a stream that stores its text. */
+struct pst___filter_t
+{
+	/** The entry the text belongs to. */
+	struct estat *sts;
+	/** The stream that's read from or written to. */
+	svn_stream_t *input;
+	/** The compressing stream into the temporary file. */
+	svn_stream_t *store;
+	/** The name of the temporary file, as long as it exists. */
+	char *tmp_name;
+	/** The MD5 of the text, which gives its name. */
+	apr_md5_ctx_t md5_ctx;
+};
+
+
+/** A text that is to become the base of its entry. */
+struct pst___pending_t
+{
+	struct estat *sts;
+	md5_digest_t md5;
+};
+
+
+/** The base path of the store, and a buffer for the names of the texts.
+ * */
+static char *pst___path;
+/** The length of the base path, including the \c PATH_SEPARATOR. */
+static int pst___path_len;
+/** The base name for temporary files; they have to be in the store, so
+ * that they can be renamed. */
+static char *pst___tmp_base;
+/** The texts that were stored in this run. @{ */
+static struct pst___pending_t *pst___pending;
+static unsigned pst___pending_count, pst___pending_max;
+/** @} */
+
+
+/** Gets the path of the store, and creates the directory. */
+static int pst___init(void)
+{
+	int status;
+	char *dir, *start_of_spec;
+
+
+	status=0;
+	if (pst___path) goto ex;
+
+	/* Everything after \a start_of_spec is the path of the given entry. */
+	STOPIF( waa__get_waa_directory(wc_path, &dir, NULL, &start_of_spec,
+				GWD_WAA), NULL);
+	pst___path_len=start_of_spec - dir;
+
+	/* "PST___DIR/xx/", the 32 hex characters, and PST___REFS_EXT. */
+	STOPIF( hlp__alloc( &pst___path, pst___path_len + strlen(PST___DIR) +
+				1 + 2 + 1 + APR_MD5_DIGESTSIZE*2 + 
+				strlen(PST___REFS_EXT) + 1), NULL);
+	memcpy(pst___path, dir, pst___path_len);
+	strcpy(pst___path + pst___path_len, PST___DIR);
+	pst___path_len += strlen(PST___DIR);
+	pst___path[pst___path_len++]=PATH_SEPARATOR;
+	pst___path[pst___path_len]=0;
+
+	STOPIF( waa__mkdir(pst___path, 1), NULL);
+	DEBUGP("pristine store at %s", pst___path);
+
+	STOPIF( hlp__alloc( &pst___tmp_base, pst___path_len + 4), NULL);
+	strcpy(pst___tmp_base, pst___path);
+	strcpy(pst___tmp_base + pst___path_len, "new");
+
+ex:
+	return status;
+}
+
+
+/** Returns the name of the text with the given \a md5, in a static
+ * buffer; the directory above is created if \a mkdir is set. */
+static int pst___text_path(const md5_digest_t md5, int mkdir, char **path)
+{
+	int status;
+	char *cp;
+
+
+	STOPIF( pst___init(), NULL);
+
+	cp=pst___path + pst___path_len;
+	cs__md5tohex(md5, cp+3);
+	cp[0]=cp[3];
+	cp[1]=cp[4];
+	cp[2]=PATH_SEPARATOR;
+
+	if (mkdir)
+		STOPIF( waa__mkdir(pst___path, 0), NULL);
+
+	*path=pst___path;
+
+ex:
+	return status;
+}
+
+
+/** Changes the reference count of the text \a md5 by \a delta; if it 
+ * gets to zero, the text is removed. */
+static int pst___change_refs(const md5_digest_t md5, int delta)
+{
+	int status, l;
+	int fh;
+	char *path, *eos;
+	char buffer[32];
+	int count;
+
+
+	fh=-1;
+	STOPIF( pst___text_path(md5, delta > 0, &path), NULL);
+	eos=path + strlen(path);
+	strcpy(eos, PST___REFS_EXT);
+
+	count=0;
+	fh=open(path, O_RDONLY);
+	if (fh == -1)
+		STOPIF_CODE_ERR( errno != ENOENT, errno, 
+				"Cannot read the references of \"%s\"", path);
+	else
+	{
+		l=read(fh, buffer, sizeof(buffer)-1);
+		STOPIF_CODE_ERR( l == -1, errno, 
+				"Cannot read the references of \"%s\"", path);
+		buffer[l]=0;
+		count=atoi(buffer);
+		STOPIF_CODE_ERR( close(fh) == -1, errno, NULL);
+	}
+	fh=-1;
+
+	count += delta;
+	DEBUGP("%s has %d references", path, count);
+	if (count <= 0)
+	{
+		STOPIF_CODE_ERR( unlink(path) == -1 && errno != ENOENT, errno,
+				"Cannot remove \"%s\"", path);
+		*eos=0;
+		STOPIF_CODE_ERR( unlink(path) == -1 && errno != ENOENT, errno,
+				"Cannot remove the pristine text \"%s\"", path);
+	}
+	else
+	{
+		fh=open(path, WAA__WRITE, 0666);
+		STOPIF_CODE_ERR( fh == -1, errno, 
+				"Cannot write the references of \"%s\"", path);
+		l=snprintf(buffer, sizeof(buffer), "%d\n", count);
+		STOPIF_CODE_ERR( write(fh, buffer, l) != l, errno,
+				"Cannot write the references of \"%s\"", path);
+	}
+
+ex:
+	if (fh != -1)
+	{
+		l=close(fh);
+		STOPIF_CODE_ERR( l == -1 && !status, errno, 
+				"Closing the references");
+	}
+	return status;
+}
+
+
+/** Reads the \ref pbase file of \a filename; returns \c ENOENT if 
+ * there's none.
+ * If \a meta is not \c NULL, the stored meta-data is put there. */
+static int pst___read_ref(const char *filename, md5_digest_t md5,
+		svn_revnum_t *rev, int *intnum, struct sstat_t *meta)
+{
+	int status, l;
+	int fh;
+	char buffer[APR_MD5_DIGESTSIZE*2 + 128];
+	char hex[APR_MD5_DIGESTSIZE*2 + 1];
+	unsigned mode;
+	t_ull mtime;
+	unsigned uid, gid;
+
+
+	fh=-1;
+	status=waa__open_byext(filename, WAA__PRISTINE_EXT, WAA__READ, &fh);
+	if (status == ENOENT) goto ex;
+	STOPIF( status, NULL);
+
+	l=read(fh, buffer, sizeof(buffer)-1);
+	STOPIF_CODE_ERR( l == -1, errno,
+			"Reading the pristine reference of \"%s\"", filename);
+	buffer[l]=0;
+
+	STOPIF_CODE_ERR( sscanf(buffer, "%32s %ld %d %o %llx %u %u",
+				hex, rev, intnum, &mode, &mtime, &uid, &gid) != 7, EINVAL,
+			"The pristine reference of \"%s\" is invalid", filename);
+	STOPIF( cs__char2md5(hex, NULL, md5), NULL);
+
+	if (meta)
+	{
+		meta->mode=mode;
+		meta->mtim.tv_sec=mtime;
+		meta->mtim.tv_nsec=0;
+		meta->uid=uid;
+		meta->gid=gid;
+	}
+
+ex:
+	if (fh != -1)
+	{
+		l=close(fh);
+		STOPIF_CODE_ERR( l == -1 && !status, errno,
+				"Closing the pristine reference");
+	}
+	return status;
+}
+
+
+/** Writes the \ref pbase file of \a sts, with its current meta-data.
+ * The reference count of the new text is incremented, and the one of 
+ * the text named before decremented. */
+static int pst___write_ref(struct estat *sts, const md5_digest_t md5,
+		svn_revnum_t rev)
+{
+	int status, l;
+	int fh;
+	char *filename;
+	char buffer[APR_MD5_DIGESTSIZE*2 + 128];
+	md5_digest_t old_md5;
+	svn_revnum_t old_rev;
+	int old_intnum, changed;
+
+
+	fh=-1;
+	STOPIF( ops__build_path(&filename, sts), NULL);
+	DEBUGP("%s is %s@%ld", filename, cs__md5tohex_buffered(md5), rev);
+
+	status=pst___read_ref(filename, old_md5, &old_rev, &old_intnum, NULL);
+	changed= status == ENOENT ? -1 : 
+		memcmp(old_md5, md5, sizeof(old_md5)) != 0;
+	if (status == ENOENT) status=0;
+	STOPIF( status, NULL);
+
+	if (changed)
+		STOPIF( pst___change_refs(md5, +1), NULL);
+
+	STOPIF( waa__open_byext(filename, WAA__PRISTINE_EXT,
+				WAA__WRITE, &fh), NULL);
+
+	l=snprintf(buffer, sizeof(buffer), "%s %ld %d %o %llx %u %u\n",
+			cs__md5tohex_buffered(md5), rev, sts->url->internal_number,
+			(unsigned)sts->st.mode, (t_ull)sts->st.mtim.tv_sec,
+			(unsigned)sts->st.uid, (unsigned)sts->st.gid);
+	STOPIF_CODE_ERR( write(fh, buffer, l) != l, errno,
+			"Writing the pristine reference of \"%s\"", filename);
+
+	l=waa__close(fh, status);
+	fh=-1;
+	STOPIF_CODE_ERR( l == -1, errno,
+			"Closing the pristine reference of \"%s\"", filename);
+
+	/* Only now the old text isn't needed anymore. */
+	if (changed == 1)
+		STOPIF( pst___change_refs(old_md5, -1), NULL);
+
+ex:
+	if (fh != -1)
+		waa__close(fh, status);
+	return status;
+}
+
+
+/** Remembers that \a md5 is to become the base text of \a sts. */
+static int pst___remember(struct estat *sts, const md5_digest_t md5)
+{
+	int status;
+
+
+	status=0;
+	if (pst___pending_count == pst___pending_max)
+	{
+		pst___pending_max= pst___pending_max ? pst___pending_max*2 : 64;
+		STOPIF( hlp__realloc( &pst___pending,
+					pst___pending_max * sizeof(*pst___pending)), NULL);
+	}
+
+	pst___pending[pst___pending_count].sts=sts;
+	memcpy(pst___pending[pst___pending_count].md5, md5, sizeof(md5_digest_t));
+	pst___pending_count++;
+
+ex:
+	return status;
+}
+
+
+/** Removes the temporary file, if the stream didn't get closed. */
+static apr_status_t pst___cleanup(void *baton)
+{
+	struct pst___filter_t *flt=baton;
+
+	if (flt->tmp_name)
+		unlink(flt->tmp_name);
+	flt->tmp_name=NULL;
+
+	return APR_SUCCESS;
+}
+
+
+/** Puts the data in the store. */
+static int pst___store(struct pst___filter_t *flt,
+		const char *data, apr_size_t len)
+{
+	int status;
+	svn_error_t *status_svn;
+
+
+	status=0;
+	apr_md5_update(& flt->md5_ctx, data, len);
+	STOPIF_SVNERR( svn_stream_write, (flt->store, data, &len) );
+
+ex:
+	return status;
+}
+
+
+svn_error_t *pst___close(void *baton);
+
+
+svn_error_t *pst___read(void *baton, char *data, apr_size_t *len)
+{
+	int status;
+	svn_error_t *status_svn;
+	struct pst___filter_t *flt=baton;
+
+
+	status=0;
+	STOPIF_SVNERR( svn_stream_read, (flt->input, data, len) );
+	if (*len && data)
+		STOPIF( pst___store(flt, data, *len), NULL);
+	else
+		STOPIF_SVNERR( pst___close, (baton));
+
+ex:
+	RETURN_SVNERR(status);
+}
+
+
+svn_error_t *pst___write(void *baton, const char *data, apr_size_t *len)
+{
+	int status;
+	svn_error_t *status_svn;
+	struct pst___filter_t *flt=baton;
+
+
+	status=0;
+	/* Only the bytes that could be written are stored. */
+	STOPIF_SVNERR( svn_stream_write, (flt->input, data, len) );
+	if (*len && data)
+		STOPIF( pst___store(flt, data, *len), NULL);
+
+ex:
+	RETURN_SVNERR(status);
+}
+
+
+/** Closes the streams, and moves the text to its place.
+ * Gets called twice on reading; once at the end of the data, and by the
+ * caller. */
+svn_error_t *pst___close(void *baton)
+{
+	int status;
+	svn_error_t *status_svn;
+	struct pst___filter_t *flt=baton;
+	md5_digest_t md5;
+	char *path;
+
+
+	status=0;
+	if (flt->input)
+	{
+		STOPIF_SVNERR( svn_stream_close, (flt->input) );
+		flt->input=NULL;
+	}
+
+	if (flt->store)
+	{
+		/* Closes the temporary file, too. */
+		STOPIF_SVNERR( svn_stream_close, (flt->store) );
+		flt->store=NULL;
+
+		apr_md5_final(md5, & flt->md5_ctx);
+		STOPIF( pst___text_path(md5, 1, &path), NULL);
+
+		/* If that text is already stored, it just gets replaced. */
+		STOPIF_CODE_ERR( rename(flt->tmp_name, path) == -1, errno,
+				"Cannot rename \"%s\" to \"%s\"", flt->tmp_name, path);
+		flt->tmp_name=NULL;
+
+		STOPIF( pst___remember(flt->sts, md5), NULL);
+	}
+
+ex:
+	RETURN_SVNERR(status);
+}
+
+
+/** -.
+ * If \ref o_pristine is off, \a output is just \a input.
+ *
+ * The stream can be read from or written to; it must see the data as
+ * it is in the repository, ie. not be behind an encoder or decoder.
+ *
+ * The text becomes the base of \a sts on the next pst__write_refs(). */
+int pst__filter(struct estat *sts,
+		svn_stream_t *input, svn_stream_t **output,
+		apr_pool_t *pool)
+{
+	int status;
+	struct pst___filter_t *flt;
+	svn_stream_t *new_str;
+	apr_file_t *tmp;
+	char *tmp_name;
+
+
+	status=0;
+	*output=input;
+	if (opt__get_int(OPT__PRISTINE) == OPT__NO) goto ex;
+
+	STOPIF( pst___init(), NULL);
+
+	flt=apr_pcalloc(pool, sizeof(*flt));
+	STOPIF_ENOMEM( !flt );
+
+	flt->sts=sts;
+	flt->input=input;
+	apr_md5_init(& flt->md5_ctx);
+
+	STOPIF( waa__get_tmp_name( pst___tmp_base, &tmp_name, &tmp, pool), NULL);
+	/* The name is only in a cache. */
+	flt->tmp_name=apr_pstrdup(pool, tmp_name);
+	STOPIF_ENOMEM( !flt->tmp_name );
+	apr_pool_cleanup_register(pool, flt, pst___cleanup,
+			apr_pool_cleanup_null);
+
+	flt->store=svn_stream_compressed(
+			svn_stream_from_aprfile2(tmp, FALSE, pool), pool);
+
+	new_str=svn_stream_create(flt, pool);
+	STOPIF_ENOMEM( !new_str );
+
+	svn_stream_set_read(new_str, pst___read);
+	svn_stream_set_write(new_str, pst___write);
+	svn_stream_set_close(new_str, pst___close);
+
+	*output=new_str;
+
+ex:
+	return status;
+}
+
+
+/** -.
+ * The base text is only given if \ref o_pristine is set, and the text of
+ * the entry's revision is stored; else \c ENOENT is returned, without an
+ * error message. Texts that go through an \ref FSVS_PROP_UPDATE_PIPE
+ * "update-pipe" aren't used.
+ *
+ * The stream has to be closed by the caller; if \a md5 is not \c NULL,
+ * the MD5 of the text is returned there. If \a meta is not \c NULL, it 
+ * gets the mode, mtime, owner and group of the entry in that revision. */
+int pst__get_base(struct estat *sts,
+		svn_stream_t **base, unsigned char md5[APR_MD5_DIGESTSIZE],
+		struct sstat_t *meta, apr_pool_t *pool)
+{
+	int status;
+	md5_digest_t digest;
+	svn_revnum_t rev;
+	int intnum;
+	char *path;
+	apr_file_t *a_file;
+	struct sstat_t st;
+
+
+	status=ENOENT;
+	if (opt__get_int(OPT__PRISTINE) == OPT__NO || !sts->url) goto ex;
+
+	STOPIF( up__fetch_decoder(sts), NULL);
+	status=ENOENT;
+	if (sts->decoder) goto ex;
+
+	STOPIF( ops__build_path(&path, sts), NULL);
+	status=pst___read_ref(path, digest, &rev, &intnum, &st);
+	if (status == ENOENT) goto ex;
+	STOPIF( status, NULL);
+
+	status=ENOENT;
+	if (rev != sts->repos_rev || intnum != sts->url->internal_number)
+	{
+		DEBUGP("stored text is for %ld@%d", rev, intnum);
+		goto ex;
+	}
+
+	STOPIF( pst___text_path(digest, 0, &path), NULL);
+	/* The store may have been removed. */
+	status=apr_file_open(&a_file, path, APR_READ, 0, pool);
+	if (APR_STATUS_IS_ENOENT(status))
+	{
+		DEBUGP("%s is missing", path);
+		status=ENOENT;
+		goto ex;
+	}
+	STOPIF( status, "Cannot open the pristine text \"%s\"", path);
+
+	*base=svn_stream_compressed(
+			svn_stream_from_aprfile2(a_file, FALSE, pool), pool);
+	if (md5)
+		memcpy(md5, digest, sizeof(digest));
+	if (meta)
+		*meta=st;
+	DEBUGP("base text is %s", path);
+
+ex:
+	return status;
+}
+
+
+/** -.
+ * For entries that get committed without a changed text; their revision
+ * changes, but the base text stays the same. */
+int pst__keep_base(struct estat *sts)
+{
+	int status;
+	md5_digest_t digest;
+	svn_revnum_t rev;
+	int intnum;
+	char *path;
+
+
+	status=0;
+	if (opt__get_int(OPT__PRISTINE) == OPT__NO || !sts->url) goto ex;
+
+	STOPIF( ops__build_path(&path, sts), NULL);
+	status=pst___read_ref(path, digest, &rev, &intnum, NULL);
+	if (status == ENOENT)
+	{
+		status=0;
+		goto ex;
+	}
+	STOPIF( status, NULL);
+
+	if (rev == sts->repos_rev && intnum == sts->url->internal_number)
+		STOPIF( pst___remember(sts, digest), NULL);
+
+ex:
+	return status;
+}
+
+
+/** -.
+ * To be called when the new revisions are set; entries that still have
+ * the special value \c SET_REVNUM get the current revision of their URL,
+ * like in waa__output_tree().
+ *
+ * Only regular files get a \ref pbase file; special entries are stored
+ * as text, too, but aren't used. */
+int pst__write_refs(void)
+{
+	int status;
+	unsigned i;
+	struct estat *sts;
+	svn_revnum_t rev;
+
+
+	status=0;
+	for(i=0; i<pst___pending_count; i++)
+	{
+		sts=pst___pending[i].sts;
+		if (!sts->url || !S_ISREG(sts->st.mode)) continue;
+
+		rev=sts->repos_rev;
+		if (rev == SET_REVNUM) rev=sts->url->current_rev;
+
+		STOPIF( pst___write_ref(sts, pst___pending[i].md5, rev), NULL);
+	}
+
+	pst___pending_count=0;
+
+ex:
+	return status;
+}
+
+
+/** -.
+ * For entries that are removed; the \ref pbase file is deleted, and the 
+ * text it named is removed, too, if no other entry has it as base.
+ *
+ * This is done even if \ref o_pristine is off now, so that the store 
+ * doesn't keep unneeded texts. */
+int pst__drop_base(char *filename)
+{
+	int status;
+	md5_digest_t digest;
+	svn_revnum_t rev;
+	int intnum;
+
+
+	status=pst___read_ref(filename, digest, &rev, &intnum, NULL);
+	if (status == ENOENT)
+	{
+		status=0;
+		goto ex;
+	}
+	STOPIF( status, NULL);
+
+	STOPIF( waa__delete_byext(filename, WAA__PRISTINE_EXT, 1), NULL);
+	STOPIF( pst___change_refs(digest, -1), NULL);
+
+ex:
+	return status;
+}
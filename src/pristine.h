@@ -0,0 +1,36 @@
+/************************************************************************
+ * Copyright (C) 2026 Philipp Marek.
+ *
+ * This program is free software;  you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ ************************************************************************/
+
+#ifndef __PRISTINE_H__
+#define __PRISTINE_H__
+
+#include <apr_md5.h>
+#include <subversion-1/svn_io.h>
+
+#include "global.h"
+
+/** \file
+ * Pristine store header file; see \ref o_pristine. */
+
+/** Stores the data that goes through the stream in the pristine store,
+ * as text of \a sts. */
+int pst__filter(struct estat *sts,
+		svn_stream_t *input, svn_stream_t **output,
+		apr_pool_t *pool);
+/** Returns the stored base text of \a sts, or \c ENOENT. */
+int pst__get_base(struct estat *sts,
+		svn_stream_t **base, unsigned char md5[APR_MD5_DIGESTSIZE],
+		struct sstat_t *meta, apr_pool_t *pool);
+/** Keeps the current base text of \a sts for its new revision. */
+int pst__keep_base(struct estat *sts);
+/** Records the stored texts as base of their entries. */
+int pst__write_refs(void);
+/** Removes the base of the removed entry \a filename. */
+int pst__drop_base(char *filename);
+
+#endif
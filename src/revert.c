@@ -25,6 +25,7 @@
 #include "update.h"
 #include "cp_mv.h"
 #include "status.h"
+#include "pristine.h"
 
 
 /** \file
@@ -166,6 +167,9 @@ static svn_revnum_t last_rev;
  *
  * If \a sts_for_manber is \c NULL, no manber hashes are calculated.
  *
+ * If \a output is \c NULL, only the properties are fetched; \a decoder 
+ * and \a sts_for_manber are not used then.
+ *
  * If \a output_sts is \c NULL, the meta-data properties are kept in \a 
  * props; else its fields are filled (as far as possible) with data. That 
  * includes the estat::repos_rev field.
@@ -232,8 +236,8 @@ int rev__get_text_to_stream( char *loc_url, svn_revnum_t revision,
 	 * We need to get the MD5 anyway; there's svn_stream_checksummed(),
 	 * but that's just one chainlink more, and so we simply use our own
 	 * function. */
-	if (sts_for_manber)
-		STOPIF( cs__new_manber_filter(sts_for_manber, 
+	if (sts_for_manber && output)
+		STOPIF( cs__new_manber_filter(sts_for_manber, NULL,
 					output, &output, pool), NULL);	
 
 
@@ -269,7 +273,7 @@ int rev__get_text_to_stream( char *loc_url, svn_revnum_t revision,
 	 * portable). */
 
 	/* Fetch decoder from repository. */
-	if (decoder == DECODER_UNKNOWN)
+	if (decoder == DECODER_UNKNOWN && output)
 	{
 		STOPIF_SVNERR_TEXT( svn_ra_get_file,
 				(current_url->session,
@@ -290,7 +294,7 @@ int rev__get_text_to_stream( char *loc_url, svn_revnum_t revision,
 
 	/* First decode, then do manber-hashing. As the filters are prepended, we 
 	 * have to do that after the manber-filter. */
-	if (decoder)
+	if (decoder && output)
 	{
 		snprintf(target_rev, sizeof(target_rev), 
 				"%llu", (t_ull)revision);
@@ -315,7 +319,8 @@ int rev__get_text_to_stream( char *loc_url, svn_revnum_t revision,
 	DEBUGP("got revision %llu", (t_ull)revision);
 
 	/* svn_ra_get_file doesn't close the stream. */
-	STOPIF_SVNERR( svn_stream_close, (output));
+	if (output)
+		STOPIF_SVNERR( svn_stream_close, (output));
 	output=NULL;
 
 	if (output_sts)
@@ -428,6 +433,8 @@ int rev__install_file(struct estat *sts, svn_revnum_t revision,
 	char *special_data;
 	char *url;
 	svn_revnum_t rev_to_take;
+	svn_stream_t *base;
+	md5_digest_t base_md5;
 
 
 	BUG_ON(!pool);
@@ -508,10 +515,36 @@ int rev__install_file(struct estat *sts, svn_revnum_t revision,
 
 	STOPIF( url__open_session(NULL, NULL), NULL);
 
-	/* We don't give an estat for meta-data parsing, because we have to loop 
-	 * through the property list anyway - for storing locally. */
-	STOPIF( rev__get_text_to_stream( url, rev_to_take, decoder, 
-				stream, sts, NULL, &props, pool), NULL);
+	/* The base text may be in the pristine store; then only the properties 
+	 * are needed from the repository. Else it gets stored now. */
+	base=NULL;
+	if (revision == 0 && sts->url && !decoder)
+	{
+		status=pst__get_base(sts, &base, base_md5, NULL, subpool);
+		if (status == ENOENT)
+			status=0;
+		STOPIF( status, NULL);
+
+		if (!base)
+			STOPIF( pst__filter(sts, stream, &stream, subpool), NULL);
+	}
+
+	if (base)
+	{
+		STOPIF( rev__get_text_to_stream( url, rev_to_take, NULL, 
+					NULL, NULL, NULL, &props, pool), NULL);
+
+		STOPIF( cs__new_manber_filter(sts, NULL, stream, &stream, subpool), 
+				NULL);
+		STOPIF( hlp__stream_copy(base, stream), NULL);
+		STOPIF_CODE_ERR( memcmp(sts->md5, base_md5, sizeof(base_md5)) != 0, 
+				EIO, "The pristine text of \"%s\" is damaged", filename);
+	}
+	else
+		/* We don't give an estat for meta-data parsing, because we have to 
+		 * loop through the property list anyway - for storing locally. */
+		STOPIF( rev__get_text_to_stream( url, rev_to_take, decoder, 
+					stream, sts, NULL, &props, pool), NULL);
 
 
 	if (apr_hash_get(props, propname_special, APR_HASH_KEY_STRING))
@@ -1114,6 +1147,7 @@ int rev__work(struct estat *root, int argc, char *argv[])
 	{
 		delay_start=time(NULL);
 		STOPIF( waa__output_tree(root), NULL);
+		STOPIF( pst__write_refs(), NULL);
 		STOPIF( hlp__delay(delay_start, DELAY_REVERT), NULL);
 	}
 
@@ -312,6 +312,9 @@ int sync__progress(struct estat *sts)
 
 		if (!(sts->remote_status & FS_META_MTIME))
 			sts->st.mtim=st.mtim;
+		/* The repository has only microseconds. */
+		sts->st.nsec_known= st.nsec_known && 
+			!(sts->remote_status & FS_META_MTIME);
 		if (!(sts->remote_status & FS_META_OWNER))
 			sts->st.uid=st.uid;
 		if (!(sts->remote_status & FS_META_GROUP))
@@ -83,6 +83,7 @@
 #include "waa.h"
 #include "commit.h"
 #include "racallback.h"
+#include "pristine.h"
 
 
 
@@ -425,6 +426,7 @@ int up__unlink(struct estat *sts, char *filename)
 	{
 		STOPIF( waa__delete_byext(filename, WAA__FILE_MD5s_EXT, 1), NULL);
 		STOPIF( waa__delete_byext(filename, WAA__PROP_EXT, 1), NULL);
+		STOPIF( pst__drop_base(filename), NULL);
 	}
 
 	DEBUGP("unlink(%s)", filename);
@@ -557,7 +559,11 @@ ex:
  * \c 0.0, mode \c 0600 ... which is not right either. */
 int up__set_meta_data(struct estat *sts, char *filename)
 {
+#ifdef HAVE_UTIMENSAT
+	struct timespec ts[2];
+#else
 	struct timeval tv[2];
+#endif
 	int status;
 	mode_t current_mode;
 
@@ -621,6 +627,17 @@ int up__set_meta_data(struct estat *sts, char *filename)
 	{
 		if (sts->remote_status & FS_META_MTIME)
 		{
+#ifdef HAVE_UTIMENSAT
+			/* Same order as below; but with full resolution, and for symlinks 
+			 * too. */
+			ts[1]=sts->st.mtim;
+			ts[0]=sts->st.mtim;
+			DEBUGP("setting %s's mtime %24.24s", 
+					filename, ctime(& (sts->st.mtim.tv_sec) ));
+			STOPIF_CODE_ERR( utimensat(AT_FDCWD, filename, ts, 
+						AT_SYMLINK_NOFOLLOW) == -1,
+					errno, "utimensat(%s)", filename);
+#else
 			/* index 1 is mtime */
 			tv[1].tv_sec =sts->st.mtim.tv_sec;
 			tv[1].tv_usec=sts->st.mtim.tv_nsec/1000;
@@ -633,6 +650,7 @@ int up__set_meta_data(struct estat *sts, char *filename)
 					filename, ctime(& (sts->st.mtim.tv_sec) ));
 			STOPIF_CODE_ERR( UTIMES_FUNC(filename, tv) == -1,
 					errno, "utimes(%s)", filename);
+#endif
 		}
 	}
 	else
@@ -971,7 +989,7 @@ into_stringbufs:
 
 		/* How do we get the filesize here? */
 		if (!action->is_import_export)
-			STOPIF( cs__new_manber_filter(sts, svn_s_tgt, &svn_s_tgt, 
+			STOPIF( cs__new_manber_filter(sts, NULL, svn_s_tgt, &svn_s_tgt, 
 						sts->filehandle_pool),
 					NULL);
 
@@ -982,6 +1000,9 @@ into_stringbufs:
 			/* If the file gets decoded, use the original MD5 for comparison. */
 			encoder->output_md5= &(sts->md5);
 		}
+		else if (!action->is_import_export)
+			STOPIF( pst__filter(sts, svn_s_tgt, &svn_s_tgt, 
+						sts->filehandle_pool), NULL);
 	}
 
 	STOPIF( hlp__local2utf8(filename, &fn_utf8, -1), NULL );
@@ -1229,6 +1250,7 @@ int up__work(struct estat *root, int argc, char *argv[])
 		delay_start=time(NULL);
 		STOPIF( waa__output_tree(root), NULL);
 		STOPIF( url__output_list(), NULL);
+		STOPIF( pst__write_refs(), NULL);
 		STOPIF( hlp__delay(delay_start, DELAY_UPDATE), NULL);
 	}
 
@@ -32,6 +32,7 @@
 #include "est_ops.h"
 #include "ignore.h"
 #include "actions.h"
+#include "prefetch.h"
 
 
 /** \file
@@ -116,7 +117,15 @@ const char
  * - needed string space (in bytes), 
  * - length of longest path in bytes.
  * */
-waa__header_line[]="%u %lu %u %u %u %u";
+waa__header_line[]="%u %lu %u %u %u %u",
+/** The header line of the binary dir-files.
+ *
+ * Has three more fields than \ref waa__header_line:
+ * - size of a record (for verification),
+ * - \c WAA_BYTE_ORDER, to detect files from other architectures,
+ * - number of struct \ref waa__dir_index_t entries.
+ * */
+waa__header_line_bin[]="%u %lu %u %u %u %u %u %x %u";
 
 
 /** Convenience function for creating two paths. */
@@ -912,6 +921,32 @@ ex:
 }
 
 
+/** -.
+ * The returned string is allocated, and has to be freed by the caller.
+ *
+ * This doesn't touch the filesystem; it's meant for the cases where the 
+ * file is opened later, possibly by another thread - the buffer returned 
+ * by waa__get_waa_directory() is shared. */
+int waa__get_byext_path(const char *entry_name,
+		const char *extension,
+		char **path)
+{
+	int status;
+	char *dest, *eos;
+
+
+	status=0;
+	STOPIF( waa__get_waa_directory(entry_name, &dest, &eos, NULL,
+				waa__get_gwd_flag(extension)), NULL);
+	strcpy(eos, extension);
+
+	STOPIF( hlp__strdup( path, dest), NULL);
+
+ex:
+	return status;
+}
+
+
 /** -.
  * */
 int waa__open_dir(char *wc_base,
@@ -922,10 +957,29 @@ int waa__open_dir(char *wc_base,
 }
 
 
-/** -.
- *
- * All entries are defined as new. */
-int waa__build_tree(struct estat *dir)
+static int waa___build_tree(struct estat *dir, int dir_fd);
+
+/** Opens the directory \a sts relative to \a parent_fd, and builds the 
+ * tree below. */
+static int waa___build_subtree(struct estat *sts, int parent_fd)
+{
+	int status, fd;
+
+	fd=openat(parent_fd, sts->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	STOPIF_CODE_ERR( fd == -1, errno, "open(%s)", sts->name);
+
+	status=waa___build_tree(sts, fd);
+	close(fd);
+	STOPIF( status, NULL);
+
+ex:
+	return status;
+}
+
+
+/** All entries of \a dir, which is opened as \a dir_fd, are defined as 
+ * new. */
+static int waa___build_tree(struct estat *dir, int dir_fd)
 {
 	int status;
 	struct estat *sts;
@@ -933,7 +987,7 @@ int waa__build_tree(struct estat *dir)
 
 	status=0;
 	/* no stat info on first iteration */
-	STOPIF( waa__dir_enum( dir, 0, 0), NULL);
+	STOPIF( waa__dir_enum( dir, dir_fd, 0, 0, NULL), NULL);
 
 
 	DEBUGP("found %d entries ...", dir->entry_count);
@@ -962,16 +1016,7 @@ int waa__build_tree(struct estat *dir)
 		if (S_ISDIR(sts->st.mode))
 		{
 			if (ops__are_children_interesting(sts))
-			{
-				STOPIF_CODE_ERR( chdir(sts->name) == -1, errno,
-						"chdir(%s)", sts->name);
-
-				STOPIF( waa__build_tree(sts), NULL );
-
-				/* this can fail if the parent directories have been removed. */
-				STOPIF_CODE_ERR( chdir("..") == -1, errno,
-						"parent has gone");
-			}
+				STOPIF( waa___build_subtree(sts, dir_fd), NULL );
 		}
 
 		STOPIF( ac__dispatch(sts), NULL);
@@ -989,99 +1034,726 @@ ex:
 }
 
 
-/** Returns the index at which the element should be
- * (the index at which an equal or first bigger inode is). */
-int waa___find_position(struct estat **new, 
-		struct estat ***array, int count)
+/** -.
+ *
+ * All entries are defined as new.
+ * \a dir must be the current working directory. */
+int waa__build_tree(struct estat *dir)
+{
+	int status, fd;
+
+	fd=open(".", O_RDONLY | O_DIRECTORY);
+	STOPIF_CODE_ERR( fd == -1, errno, "open(.)");
+
+	status=waa___build_tree(dir, fd);
+	close(fd);
+	STOPIF( status, NULL);
+
+ex:
+	return status;
+}
+
+
+/** Restores the heap order of the \a count cursors in \a directory, 
+ * after the one at position \a i has been advanced to a bigger inode.
+ *
+ * Normally the next entry of the same directory is still the smallest 
+ * one (the inodes are often grouped in their directories), so that takes 
+ * only one or two comparisons. */
+static inline void waa___heap_down(struct estat ***directory, int count, 
+		int i)
+{
+	struct estat **cur;
+	int child;
+
+
+	cur=directory[i];
+	while (1)
+	{
+		child=2*i+1;
+		if (child >= count) break;
+		if (child+1 < count &&
+				dir___f_sort_by_inode(directory[child+1], directory[child]) < 0)
+			child++;
+		if (dir___f_sort_by_inode(cur, directory[child]) <= 0) break;
+
+		directory[i]=directory[child];
+		i=child;
+	}
+	directory[i]=cur;
+}
+
+
+/** Moves the new cursor at position \a i in \a directory upwards, until 
+ * the heap order is restored. */
+static inline void waa___heap_up(struct estat ***directory, int i)
+{
+	struct estat **cur;
+	int parent;
+
+
+	cur=directory[i];
+	while (i)
+	{
+		parent=(i-1)/2;
+		if (dir___f_sort_by_inode(directory[parent], cur) <= 0) break;
+
+		directory[i]=directory[parent];
+		i=parent;
+	}
+	directory[i]=cur;
+}
+
+
+/** \name Output buffer for the dir file.
+ * The entries are collected here, and written in big chunks; the 
+ * checksum is calculated on the way.
+ * @{ */
+#define WAA___OUT_BUFFER (256*1024)
+static char *waa___out;
+static unsigned waa___out_used;
+static struct hlp__checksum_t waa___out_sum;
+/** @} */
+
+/** Writes the buffered data to \a fd.
+ * As the buffer size is a multiple of 8, only the last call can give a 
+ * partial word to hlp__checksum(). */
+static int waa___out_flush(int fd)
+{
+	int status;
+	ssize_t len;
+
+
+	status=0;
+	if (!waa___out_used) goto ex;
+
+	hlp__checksum(&waa___out_sum, waa___out, waa___out_used);
+	len=write(fd, waa___out, waa___out_used);
+	STOPIF_CODE_ERR( len != waa___out_used, errno, "write entries");
+	waa___out_used=0;
+
+ex:
+	return status;
+}
+
+/** Appends \a len bytes at \a data to the output buffer. */
+static int waa___out_write(int fd, const void *data, size_t len)
+{
+	int status;
+	size_t part;
+
+
+	status=0;
+	if (!waa___out)
+		STOPIF( hlp__alloc( &waa___out, WAA___OUT_BUFFER), NULL);
+
+	while (len)
+	{
+		part=WAA___OUT_BUFFER - waa___out_used;
+		if (part > len) part=len;
+
+		memcpy(waa___out + waa___out_used, data, part);
+		waa___out_used += part;
+		data=(const char*)data + part;
+		len -= part;
+
+		if (waa___out_used == WAA___OUT_BUFFER)
+			STOPIF( waa___out_flush(fd), NULL);
+	}
+
+ex:
+	return status;
+}
+
+
+/** \name Name area of the binary dir file.
+ * The names are collected while writing the records, and appended at the 
+ * end; the parent of each record is remembered for the index.
+ * @{ */
+static char *waa___names;
+static unsigned waa___names_len, waa___names_alloc;
+static uint32_t *waa___parents;
+static unsigned waa___parents_count, waa___parents_alloc;
+/** @} */
+
+/** Writes a single entry to \a fd, in the format chosen by \ref 
+ * o_dir_format. */
+static int waa___output_1entry(struct estat *sts, ino_t parent_index,
+		int fd, int binary)
 {
-	int smaller, middle, bigger_eq;
 	int status;
+	unsigned len;
+	struct waa__dir_record_t rec;
+	char *line;
+	int line_len;
 
 
-	/* That's easy. */
-	if (count == 0) 
-		return 0;
+	if (!binary)
+	{
+		STOPIF( ops__save_1entry(sts, parent_index, &line, &line_len), NULL);
+		STOPIF( waa___out_write(fd, line, line_len), NULL);
+		goto ex;
+	}
 
-	/* A special case. As the directories are normally laid out sequentially 
-	 * on a hard disk, the inodes are often grouped in their directories.
-	 * In a test case (my /etc) this shortcut was taken 1294 times, and
-	 * didn't catch 1257 times (with up to 80 entries in the array). */
-	/* Recent gcov tests are still better:
-	 * - of ~24000 calls of this function
-	 * - 118 times the above shortcut for only a single directory was taken,
-	 * - ~23730 times this single comparison was enough,
-	 * - and the binary search loop below was called only 16 times.
-	 * Hooray! */
-	if (dir___f_sort_by_inode(new, array[0]) < 0)
+	len=strlen(sts->name)+1;
+	if (waa___names_len + len > waa___names_alloc)
 	{
-		DEBUGP("short path taken for 0<1");
-		return 0;
+		waa___names_alloc = (waa___names_alloc + len) * 2;
+		STOPIF( hlp__realloc( &waa___names, waa___names_alloc), NULL);
 	}
-	/* if only one element, and not on first position ... */
-	if (count == 1) return 1;
 
-	/* some more cheating :-) */
-	if (dir___f_sort_by_inode(new, array[count-1]) >= 0)
+	STOPIF( ops__save_1record(sts, parent_index, waa___names_len, &rec), 
+			NULL);
+	memcpy(waa___names + waa___names_len, sts->name, len);
+	waa___names_len += len;
+
+	if (waa___parents_count >= waa___parents_alloc)
 	{
-		DEBUGP("short path taken for >count");
-		return count;
+		waa___parents_alloc = waa___parents_alloc*2 + 1024;
+		STOPIF( hlp__realloc( &waa___parents, 
+					waa___parents_alloc * sizeof(*waa___parents)), NULL);
 	}
-	smaller=1; 
+	waa___parents[waa___parents_count++]=parent_index;
+
+	STOPIF( waa___out_write(fd, &rec, sizeof(rec)), NULL);
+
+ex:
+	return status;
+}
+
+
+/** Writes the directory index for the records written so far; see 
+ * struct \ref waa__dir_index_t.
+ * The number of index entries is returned in \a index_count. */
+static int waa___output_index(int fd, unsigned *index_count)
+{
+	int status;
+	uint32_t *pos, *children;
+	struct waa__dir_index_t idx;
+	unsigned i, count, sum;
+
+
+	pos=children=NULL;
+	count=waa___parents_count;
+	*index_count=0;
+	STOPIF( hlp__calloc( &pos, count+1, sizeof(*pos)), NULL);
+	STOPIF( hlp__alloc( &children, count * sizeof(*children)), NULL);
 
-	/* bsearch can only find the _equal_ element - we need 
-	 * the first one higher. */
-	/* order is wrong - find new place for this element. */
-	bigger_eq=count-1;
-	/* i is a smaller element, k a possibly higher */
-#if 0
-	if (1)
+	/* The root has no parent. */
+	for(i=1; i<count; i++)
+		pos[ waa___parents[i] ]++;
+
+	sum=0;
+	for(i=1; i<=count; i++)
 	{
-		char tmp[count*(18+1)+10];
-		int i, n;
-		for (i=n=0; i<count; i++)
+		if (!pos[i]) continue;
+
+		idx.record=i;
+		idx.first=sum;
+		STOPIF( waa___out_write(fd, &idx, sizeof(idx)), NULL);
+		(*index_count)++;
+
+		sum += pos[i];
+		pos[i]=idx.first;
+	}
+
+	/* The records of a directory are written in its order, so the 
+	 * children stay sorted by inode. */
+	for(i=1; i<count; i++)
+		children[ pos[waa___parents[i]]++ ] = i+1;
+	STOPIF( waa___out_write(fd, children, 
+				(count ? count-1 : 0) * sizeof(*children)), NULL);
+
+ex:
+	IF_FREE(pos);
+	IF_FREE(children);
+	return status;
+}
+
+
+/** The binary \ref dir data of the last waa__input_tree() call.
+ * waa__output_tree() compares the entries against that, to write only the 
+ * changes to the \ref dirlog "journal".
+ *
+ * The memory stays mapped, as the names are used in place. */
+static struct {
+	/** The records and names of the \ref dir file. */
+	struct waa__dir_record_t *records;
+	char *names;
+	unsigned count, names_len;
+	/** The directory index, and the children array behind it. */
+	struct waa__dir_index_t *index;
+	uint32_t *children;
+	unsigned index_count;
+	/** Size and identity of the \ref dir file. */
+	struct sstat_t st;
+	/** The last journal entry for each changed index, sorted by index. */
+	struct waa__journal_entry_t **changes;
+	unsigned change_count;
+	/** The highest index in use. */
+	unsigned max_index;
+	/** Number of bytes of the journal that are valid. */
+	off_t journal_len;
+} waa___loaded;
+
+
+/** The records to load, if only some subtrees are wanted.
+ * Each value in \c wanted is the index of a record, shifted left by one; 
+ * the lowest bit is set for directories whose children are \b not loaded.
+ * \c stubs counts these. */
+static struct {
+	uint32_t *wanted;
+	unsigned count, alloc, pos;
+	unsigned stubs;
+} waa___lazy;
+
+
+/** Sorts journal entries by index; for the same index in the order of the 
+ * file, so that the last change wins. */
+static int waa___journal_cmp(const void *a, const void *b)
+{
+	const struct waa__journal_entry_t *ja=*(void**)a, *jb=*(void**)b;
+
+	if (ja->index != jb->index) 
+		return ja->index < jb->index ? -1 : +1;
+	return ja < jb ? -1 : (ja > jb);
+}
+
+
+/** Compares the index of two (deduplicated) journal entries. */
+static int waa___journal_cmp_index(const void *a, const void *b)
+{
+	const struct waa__journal_entry_t *ja=*(void**)a, *jb=*(void**)b;
+
+	return ja->index < jb->index ? -1 : (ja->index > jb->index);
+}
+
+
+/** Reads the \ref dirlog "journal" for the \ref dir file described by \c 
+ * waa___loaded.
+ *
+ * The last change for each index is put into \c waa___loaded.changes; \a 
+ * count is corrected for the added and removed entries. A stale journal 
+ * (or one written with another record layout), and an incomplete batch 
+ * at the end or one with a wrong checksum are silently ignored, as they 
+ * are the normal result of an interrupted run. */
+static int waa___journal_load(unsigned *count)
+{
+	int status, fh, i;
+	off_t length, pos, end, batch_pos;
+	char *map;
+	struct waa__journal_head_t *head;
+	struct waa__journal_batch_t *batch;
+	struct waa__journal_entry_t *entry;
+	unsigned alloc, batch_start, n, j;
+	struct hlp__checksum_t sum;
+
+
+	map=NULL;
+	length=0;
+	alloc=0;
+	waa___loaded.max_index=waa___loaded.count;
+
+	status=waa__open_byext(NULL, WAA__DIR_JOURNAL_EXT, O_RDONLY, &fh);
+	if (status == ENOENT) 
+	{
+		status=0;
+		goto ex;
+	}
+	STOPIF(status, "cannot open the journal");
+
+	length=lseek(fh, 0, SEEK_END);
+	status= length == (off_t)-1 ? errno : 0;
+	if (!status && length >= sizeof(*head))
+	{
+		/* Private and writable, like the dir file. */
+		map=mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fh, 0);
+		if (map == MAP_FAILED) 
 		{
-			n += sprintf(tmp+n,"%llu ", (t_ull)(*array[i])->st.ino);
+			map=NULL;
+			status=errno;
 		}
-		DEBUGP("having %d [ %s]", count, tmp);
-		DEBUGP("looking for %llu", (t_ull)(*new)->st.ino);
 	}
-#endif
+	i=close(fh);
+	STOPIF_CODE_ERR( status, status, "Cannot map the journal");
+	STOPIF_CODE_ERR( i, errno, "close() failed");
+	if (!map) goto ex;
+
+	head=(struct waa__journal_head_t*)map;
+	if (head->magic != WAA_JOURNAL_MAGIC ||
+			head->byte_order != WAA_BYTE_ORDER ||
+			head->version != WAA_VERSION_BINARY ||
+			head->record_size != sizeof(*entry) ||
+			head->base_ino != waa___loaded.st.ino ||
+			head->base_size != waa___loaded.st.size ||
+			head->base_mtime != waa___loaded.st.mtim.tv_sec ||
+			head->base_mtime_nsec != waa___loaded.st.mtim.tv_nsec)
+	{
+		DEBUGP("journal doesn't belong to this dir file");
+		goto ex;
+	}
 
-	while (1) //bigger_eq>smaller+1)
+	pos=sizeof(*head);
+	while (pos + sizeof(*batch) <= length)
 	{
-		middle=(bigger_eq+smaller)/2;
-		DEBUGP("at %d=%llu - %d=%llu - %d=%llu", 
-				smaller, (t_ull)(*array[smaller])->st.ino,
-				middle, (t_ull)(*array[middle])->st.ino,
-				bigger_eq, (t_ull)(*array[bigger_eq])->st.ino);
+		batch=(struct waa__journal_batch_t*)(map+pos);
+		if (batch->magic != WAA_JOURNAL_BATCH ||
+				batch->length > length - pos - sizeof(*batch))
+			break;
 
-		status=dir___f_sort_by_inode(new, array[middle]);
-		if (status > 0)
-			smaller=middle+1;
-		else if (status	< 0)
-			bigger_eq=middle;
-		else 
+		batch_pos=pos;
+		end=pos + sizeof(*batch) + batch->length;
+		pos += sizeof(*batch);
+
+		memset(&sum, 0, sizeof(sum));
+		hlp__checksum(&sum, map+pos, batch->length);
+		if (sum.a != batch->sum_a || sum.b != batch->sum_b)
 		{
-			/* status==0 means identical inodes => hardlinks.
-			 * Now these are directories ... but we see hardlinks eg. for binding 
-			 * mounts, so we cannot just abort. */
-			DEBUGP("Jackpot, hardlink!");
-			bigger_eq=middle;
+			DEBUGP("batch at %llu has a wrong checksum", (t_ull)batch_pos);
+			pos=batch_pos;
+			break;
+		}
+
+		batch_start=waa___loaded.change_count;
+		for(n=0; pos + sizeof(*entry) <= end; n++)
+		{
+			entry=(struct waa__journal_entry_t*)(map+pos);
+			if (WAA_JOURNAL_ENTRY_SIZE(entry->name_len) > end-pos ||
+					!entry->index ||
+					entry->op < WAA_JOURNAL_ADD || entry->op > WAA_JOURNAL_REMOVE ||
+					(entry->op == WAA_JOURNAL_REMOVE) != !entry->name_len ||
+					(entry->name_len && 
+					 ((char*)(entry+1))[entry->name_len-1] != '\0'))
+				break;
+
+			if (waa___loaded.change_count >= alloc)
+			{
+				alloc = alloc*2 + 64;
+				STOPIF( hlp__realloc( &waa___loaded.changes, 
+							alloc * sizeof(*waa___loaded.changes)), NULL);
+			}
+			waa___loaded.changes[waa___loaded.change_count++] = entry;
+			pos += WAA_JOURNAL_ENTRY_SIZE(entry->name_len);
+		}
+
+		if (pos != end || n != batch->count)
+		{
+			DEBUGP("batch at %llu is damaged", (t_ull)batch_pos);
+			waa___loaded.change_count=batch_start;
+			/* The next batch is written over this one. */
+			pos=batch_pos;
 			break;
 		}
-		if (bigger_eq<=smaller) break;
 	}
 
-	DEBUGP("believing in %d %llu",
-			bigger_eq, (t_ull)(*array[bigger_eq])->st.ino);
-	/* now we have an index bigger_eq, whose element is bigger or equal 
-	 * than the new, and its left is smaller or equal: */
-#if DEBUG
-	BUG_ON((bigger_eq < count-1 && dir___f_sort_by_inode(new, array[bigger_eq])>0) ||
-			(bigger_eq >0 && dir___f_sort_by_inode(new, array[bigger_eq-1])<0));
-#endif
+	/* Only the complete batches count. */
+	if (!waa___loaded.change_count) goto ex;
+	waa___loaded.journal_len=pos;
+	DEBUGP("%u changes in %llu bytes of journal", 
+			waa___loaded.change_count, (t_ull)pos);
+
+	qsort(waa___loaded.changes, waa___loaded.change_count, 
+			sizeof(*waa___loaded.changes), waa___journal_cmp);
+
+	/* Keep only the last change per index, and get the number of entries. */
+	n=0;
+	for(j=0; j<waa___loaded.change_count; j++)
+	{
+		entry=waa___loaded.changes[j];
+		if (j+1 < waa___loaded.change_count &&
+				waa___loaded.changes[j+1]->index == entry->index)
+			continue;
+
+		if (entry->index <= waa___loaded.count)
+		{
+			if (entry->op == WAA_JOURNAL_REMOVE) (*count)--;
+		}
+		else if (entry->op != WAA_JOURNAL_REMOVE)
+			(*count)++;
+
+		if (entry->index > waa___loaded.max_index)
+			waa___loaded.max_index=entry->index;
+		waa___loaded.changes[n++]=entry;
+	}
+	waa___loaded.change_count=n;
+
+	/* The names are used in place. */
+	map=NULL;
+
+ex:
+	if (map) munmap(map, length);
+	return status;
+}
+
+
+/** Returns the currently stored data for \a index, or \c NULL in \a rec 
+ * if there's none. */
+static void waa___loaded_record(unsigned index, 
+		struct waa__dir_record_t **rec, char **name)
+{
+	struct waa__journal_entry_t key, *kp, **found;
+
+
+	*rec=NULL;
+	kp=&key;
+	key.index=index;
+	found= waa___loaded.change_count ?
+		bsearch(&kp, waa___loaded.changes, waa___loaded.change_count,
+				sizeof(*waa___loaded.changes), waa___journal_cmp_index) :
+		NULL;
+	if (found)
+	{
+		if ((*found)->op == WAA_JOURNAL_REMOVE) return;
+		*rec=&(*found)->rec;
+		*name=(char*)(*found+1);
+	}
+	else if (index && index <= waa___loaded.count &&
+			waa___loaded.records[index-1].name_offset < waa___loaded.names_len)
+	{
+		*rec=waa___loaded.records + index-1;
+		*name=waa___loaded.names + (*rec)->name_offset;
+	}
+}
+
+
+/** \name Journal output buffer.
+ * @{ */
+static char *waa___journal;
+static size_t waa___journal_used, waa___journal_alloc, waa___journal_max;
+static unsigned waa___journal_count, waa___journal_next;
+static unsigned char *waa___journal_seen;
+/** @} */
+
+/** Appends a single change to the journal buffer.
+ * If the journal would get too big, nothing more is stored; the caller 
+ * has to check \c waa___journal_used. */
+static int waa___journal_add(int op, unsigned index,
+		struct waa__dir_record_t *rec, const char *name)
+{
+	int status;
+	unsigned name_len;
+	size_t len;
+	struct waa__journal_entry_t *entry;
+
+
+	status=0;
+	name_len= name ? strlen(name)+1 : 0;
+	len=WAA_JOURNAL_ENTRY_SIZE(name_len);
+	if (waa___journal_used + len > waa___journal_max)
+	{
+		waa___journal_used=waa___journal_max+1;
+		goto ex;
+	}
+
+	if (waa___journal_used + len > waa___journal_alloc)
+	{
+		waa___journal_alloc = (waa___journal_used + len) * 2;
+		STOPIF( hlp__realloc( &waa___journal, waa___journal_alloc), NULL);
+	}
+
+	entry=(struct waa__journal_entry_t*)(waa___journal + waa___journal_used);
+	memset(entry, 0, len);
+	entry->op=op;
+	entry->index=index;
+	entry->name_len=name_len;
+	if (rec) entry->rec=*rec;
+	if (name) memcpy(entry+1, name, name_len);
+
+	waa___journal_used += len;
+	waa___journal_count++;
+
+ex:
+	return status;
+}
+
+
+/** Puts \a sts and its children into the journal buffer, if they differ 
+ * from the loaded data.
+ *
+ * Entries that are new (or whose index can't be used anymore) get a new 
+ * index; as the parents have to be loaded first, an entry below a parent 
+ * with a higher index has to be moved, too. */
+static int waa___journal_entry(struct estat *sts)
+{
+	int status;
+	unsigned index, parent_index;
+	struct waa__dir_record_t rec, *old, cmp;
+	char *old_name;
+	struct estat **list;
+
+
+	parent_index= sts->parent ? sts->parent->waa_index : 0;
+	index=sts->waa_index;
+	old=NULL;
+	if (index && index <= waa___loaded.max_index && index > parent_index &&
+			!(waa___journal_seen[index/8] & (1 << (index % 8))))
+		waa___loaded_record(index, &old, &old_name);
+
+	if (old)
+		waa___journal_seen[index/8] |= 1 << (index % 8);
+	else
+		sts->waa_index=index=waa___journal_next++;
+
+	STOPIF( ops__save_1record(sts, parent_index, 0, &rec), NULL);
+
+	if (old)
+	{
+		cmp=*old;
+		cmp.name_offset=0;
+		if (memcmp(&cmp, &rec, sizeof(rec)) == 0 &&
+				strcmp(old_name, sts->name) == 0)
+			goto children;
+	}
+
+	STOPIF( waa___journal_add(old ? WAA_JOURNAL_CHANGE : WAA_JOURNAL_ADD,
+				index, &rec, sts->name), NULL);
+
+children:
+	if (ops__has_children(sts))
+	{
+		for(list=sts->by_inode; *list; list++)
+			if (ops__should_entry_be_written_in_list(*list))
+				STOPIF( waa___journal_entry(*list), NULL);
+	}
+
+ex:
+	return status;
+}
+
+
+/** Removes the \ref dirlog "journal", after a new \ref dir file has been 
+ * written. */
+static int waa___journal_remove(void)
+{
+	int status;
+	char *wd;
+
+
+	wd=NULL;
+	waa___loaded.records=NULL;
+	STOPIF( waa__given_or_current_wd(NULL, &wd), NULL );
+	STOPIF( waa__delete_byext(wd, WAA__DIR_JOURNAL_EXT, 1), NULL);
+
+ex:
+	IF_FREE(wd);
+	return status;
+}
+
+
+/** Tries to write only the changes to \a root into the \ref dirlog 
+ * "journal".
+ *
+ * Returns with \a done \c ==0 if the full \ref dir file has to be 
+ * written: there's no binary data loaded, or the journal would get too 
+ * big. */
+static int waa___journal_output(struct estat *root, int *done)
+{
+	int status, fh, i;
+	unsigned index, start;
+	struct waa__dir_record_t *old;
+	char *name;
+	struct waa__journal_head_t *head;
+	struct waa__journal_batch_t *batch;
+	struct hlp__checksum_t sum;
+
+
+	*done=0;
+	fh=-1;
+	waa___journal_seen=NULL;
+	status=0;
+
+	if (!waa___loaded.records || 
+			opt__get_int(OPT__DIR_FORMAT) != DIR_FORMAT_BINARY ||
+			opt__get_int(OPT__DIR_JOURNAL) <= 0 ||
+			root->waa_index != 1)
+		goto ex;
+
+	/* Leave space for the headers. */
+	start= waa___loaded.journal_len ? 0 : sizeof(*head);
+	waa___journal_used=start + sizeof(*batch);
+	waa___journal_max=(size_t)waa___loaded.st.size * 
+		opt__get_int(OPT__DIR_JOURNAL) / 100;
+	if (waa___loaded.journal_len >= waa___journal_max) goto ex;
+	waa___journal_max -= waa___loaded.journal_len;
+	if (waa___journal_used > waa___journal_max) goto ex;
+
+	waa___journal_count=0;
+	waa___journal_next=waa___loaded.max_index+1;
+	if (waa___journal_alloc < waa___journal_used)
+	{
+		waa___journal_alloc=waa___journal_used*16;
+		STOPIF( hlp__realloc( &waa___journal, waa___journal_alloc), NULL);
+	}
+	STOPIF( hlp__calloc( &waa___journal_seen, 
+				waa___loaded.max_index/8+1, 1), NULL);
 
-	return bigger_eq;
+	STOPIF( waa___journal_entry(root), NULL);
+
+	/* All loaded entries that weren't seen are removed. */
+	for(index=1; index <= waa___loaded.max_index; index++)
+	{
+		if (waa___journal_seen[index/8] & (1 << (index % 8))) continue;
+
+		waa___loaded_record(index, &old, &name);
+		if (old)
+			STOPIF( waa___journal_add(WAA_JOURNAL_REMOVE, index, NULL, NULL), 
+					NULL);
+	}
+
+	if (waa___journal_used > waa___journal_max) 
+	{
+		DEBUGP("journal would get too big");
+		goto ex;
+	}
+
+	*done=1;
+	DEBUGP("%u changes for the journal", waa___journal_count);
+	if (!waa___journal_count) goto ex;
+
+	if (start)
+	{
+		head=(struct waa__journal_head_t*)waa___journal;
+		memset(head, 0, sizeof(*head));
+		head->magic=WAA_JOURNAL_MAGIC;
+		head->byte_order=WAA_BYTE_ORDER;
+		head->version=WAA_VERSION_BINARY;
+		head->record_size=sizeof(struct waa__journal_entry_t);
+		head->base_ino=waa___loaded.st.ino;
+		head->base_size=waa___loaded.st.size;
+		head->base_mtime=waa___loaded.st.mtim.tv_sec;
+		head->base_mtime_nsec=waa___loaded.st.mtim.tv_nsec;
+	}
+
+	batch=(struct waa__journal_batch_t*)(waa___journal+start);
+	batch->magic=WAA_JOURNAL_BATCH;
+	batch->count=waa___journal_count;
+	batch->length=waa___journal_used - start - sizeof(*batch);
+	memset(&sum, 0, sizeof(sum));
+	hlp__checksum(&sum, batch+1, batch->length);
+	batch->sum_a=sum.a;
+	batch->sum_b=sum.b;
+
+	/* A stale journal or a damaged batch at the end are cut off; the new 
+	 * batch is written with a single call, so that it's either completely 
+	 * there or detected as incomplete. */
+	STOPIF( waa__open_byext(NULL, WAA__DIR_JOURNAL_EXT, 
+				O_WRONLY | O_CREAT | O_APPEND, &fh), NULL);
+	STOPIF_CODE_ERR( ftruncate(fh, waa___loaded.journal_len) == -1, errno,
+			"Cannot truncate the journal");
+	i=write(fh, waa___journal, waa___journal_used);
+	STOPIF_CODE_ERR( i != waa___journal_used, errno, 
+			"Cannot append to the journal");
+	i=close(fh);
+	fh=-1;
+	STOPIF_CODE_ERR( i == -1, errno, "Cannot close the journal");
+
+	/* The loaded data doesn't match anymore. */
+	waa___loaded.records=NULL;
+
+ex:
+	if (fh != -1) close(fh);
+	IF_FREE(waa___journal_seen);
+	return status;
 }
 
 
@@ -1103,6 +1775,19 @@ int waa___find_position(struct estat **new,
  * The other lines have space-delimited fields, and a \\0 delimited name 
  * at the end, followed by a newline.
  *
+ * In the binary format (\c WAA_VERSION_BINARY) the header is followed by 
+ * an array of struct \ref waa__dir_record_t, the directory index, and then 
+ * by the names, each terminated by a \c \\0. The records reference their 
+ * names by offset, so that waa__input_tree() can use them in place; the 
+ * index lets waa__input_subtrees() find the children of a directory.
+ *
+ * <h3>Journal</h3>
+ * If a binary file was loaded, the entries are first compared against the 
+ * loaded data; if only a few have changed, these are appended to the \ref 
+ * dirlog "journal" instead (see \ref o_dir_journal), keyed by the index 
+ * of the entry in the file. waa__input_tree() applies these changes.
+ * When the full file gets written, the journal is removed.
+ *
  * <h3>Order of entries in the file</h3>
  * We always write parents before children, and (mostly) lower inode numbers 
  * before higher; mixing the subdirectories is allowed.
@@ -1188,27 +1873,43 @@ int waa___find_position(struct estat **new,
  * That means that as long as we allocate the memory block in a single
  * continuous block, we don't have to search any more; we can just reconstruct
  * the pointers to the parent. 
- * We keep the directory-array sorted; so we have to insert a new directory
- * at the correct position, but can otherwise output very fast. 
- * So for the array
- *   [10 20 30 40 50 60 70]
- * the element 10 is written; the next one, say 35, is inserted at the
- * correct position:
- *   [20 30 35 40 50 60 70]
- * Again the first (smallest) element is written, and so on.
+ * The directory-array is kept as a binary heap (by the inode the cursors 
+ * point to), so the smallest entry is always at \c directory[0]. After 
+ * writing it the cursor gets advanced, and moved down the heap; new 
+ * directories are appended and moved up. So each entry costs only 
+ * <tt>O(log(directories))</tt>, even for wide trees with thousands of 
+ * directories in progress.
  */ 
 int waa__output_tree(struct estat *root)
 {
-	struct estat ***directory, *sts, **sts_pp;
+	struct estat ***directory, *sts;
 	int max_dir, i, alloc_dir;
 	unsigned this_len;
 	int status, waa_info_hdl;
 	unsigned complete_count, string_space;
 	char header[HEADER_LEN] = "UNFINISHED";
+	int binary;
+	struct waa__dir_trailer_t trailer;
+	unsigned index_count;
 
 
 	waa_info_hdl=-1;
 	directory=NULL;
+	waa___names_len=0;
+	waa___parents_count=0;
+	waa___out_used=0;
+	memset(&waa___out_sum, 0, sizeof(waa___out_sum));
+	binary= opt__get_int(OPT__DIR_FORMAT) == DIR_FORMAT_BINARY;
+
+	BUG_ON(waa___lazy.stubs, "Partially loaded tree can't be written");
+
+	/* The root entry is visible above all URLs. */
+	root->url=NULL;
+
+	/* If there are only a few changes, they're just appended. */
+	STOPIF( waa___journal_output(root, &i), NULL);
+	if (i) goto ex;
+
 	STOPIF( waa__open_dir(NULL, WAA__WRITE, &waa_info_hdl), NULL);
 
 	/* allocate space for later use - entry count and similar. */
@@ -1225,10 +1926,7 @@ int waa__output_tree(struct estat *root)
 	STOPIF( hlp__calloc( &directory, alloc_dir+1, sizeof(*directory)), NULL);
 
 
-	/* The root entry is visible above all URLs. */
-	root->url=NULL;
-
-	STOPIF( ops__save_1entry(root, 0, waa_info_hdl), NULL);
+	STOPIF( waa___output_1entry(root, 0, waa_info_hdl, binary), NULL);
 	root->file_index=complete_count=1;
 
 
@@ -1266,45 +1964,25 @@ int waa__output_tree(struct estat *root)
 		/* end of this directory ?*/
 		if (*directory[0] == NULL)
 		{
-			/* remove this directory by shifting the list */
+			/* remove this directory by putting the last one at the top */
 			max_dir--;
 			DEBUGP("finished subdir");
-			memmove(directory, directory+1, sizeof(*directory)*max_dir);
-		}
-		else if (max_dir>1)
-		{
-			/* check if it stays or gets moved.
-			 * ignore element 0, as this is the new one. */
-			i=waa___find_position(directory[0], directory+1, max_dir-1);
-			if (i)
-			{
-				/* order is wrong - move elements.
-				 * Mind that returned index is one element further in directory[]! 
-				 * 
-				 * [ 55 20 30 40 50 60 ] max_dir=6, i=4
-				 * new^ ^0          ^4
-				 *
-				 * [ 20 30 40 50 55 60 ]
-				 * */
-				sts_pp=directory[0];
-				memmove(directory, directory+1, sizeof(*directory)*i);
-				directory[i]=sts_pp;
-				DEBUGP("old current moves to #%u: %llu < %llu",
-						i, 
-						(t_ull)(*directory[i-1])->st.ino, 
-						(t_ull)(*directory[i  ])->st.ino);
-			}
+			directory[0]=directory[max_dir];
 		}
 
+		/* check if it stays or gets moved. */
+		if (max_dir>1)
+			waa___heap_down(directory, max_dir, 0);
+
 		/* If this takes too much performance, we might have to duplicate that 
-		 * check before the waa___find_position() call above. */
+		 * check before the waa___heap_down() call above. */
 		if (!ops__should_entry_be_written_in_list(sts))
 			continue;
 
 
 		// do current entry
-		STOPIF( ops__save_1entry(sts, sts->parent->file_index, waa_info_hdl), 
-				NULL);
+		STOPIF( waa___output_1entry(sts, sts->parent->file_index, 
+					waa_info_hdl, binary), NULL);
 
 		complete_count++;
 		/* store position number for child -> parent relationship */
@@ -1344,43 +2022,62 @@ int waa__output_tree(struct estat *root)
 				STOPIF( dir__sortbyinode(sts), NULL);
 
 
-			/* sort into array */
-			i=waa___find_position(sts->by_inode, directory, max_dir);
-
-			/* this time we have to shift all bigger elements one further:
-			 *   new=45, max_dir=7,
-			 *   [10 20 30 40 50 60 70]
-			 *                i=4  
-			 * results in
-			 *   [10 20 30 40 45 50 60 70] */
-			memmove(directory+i+1, directory+i, 
-					sizeof(*directory)*(max_dir-i));
-
-			directory[i]=sts->by_inode;
-			DEBUGP("new subdir %llu #%u", (t_ull)(*directory[i])->st.ino, i);
+			/* put into heap */
+			directory[max_dir]=sts->by_inode;
+			DEBUGP("new subdir %llu", (t_ull)(*directory[max_dir])->st.ino);
+			waa___heap_up(directory, max_dir);
 			max_dir++;
 		}
 
 #ifdef DEBUG
 		for(i=1; i<max_dir; i++)
 			BUG_ON(
-					dir___f_sort_by_inode( directory[i-1], directory[i] ) >0);
+					dir___f_sort_by_inode( directory[(i-1)/2], directory[i] ) >0);
 #endif
 	}
 
 
 save_header:
+	if (binary)
+	{
+		STOPIF( waa___output_index(waa_info_hdl, &index_count), NULL);
+		STOPIF( waa___out_write(waa_info_hdl, waa___names, waa___names_len), 
+				NULL);
+	}
+	STOPIF( waa___out_flush(waa_info_hdl), NULL);
+
 	/* save header information */
 	/* path_len needs a terminating \0, so add a few bytes. */
-	status=snprintf(header, sizeof(header), waa__header_line,
-			WAA_VERSION, (t_ul)sizeof(header),
-			complete_count, alloc_dir, string_space+4,
-			max_path_len+4);
+	if (binary)
+		status=snprintf(header, sizeof(header), waa__header_line_bin,
+				WAA_VERSION_BINARY, (t_ul)sizeof(header),
+				complete_count, alloc_dir, string_space+4,
+				max_path_len+4, 
+				(unsigned)sizeof(struct waa__dir_record_t), WAA_BYTE_ORDER,
+				index_count);
+	else
+		status=snprintf(header, sizeof(header), waa__header_line,
+				WAA_VERSION_TEXT, (t_ul)sizeof(header),
+				complete_count, alloc_dir, string_space+4,
+				max_path_len+4);
 	BUG_ON(status >= sizeof(header)-1, "header space not large enough");
 
 	/* keep \n at end */
 	memset(header + status, ' ', sizeof(header)-1 -status);
 	header[sizeof(header)-2]='$';
+
+	/* The binary format gets a checksum over everything. */
+	if (binary)
+	{
+		hlp__checksum(&waa___out_sum, header, sizeof(header));
+		trailer.magic=WAA_TRAILER_MAGIC;
+		trailer.sum_a=waa___out_sum.a;
+		trailer.sum_b=waa___out_sum.b;
+		status=write(waa_info_hdl, &trailer, sizeof(trailer));
+		STOPIF_CODE_ERR( status != sizeof(trailer), errno,
+				"writing the checksum failed");
+	}
+
 	STOPIF_CODE_ERR( lseek(waa_info_hdl, 0, SEEK_SET) == -1, errno,
 			"seeking to start of file");
 	status=write(waa_info_hdl, header, sizeof(header));
@@ -1395,9 +2092,18 @@ ex:
 		i=waa__close(waa_info_hdl, status);
 		waa_info_hdl=-1;
 		STOPIF( i, "closing tree handle");
+
+		/* The journal belonged to the old file. */
+		if (!status)
+			STOPIF( waa___journal_remove(), NULL);
 	}
 
 	if (directory) IF_FREE(directory);
+	IF_FREE(waa___names);
+	waa___names_alloc=0;
+	IF_FREE(waa___parents);
+	waa___parents_alloc=0;
+	IF_FREE(waa___out);
 
 	return status;
 }
@@ -1405,6 +2111,8 @@ ex:
 
 static struct estat *old;
 static struct estat current;
+/** The handle of the directory in \c current. */
+static int current_fd;
 static int nr_new;
 /** Compares the directories.
  * Every element found in old will be dropped from current;
@@ -1426,6 +2134,11 @@ static int nr_new;
  *   by_name    NULL   b   c   NULL   e   NULL   g   h   NULL
  * with nr_new=3.
  *
+ * As dir__enumerator() is given \c old, the known names (\c b, \c c, \c 
+ * e, \c g, and \c h) are skipped there already; so \c current normally 
+ * only has \c A, \c D, and \c F, and the other entries are neither 
+ * stat()ed nor allocated a second time.
+ *
  * */
 int new_entry(struct estat *sts, struct estat **sts_p)
 {
@@ -1460,15 +2173,7 @@ int new_entry(struct estat *sts, struct estat **sts_p)
 		if (S_ISDIR(sts->st.mode) && 
 				ops__are_children_interesting(sts) &&
 				(opt__get_int(OPT__FILTER) & FS_NEW))
-		{
-			STOPIF_CODE_ERR( chdir(sts->name) == -1, errno,
-					"chdir(%s)", sts->name);
-
-			STOPIF( waa__build_tree(sts), NULL);
-
-			STOPIF_CODE_ERR( chdir("..") == -1, errno,
-					"parent went away");
-		}
+			STOPIF( waa___build_subtree(sts, current_fd), NULL);
 
 	}
 
@@ -1487,18 +2192,18 @@ ex:
  * The estat::do_this_entry and estat::do_userselected flags are set, and 
  * depending on them (and opt_recursive) estat::entry_status is set.
  *
- * On \c chdir() an eventual \c EACCES is ignored, and the "maybe changed" 
+ * On \c open() an eventual \c EACCES is ignored, and the "maybe changed" 
  * status returned. */
 int waa__update_dir(struct estat *_old)
 {
-	int dir_hdl, status;
-	int i;
+	int status;
+	int i, cached_fd;
 	char *path;
 
 
 	old = _old;
 	status=nr_new=0;
-	dir_hdl=-1;
+	current_fd=-1;
 
 	current=*old;
 	current.by_inode=current.by_name=NULL;
@@ -1506,21 +2211,24 @@ int waa__update_dir(struct estat *_old)
 
 	STOPIF( ops__build_path(&path, old), NULL);
 
-	/* To avoid storing arbitrarily long pathnames, we just open this
-	 * directory and do a fchdir() later. */
-	dir_hdl=open(".", O_RDONLY | O_DIRECTORY);
-	STOPIF_CODE_ERR( dir_hdl==-1, errno, 
-			"saving current directory with open(.)");
-
-	DEBUGP("update_dir: chdir(%s)", path);
-	if (chdir(path) == -1)
+	/* The working directory isn't changed; everything below is done 
+	 * relative to this handle. If possible we get it via the cached handle 
+	 * of this directory, to avoid a lookup of the whole path. */
+	DEBUGP("update_dir: open(%s)", path);
+	if (ops__dir_fd(old, &cached_fd) == 0)
+		current_fd=openat(cached_fd, ".", O_RDONLY | O_DIRECTORY);
+	if (current_fd == -1)
+		current_fd=open(path, O_RDONLY | O_DIRECTORY);
+	if (current_fd == -1)
 	{
 		if (errno == EACCES) goto ex;
-		STOPIF( errno, "chdir(%s)", path);
+		STOPIF( errno, "open(%s)", path);
 	}
 
-	/* Here we need the entries sorted by name. */
-	STOPIF( waa__dir_enum( &current, 0, 1), NULL);
+	/* Here we need the entries sorted by name. The known entries have 
+	 * already been stat()ed by waa__update_tree(), so we only get the new 
+	 * names. */
+	STOPIF( waa__dir_enum( &current, current_fd, 0, 1, old), NULL);
 	DEBUGP("update_dir: direnum found %d; old has %d (%d)", 
 			current.entry_count, old->entry_count,
 			status);
@@ -1568,12 +2276,10 @@ after_compare:
 		ops__mark_changed_parentcc(old, entry_status);
 
 ex:
-	if (dir_hdl!=-1) 
+	if (current_fd!=-1) 
 	{
-		i=fchdir(dir_hdl);
-		STOPIF_CODE_ERR(i == -1 && !status, errno,
-				"cannot fchdir() back");
-		i=close(dir_hdl);
+		i=close(current_fd);
+		current_fd=-1;
 		STOPIF_CODE_ERR(i == -1 && !status, errno,
 				"cannot close dirhandle");
 	}
@@ -1596,13 +2302,268 @@ ex:
 			__VA_ARGS__);
 
 
-/** -.
+/** Compares two \c wanted values. */
+static int waa___lazy_cmp(const void *a, const void *b)
+{
+	uint32_t va=*(uint32_t*)a, vb=*(uint32_t*)b;
+
+	return va < vb ? -1 : (va > vb);
+}
+
+
+/** Compares the record numbers of two index entries. */
+static int waa___index_cmp(const void *a, const void *b)
+{
+	const struct waa__dir_index_t *ia=a, *ib=b;
+
+	return ia->record < ib->record ? -1 : (ia->record > ib->record);
+}
+
+
+/** Returns the children of record \a index, from the directory index.  */
+static int waa___index_children(unsigned index, 
+		uint32_t **children, unsigned *count)
+{
+	int status;
+	struct waa__dir_index_t key, *found;
+	unsigned end;
+
+
+	status=0;
+	*count=0;
+	key.record=index;
+	found=bsearch(&key, waa___loaded.index, waa___loaded.index_count,
+			sizeof(key), waa___index_cmp);
+	if (!found) goto ex;
+
+	end= found+1 < waa___loaded.index+waa___loaded.index_count ?
+		found[1].first : waa___loaded.count-1;
+	TREE_DAMAGED( found->first >= end || end > waa___loaded.count-1,
+			"the directory index is invalid");
+
+	*children=waa___loaded.children + found->first;
+	*count=end - found->first;
+
+ex:
+	return status;
+}
+
+
+/** Puts record \a index on the list to load. */
+static int waa___lazy_add(unsigned index, int stub)
+{
+	int status;
+
+
+	status=0;
+	TREE_DAMAGED( !index || index > waa___loaded.count,
+			"the directory index is invalid");
+
+	if (waa___lazy.count >= waa___lazy.alloc)
+	{
+		waa___lazy.alloc = waa___lazy.alloc*2 + 256;
+		STOPIF( hlp__realloc( &waa___lazy.wanted, 
+					waa___lazy.alloc * sizeof(*waa___lazy.wanted)), NULL);
+	}
+	waa___lazy.wanted[waa___lazy.count++] = (index << 1) | (stub ? 1 : 0);
+
+ex:
+	return status;
+}
+
+
+/** Puts record \a index and everything below on the list to load. */
+static int waa___lazy_subtree(unsigned index)
+{
+	int status;
+	uint32_t *children;
+	unsigned i, count;
+
+
+	STOPIF( waa___lazy_add(index, 0), NULL);
+	STOPIF( waa___index_children(index, &children, &count), NULL);
+	for(i=0; i<count; i++)
+	{
+		TREE_DAMAGED( children[i] <= index, "the directory index is invalid");
+		STOPIF( waa___lazy_subtree(children[i]), NULL);
+	}
+
+ex:
+	return status;
+}
+
+
+/** Puts the records needed for the \a argc paths in \a normalized on the 
+ * list to load.
+ *
+ * For each path the directories above are loaded with all their direct 
+ * children, so that the tree looks complete for them; the other 
+ * subdirectories there are left as stubs without children. Everything 
+ * below the path itself is loaded.
+ *
+ * If a path is not (completely) known, the deepest known directory is 
+ * loaded, so that ops__traverse() can add the new entries.
+ *
+ * Returns with \c waa___lazy.wanted \c ==NULL if a path can't be 
+ * handled; then the whole tree has to be read. */
+static int waa___lazy_select(int argc, char *normalized[])
+{
+	int status, i;
+	unsigned index, n, count, len;
+	uint32_t *children;
+	struct waa__dir_record_t *rec;
+	const char *path, *next;
+
+
+	status=0;
+	waa___lazy.count=waa___lazy.pos=waa___lazy.stubs=0;
+	for(i=0; i<argc; i++)
+	{
+		index=1;
+		path=normalized[i];
+		DEBUGP("selecting %s", path);
+
+		while (1)
+		{
+			while (*path == PATH_SEPARATOR) path++;
+			if (!*path) 
+			{
+				/* Found - take all. For the root that's simpler done 
+				 * directly. */
+				if (index == 1) goto give_up;
+				STOPIF( waa___lazy_subtree(index), NULL);
+				break;
+			}
+
+			next=strchr(path, PATH_SEPARATOR);
+			len= next ? next-path : strlen(path);
+			if (len == 1 && path[0] == '.')
+			{
+				path+=len;
+				continue;
+			}
+			if (len == 2 && path[0] == '.' && path[1] == '.')
+				goto give_up;
+
+			/* This one is needed completely. */
+			STOPIF( waa___lazy_add(index, 0), NULL);
+			STOPIF( waa___index_children(index, &children, &count), NULL);
+
+			index=0;
+			for(n=0; n<count; n++)
+			{
+				TREE_DAMAGED( !children[n] || children[n] > waa___loaded.count,
+						"the directory index is invalid");
+				rec=waa___loaded.records + children[n]-1;
+				TREE_DAMAGED( rec->name_offset >= waa___loaded.names_len,
+						"a name is out of range");
+
+				STOPIF( waa___lazy_add(children[n], 
+							S_ISDIR(rec->mode) && rec->entry_count), NULL);
+				if (!index && 
+						strncmp(waa___loaded.names + rec->name_offset, path, len) == 0 &&
+						waa___loaded.names[rec->name_offset + len] == '\0')
+					index=children[n];
+			}
+
+			/* Not known - everything needed is there. */
+			if (!index) break;
+			path+=len;
+		}
+	}
+
+	if (!waa___lazy.count) goto ex;
+
+	/* The entries must be read in the order of the file; if something is 
+	 * wanted both completely and as stub, the former wins. */
+	qsort(waa___lazy.wanted, waa___lazy.count, 
+			sizeof(*waa___lazy.wanted), waa___lazy_cmp);
+	for(n=count=0; n<waa___lazy.count; n++)
+	{
+		if (count && 
+				(waa___lazy.wanted[count-1] >> 1) == (waa___lazy.wanted[n] >> 1))
+			continue;
+		waa___lazy.wanted[count++]=waa___lazy.wanted[n];
+		if (waa___lazy.wanted[n] & 1) waa___lazy.stubs++;
+	}
+	waa___lazy.count=count;
+	DEBUGP("loading %u of %u entries, %u stubs",
+			count, waa___loaded.count, waa___lazy.stubs);
+	goto ex;
+
+give_up:
+	IF_FREE(waa___lazy.wanted);
+	waa___lazy.alloc=waa___lazy.count=waa___lazy.stubs=0;
+
+ex:
+	return status;
+}
+
+
+/** Returns the next entry of the binary \ref dir file in \a rec and \a 
+ * name, with the changes from the \ref dirlog "journal" applied.
+ *
+ * \a index is the last returned index, \a change the position in \c 
+ * waa___loaded.changes; \a from_journal tells whether the data came from 
+ * the journal. */
+static int waa___next_record(unsigned *index, unsigned *change,
+		struct waa__dir_record_t **rec, char **name, int *from_journal)
+{
+	int status;
+	struct waa__journal_entry_t *entry;
+
+
+	status=0;
+	while (1)
+	{
+		if (waa___lazy.wanted)
+		{
+			BUG_ON(waa___lazy.pos >= waa___lazy.count);
+			*index=waa___lazy.wanted[ waa___lazy.pos++ ] >> 1;
+		}
+		else
+			(*index)++;
+		BUG_ON(*index > waa___loaded.max_index);
+
+		if (*change < waa___loaded.change_count &&
+				waa___loaded.changes[*change]->index == *index)
+		{
+			entry=waa___loaded.changes[ (*change)++ ];
+			if (entry->op == WAA_JOURNAL_REMOVE) continue;
+
+			*rec=&entry->rec;
+			*name=(char*)(entry+1);
+			*from_journal=1;
+			break;
+		}
+
+		/* Indizes between the ones in the file and the added ones are 
+		 * possible, if added entries got removed again. */
+		if (*index > waa___loaded.count) continue;
+
+		*rec=waa___loaded.records + *index-1;
+		TREE_DAMAGED( (*rec)->name_offset >= waa___loaded.names_len,
+				"a name is out of range");
+		*name=waa___loaded.names + (*rec)->name_offset;
+		*from_journal=0;
+		break;
+	}
+
+ex:
+	return status;
+}
+
+
+/** Reads the \ref dir file; if \a normalized is not \c NULL, only the 
+ * parts needed for these \a argc paths (if possible).
+ *
  * This may silently return -ENOENT, if the waa__open fails.
  *
  * The \a callback is called for \b every entry read; but for performance 
  * reasons the \c path parameter will be \c NULL.
  * */
-int waa__input_tree(struct estat *root,
+static int waa___input_tree(struct estat *root,
+		int argc, char *normalized[],
 		struct waa__entry_blocks_t **blocks,
 		action_t *callback)
 {
@@ -1622,6 +2583,13 @@ int waa__input_tree(struct estat *root,
 	off_t length;
 	t_ul header_len;
 	struct estat *sts_tmp;
+	struct waa__dir_record_t *record;
+	unsigned record_size, byte_order, index_count;
+	unsigned index, change, *remap, resort_count;
+	int binary, from_journal;
+	struct estat **resort;
+	struct waa__dir_trailer_t trailer;
+	struct hlp__checksum_t sum;
 
 
 	waa__entry_block.first=root;
@@ -1630,6 +2598,14 @@ int waa__input_tree(struct estat *root,
 
 	length=0;
 	dir_mmap=NULL;
+	binary=0;
+	remap=NULL;
+	resort=NULL;
+	resort_count=0;
+	IF_FREE(waa___loaded.changes);
+	memset(&waa___loaded, 0, sizeof(waa___loaded));
+	IF_FREE(waa___lazy.wanted);
+	memset(&waa___lazy, 0, sizeof(waa___lazy));
 	status=waa__open_dir(NULL, WAA__READ, &waa_info_hdl);
 	if (status == ENOENT) 
 	{
@@ -1641,15 +2617,21 @@ int waa__input_tree(struct estat *root,
 	length=lseek(waa_info_hdl, 0, SEEK_END);
 	STOPIF_CODE_ERR( length == (off_t)-1, errno, 
 			"Cannot get length of .dir file");
+	/* To find out whether the journal belongs to this file. */
+	STOPIF( hlp__fstat(waa_info_hdl, &waa___loaded.st), NULL);
 
 	DEBUGP("mmap()ping %llu bytes", (t_ull)length);
+	/* A private, writable mapping, so that the names of the binary format 
+	 * can be used (and changed) in place; the file itself is never 
+	 * modified. */
 	dir_mmap=mmap(NULL, length,
-			PROT_READ, MAP_SHARED, 
+			PROT_READ | PROT_WRITE, MAP_PRIVATE, 
 			waa_info_hdl, 0);
 	/* If there's an error, return it.
 	 * Always close the file. Check close() return code afterwards. */
 	status=errno;
 	i=close(waa_info_hdl);
+	if (dir_mmap == MAP_FAILED) dir_mmap=NULL;
 	STOPIF_CODE_ERR( !dir_mmap, status, "mmap failed");
 	STOPIF_CODE_ERR( i, errno, "close() failed");
 
@@ -1664,20 +2646,22 @@ int waa__input_tree(struct estat *root,
 	 * mmap()ed read-only. */
 	memcpy(header, dir_mmap, HEADER_LEN-2);
 	header[HEADER_LEN-2]=0;
-	status=sscanf(header, waa__header_line,
+	/* The text format has only the first 6 fields. */
+	status=sscanf(header, waa__header_line_bin,
 			&i, &header_len,
 			&count, &subdirs, &string_space,
-			&max_path_len);
+			&max_path_len,
+			&record_size, &byte_order, &index_count);
 	DEBUGP("got %d header fields", status);
-	TREE_DAMAGED( status != 6,
+	TREE_DAMAGED( status < 6 || 
+			(i == WAA_VERSION_BINARY && status != 9),
 			"not all needed header fields could be parsed");
 	dir_curr=dir_mmap+HEADER_LEN;
 
-	TREE_DAMAGED( i != WAA_VERSION || header_len != HEADER_LEN, 
+	TREE_DAMAGED( (i != WAA_VERSION_TEXT && i != WAA_VERSION_BINARY) || 
+			header_len != HEADER_LEN, 
 			"the header has a wrong version");
 
-	/* For progress display */
-	approx_entry_count=count;
 
 	/* for new subdirectories allow for some more space.
 	 * Note that this is not clean - you may have to have more space
@@ -1689,30 +2673,98 @@ int waa__input_tree(struct estat *root,
 			subdirs, count, string_space);
 
 
-	/* Isn't there a snscanf() or something similar? I remember having seen
-	 * such a beast. There's always the chance of a damaged file, so 
-	 * I wouldn't depend on sscanf staying in its buffer.
-	 *
-	 * I now check for a \0\n at the end, so that I can be sure 
-	 * there'll be an end to sscanf. */
-	TREE_DAMAGED( dir_mmap[length-2] != '\0' || dir_mmap[length-1] != '\n',
-			"the file is not correctly terminated");
+	if (i == WAA_VERSION_BINARY)
+	{
+		TREE_DAMAGED( byte_order != WAA_BYTE_ORDER, 
+				"it was written on an architecture with another byte order");
+		TREE_DAMAGED( record_size != sizeof(*record),
+				"the record size is wrong");
+
+		/* Verify the whole file before believing any of its numbers; the 
+		 * header is summed last, as it is written last, too. */
+		TREE_DAMAGED( length < HEADER_LEN + sizeof(trailer),
+				"the checksum is missing");
+		dir_end -= sizeof(trailer);
+		memcpy(&trailer, dir_end, sizeof(trailer));
+		memset(&sum, 0, sizeof(sum));
+		hlp__checksum(&sum, dir_curr, dir_end - dir_curr);
+		hlp__checksum(&sum, dir_mmap, HEADER_LEN);
+		TREE_DAMAGED( trailer.magic != WAA_TRAILER_MAGIC ||
+				trailer.sum_a != sum.a || trailer.sum_b != sum.b,
+				"the checksum doesn't match");
+
+		TREE_DAMAGED( !count || (t_ull)(dir_end - dir_curr) < 
+				(t_ull)count * record_size + 
+				(t_ull)index_count * sizeof(struct waa__dir_index_t) +
+				(t_ull)(count-1) * sizeof(uint32_t),
+				"there are fewer records than announced");
+
+		/* The index and the names are behind the records; the last name 
+		 * must be terminated. */
+		binary=1;
+		waa___loaded.records=(struct waa__dir_record_t*)dir_curr;
+		waa___loaded.count=count;
+		waa___loaded.index=(struct waa__dir_index_t*)
+			(waa___loaded.records+count);
+		waa___loaded.index_count=index_count;
+		waa___loaded.children=(uint32_t*)
+			(waa___loaded.index+index_count);
+		waa___loaded.names=(char*)(waa___loaded.children+count-1);
+		waa___loaded.names_len=dir_end - waa___loaded.names;
+		TREE_DAMAGED( !waa___loaded.names_len || 
+				waa___loaded.names[waa___loaded.names_len-1] != '\0',
+				"the names are not correctly terminated");
+
+		/* The names are used in place, so there's nothing to free. */
+		root->strings=NULL;
+
+		STOPIF( waa___journal_load(&count), NULL);
+
+		/* The index describes only the file itself, not the journal. */
+		if (normalized && !waa___loaded.change_count)
+		{
+			STOPIF( waa___lazy_select(argc, normalized), NULL);
+			if (waa___lazy.wanted)
+				count=waa___lazy.count;
+		}
 
-	DEBUGP("ok, found \\0 or \\0\\n at end");
+		/* With a journal or a partial load the stored parent numbers have 
+		 * holes. */
+		if (waa___loaded.change_count || waa___lazy.wanted)
+			STOPIF( hlp__calloc( &remap, waa___loaded.max_index+1, 
+						sizeof(*remap)), NULL);
+	}
+	else
+	{
+		/* Isn't there a snscanf() or something similar? I remember having seen
+		 * such a beast. There's always the chance of a damaged file, so 
+		 * I wouldn't depend on sscanf staying in its buffer.
+		 *
+		 * I now check for a \0\n at the end, so that I can be sure 
+		 * there'll be an end to sscanf. */
+		TREE_DAMAGED( dir_mmap[length-2] != '\0' || dir_mmap[length-1] != '\n',
+				"the file is not correctly terminated");
 
-	STOPIF( hlp__alloc( &strings, string_space), NULL);
-	root->strings=strings;
+		DEBUGP("ok, found \\0 or \\0\\n at end");
+
+		STOPIF( hlp__alloc( &strings, string_space), NULL);
+		root->strings=strings;
+	}
+
+	/* For progress display */
+	approx_entry_count=count;
 
 	/* read inodes */
 	cur=0;
 	sts_free=1;
 	first=1;
+	index=change=0;
 	/* As long as there should be entries ... */
 	while ( count > 0)
 	{
 		DEBUGP("curr=%p, end=%p, count=%d",
 				dir_curr, dir_end, count);
-		TREE_DAMAGED( dir_curr>=dir_end, 
+		TREE_DAMAGED( !binary && dir_curr>=dir_end, 
 				"An entry line has a wrong number of entries");
 
 		if (sts_free == 0)
@@ -1730,8 +2782,33 @@ int waa__input_tree(struct estat *root,
 
 		sts=first ? root : stat_mem+cur;
 
-		DEBUGP("about to parse %p = '%-.40s...'", dir_curr, dir_curr);
-		STOPIF( ops__load_1entry(&dir_curr, sts, &filename, &parent), NULL);
+		if (binary)
+		{
+			STOPIF( waa___next_record(&index, &change, 
+						&record, &filename, &from_journal), NULL);
+			STOPIF( ops__load_1record(record, sts, &parent), NULL);
+
+			/* The children of a stub are not loaded. */
+			if (waa___lazy.wanted && 
+					(waa___lazy.wanted[waa___lazy.pos-1] & 1))
+				sts->entry_count=0;
+
+			/* Translate the stored index into the position here. */
+			if (remap)
+			{
+				TREE_DAMAGED( parent >= index, "the parent pointers are invalid");
+				parent=remap[parent];
+				remap[index]= first ? 1 : cur+2;
+			}
+		}
+		else
+		{
+			DEBUGP("about to parse %p = '%-.40s...'", dir_curr, dir_curr);
+			STOPIF( ops__load_1entry(&dir_curr, sts, &filename, &parent), NULL);
+			index++;
+			from_journal=0;
+		}
+		sts->waa_index=index;
 
 		/* Should this just be a BUG_ON? To not waste space in the release 
 		 * binary just for people messing with their dir-file?  */
@@ -1744,10 +2821,15 @@ int waa__input_tree(struct estat *root,
 		else cur++;
 
 		/* First - set all fields of this entry */
-		strcpy(strings, filename);
-		sts->name=strings;
-		strings += strlen(filename)+1;
-		BUG_ON(strings - root->strings > string_space);
+		if (binary)
+			sts->name=filename;
+		else
+		{
+			strcpy(strings, filename);
+			sts->name=strings;
+			strings += strlen(filename)+1;
+			BUG_ON(strings - root->strings > string_space);
+		}
 
 		if (parent)
 		{
@@ -1764,6 +2846,16 @@ int waa__input_tree(struct estat *root,
 			BUG_ON(sts->parent->child_index > sts->parent->entry_count,
 					"too many children for parent");
 
+			/* Entries from the journal are not in inode order. */
+			if (from_journal && !sts->parent->to_be_sorted)
+			{
+				if (!(resort_count % 64))
+					STOPIF( hlp__realloc( &resort, 
+								(resort_count+64) * sizeof(*resort)), NULL);
+				resort[resort_count++]=sts->parent;
+				sts->parent->to_be_sorted=1;
+			}
+
 			/* Check the revision */
 			if (sts->repos_rev != sts->parent->repos_rev)
 			{
@@ -1793,13 +2885,28 @@ int waa__input_tree(struct estat *root,
 			STOPIF( callback(sts), NULL);
 	} /* while (count)  read entries */
 
+	while (resort_count)
+	{
+		sts=resort[--resort_count];
+		TREE_DAMAGED( sts->child_index != sts->entry_count,
+				"the journal has a wrong number of entries");
+		STOPIF( dir__sortbyinode(sts), NULL);
+		sts->to_be_sorted=0;
+	}
+
 
 ex:
 	/* Return the first block even if we had eg. ENOENT */
 	if (blocks)
 		*blocks=&waa__entry_block;
 
-	if (dir_mmap)
+	IF_FREE(remap);
+	IF_FREE(resort);
+	IF_FREE(waa___lazy.wanted);
+	waa___lazy.alloc=0;
+
+	/* The names of the binary format are still in use. */
+	if (dir_mmap && !binary)
 	{
 		i=munmap(dir_mmap, length);
 		if (!status)
@@ -1810,6 +2917,32 @@ ex:
 }
 
 
+/** -. */
+int waa__input_tree(struct estat *root,
+		struct waa__entry_blocks_t **blocks,
+		action_t *callback)
+{
+	return waa___input_tree(root, 0, NULL, blocks, callback);
+}
+
+
+/** -.
+ *
+ * This is possible only for a binary \ref dir file without pending \ref 
+ * dirlog "journal" changes; else the whole tree is read.
+ *
+ * Directories that are not needed for the paths are loaded without their 
+ * children, so such a tree must not be written with waa__output_tree().
+ * */
+int waa__input_subtrees(struct estat *root,
+		int argc, char *normalized[],
+		struct waa__entry_blocks_t **blocks,
+		action_t *callback)
+{
+	return waa___input_tree(root, argc, normalized, blocks, callback);
+}
+
+
 /** Check whether the conditions for update and/or printing the directory
  * are fulfilled.
  *
@@ -1965,16 +3098,14 @@ ex:
  * decremented.
  *
  * <h3>Threading</h3>
- * We could use several threads, to get more that one \c lstat() to run at
- * once. I have done this and a patch available, but testing on linux/x86 on 
- * ext3 seems to readahead the inodes, so the wall time got no shorter.
+ * With \ref o_threads several \c lstat() calls run at once; see \ref 
+ * prefetch. Local filesystems like ext3 seem to readahead the inodes, so 
+ * the wall time gets no shorter there; but on NFS and similar it helps.
  *
- * If somebody wants to test with threads, I'll post the patch.
- *
- * For threading there has to be some synchronization - an entry can be done
- * only if its parent has been finished. That makes sense insofar, as when
- * some directory got deleted we don't need to \c lstat() the children - they
- * must be gone, too.
+ * The threads only fetch the meta-data; everything else is done here, in 
+ * the same order as without threads. That's needed, as an entry can be 
+ * done only if its parent has been finished - when some directory got 
+ * deleted we don't need to look at the children, they must be gone, too.
  *
  * <h3>KThreads</h3>
  * On LKML there was a discussion about making a list of syscalls, for 
@@ -2011,10 +3142,11 @@ ex:
 int waa__update_tree(struct estat *root,
 		struct waa__entry_blocks_t *cur_block)
 {
-	int status;
+	int status, i, full;
 	struct estat *sts;
 
 
+	full=0;
 	if (! (root->do_userselected || root->do_child_wanted) )
 	{
 		/* If neither is set, waa__partial_update() wasn't called, so
@@ -2024,11 +3156,19 @@ int waa__update_tree(struct estat *root,
 			root->do_filter_allows_done =
 			root->do_filter_allows = 1;
 		DEBUGP("Full tree update");
+		full=1;
 	}
 
 	/* TODO: allow non-remembering behaviour */
 	action->keep_children=1;
 
+	/* For a partial update we'd have to know which entries are wanted; 
+	 * they're only found by the tree walk. */
+	if (full && opt__get_int(OPT__HASH_ORDER) == HASH_ORDER_DISK)
+		STOPIF( pf__hash_in_disk_order(cur_block), NULL);
+
+	STOPIF( pf__start(cur_block), NULL);
+
 	status=0;
 	while (cur_block)
 	{
@@ -2173,6 +3313,11 @@ next:
 
 
 ex:
+	i=pf__stop();
+	if (!status)
+		STOPIF( i, "stopping the prefetch threads");
+	ops__dir_fd_flush();
+
 	return status;
 }
 
@@ -2187,6 +3332,9 @@ ex:
  *
  * The \a callback is called for \b every entry read by waa__input_tree(), 
  * not filtered like the normal actions.
+ *
+ * Read-only actions never write the tree, so for them only the parts 
+ * needed for the given paths are loaded; see waa__input_subtrees().
  */
 int waa__read_or_build_tree(struct estat *root, 
 		int argc, char *normalized[], char *orig[],
@@ -2195,10 +3343,17 @@ int waa__read_or_build_tree(struct estat *root,
 {
 	int status;
 	struct waa__entry_blocks_t *blocks;
+	int paths;
 
 
 	status=0;
-	status=waa__input_tree(root, &blocks, callback);
+	/* Like in waa__partial_update(): with no arguments the faked one is 
+	 * used. */
+	paths= argc ? argc : (*normalized ? 1 : 0);
+	if (action->is_readonly && !callback && paths)
+		status=waa__input_subtrees(root, paths, normalized, &blocks, NULL);
+	else
+		status=waa__input_tree(root, &blocks, callback);
 	DEBUGP("read tree = %d", status);
 
 	if (status == -ENOENT)
@@ -2541,6 +3696,7 @@ only_rel_path:
 			NULL);
 	setenv( FSVS_EXP_WC_CONF, confname, 1);
 	STOPIF( opt__load_settings(confname, "config", PRIO_ETC_WC ), NULL);
+	cs__throttle_signal();
 
 
 	/* If this command is not filtered, or an invalid filter is defined, 
@@ -2800,32 +3956,34 @@ ex:
 
 /** -.
  *
- * The cwd is the directory to be looked at.
+ * \a dir_fd is the directory to be looked at.
  *
  * IIRC the inode numbers may change on NFS; but having the WAA on NFS 
  * isn't a good idea, anyway.
  * */
 int waa__dir_enum(struct estat *this,
+		int dir_fd,
 		int est_count,
-		int by_name)
+		int by_name,
+		struct estat *known)
 {
 	int status;
-	struct sstat_t cwd_stat;
+	struct sstat_t dir_stat;
 
 
 	status=0;
-	STOPIF( hlp__lstat(".", &cwd_stat), NULL);
+	STOPIF( hlp__fstat(dir_fd, &dir_stat), NULL);
 
 	DEBUGP("checking: %llu to %llu",
-			(t_ull)cwd_stat.ino,
+			(t_ull)dir_stat.ino,
 			(t_ull)waa_stat.ino);
 	/* Is the parent the WAA? */
-	if (cwd_stat.dev == waa_stat.dev &&
-			cwd_stat.ino == waa_stat.ino)
+	if (dir_stat.dev == waa_stat.dev &&
+			dir_stat.ino == waa_stat.ino)
 		goto ex;
 
 	/* If not, get a list. */
-	STOPIF( dir__enumerator(this, est_count, by_name), NULL);
+	STOPIF( dir__enumerator(this, dir_fd, est_count, by_name, known), NULL);
 
 ex:
 	return status;
@@ -109,6 +109,13 @@ extern struct waa__entry_blocks_t waa__entry_block;
  * See also \a waa__output_tree().
  * */
 #define WAA__DIR_EXT		"dir"
+/** \anchor dirlog Journal of changes to the \ref dir file.
+ *
+ * Instead of rewriting the whole \ref dir file for a few changed entries, 
+ * the changed, added and removed records are appended here; see \ref 
+ * waa__output_tree(). It's only used together with a binary \ref dir 
+ * file, and is removed when that gets rewritten. */
+#define WAA__DIR_JOURNAL_EXT		"dirlog"
 /** \anchor ign List of groupings ("Identification Groups for New entries", 
  * formally "Ignore patterns").
  * They consist of a header with the number of patterns, followed by the 
@@ -146,8 +153,9 @@ extern struct waa__entry_blocks_t waa__entry_block;
  * This way big files don't have to be hashed in full to check whether 
  * they've changed; and the manber blocks can be used for the delta algorithm.
  *
- * Maybe the parameters for manber hashing should be stored there, too - 
- * currently they're hardcoded.
+ * The binary format (see struct \ref cs__md5s_head_t) stores the 
+ * parameters for manber hashing, too; the text format has only the 
+ * blocks, so these have to stay hardcoded.
  *
  * Furthermore in the WAA directory of the working copy we store a 
  * (temporary) file as an index for all entries' MD5 checksums. */
@@ -158,6 +166,10 @@ extern struct waa__entry_blocks_t waa__entry_block;
 /** \anchor cflct List of other conflict files.
  * Defined as <tt>filename\\0\\nfilename\\0\\n...</tt> */
 #define WAA__CONFLICT_EXT	"cflct"
+/** \anchor pbase Which text in the pristine store is the base.
+ * One line, with the MD5 as hex, the revision, the internal number of 
+ * the URL, and the mode, mtime, owner and group; see pristine.c. */
+#define WAA__PRISTINE_EXT	"pbase"
 /** @} */
 
 /** \anchor ino
@@ -200,7 +212,8 @@ extern struct waa__entry_blocks_t waa__entry_block;
 			max(max(strlen(WAA__DIR_EXT),                  \
 					strlen(WAA__FILE_MD5s_EXT)),               \
 				max(strlen(WAA__PROP_EXT),                   \
-					strlen(WAA__CONFLICT_EXT)) ),              \
+					max(strlen(WAA__CONFLICT_EXT),             \
+						strlen(WAA__PRISTINE_EXT))) ),           \
 			max(                                           \
 				max(strlen(WAA__FILE_INODE_EXT),             \
 					strlen(WAA__DIR_INODE_EXT)),               \
@@ -244,6 +257,10 @@ int waa__open_byext(const char *directory,
 		const char *extension,
 		int write,
 		int *fh);
+/** Returns the WAA path for the given entry and extension. */
+int waa__get_byext_path(const char *entry_name,
+		const char *extension,
+		char **path);
 /** Wrapper for \c waa__load_repos_urls_silent(). */
 int waa__load_repos_urls(char *dir, int reserve_space);
 /** Load the URLs associated with \a dir (or current working directory, if
@@ -258,6 +275,12 @@ int waa__make_info_file(char *directory, char *name, char *dest);
 int waa__delete_byext(char *path, 
 		char *extension,
 		int ignore_not_exist);
+/** Reads only the parts of the \ref dir file that are needed for the \a 
+ * argc paths in \a normalized. */
+int waa__input_subtrees(struct estat *root,
+		int argc, char *normalized[],
+		struct waa__entry_blocks_t **blocks,
+		action_t *callback);
 /** Reads the entry tree or, if none stored, builds one. */
 int waa__read_or_build_tree(struct estat *root, 
 		int argc, char *normalized[], char *orig[],
@@ -339,16 +362,172 @@ int waa__do_sorted_tree(struct estat *root, action_t handler);
 /** A wrapper around dir__enumerator(), ignoring entries below \c 
  * $FSVS_WAA.  */
 int waa__dir_enum(struct estat *this,
+		int dir_fd,
 		int est_count,
-		int by_name);
+		int by_name,
+		struct estat *known);
 
 /** Copies all sub-entries of \a src to \a dest. */
 int waa__copy_entries(struct estat *src, struct estat *dest);
 
 /** How many bytes the \ref dir file header has. */
 #define HEADER_LEN (64)
-/** Which version does the dir file have? */
-#define WAA_VERSION (6)
+/** \name Versions of the \ref dir file.
+ * The version is the first number in the header; both are read, the one 
+ * written is chosen via \ref o_dir_format.
+ * @{ */
+/** One text line per entry, see \c ops__dir_info_format_p. */
+#define WAA_VERSION_TEXT (6)
+/** An array of struct \ref waa__dir_record_t, the directory index (see 
+ * struct \ref waa__dir_index_t), the names, and a struct \ref 
+ * waa__dir_trailer_t. */
+#define WAA_VERSION_BINARY (7)
+/** The newest version. */
+#define WAA_VERSION WAA_VERSION_BINARY
+/** @} */
+
+/** Marker for the byte order of the binary \ref dir file. */
+#define WAA_BYTE_ORDER (0x01020304)
+
+/** One entry in the binary \ref dir file.
+ *
+ * The records are written in native byte order, directly after the 
+ * header; all fields are naturally aligned, so that the \c mmap()ed file 
+ * can be used without copying. Behind the last record the names are 
+ * stored, each \c \\0 -terminated.
+ *
+ * The fields hold the same data as the text format, plus the nanoseconds 
+ * of the timestamps; these get lost in a conversion to text. */
+struct waa__dir_record_t {
+	/** Size in bytes, or the device number for devices. */
+	uint64_t size;
+	/** Device and inode number. */
+	uint64_t dev, ino;
+	/** Change and modification time, in seconds. */
+	int64_t ctime, mtime;
+	/** The revision number. */
+	int64_t revision;
+	/** The unix mode, including the file type. */
+	uint32_t mode;
+	/** The flags, see \c RF___SAVE_MASK. */
+	uint32_t flags;
+	/** Owner and group. */
+	uint32_t uid, gid;
+	/** The \c internal_number of the URL, or \c 0. */
+	uint32_t url_intnum;
+	/** Index of the parent record, counted from \c 1; \c 0 for the root. */
+	uint32_t parent;
+	/** Number of children (directories only). */
+	uint32_t entry_count;
+	/** Offset of the name in the name area. */
+	uint32_t name_offset;
+	/** The nanoseconds of \c ctime and \c mtime. */
+	uint32_t ctime_nsec, mtime_nsec;
+	/** Whether the nanoseconds are known, see \c sstat_t::nsec_known. */
+	uint32_t nsec_known;
+	uint32_t padding;
+	/** MD5 (for all but directories). */
+	md5_digest_t md5;
+};
+
+/** One entry of the directory index in the binary \ref dir file.
+ *
+ * Behind the records there's an array of these, one for each directory 
+ * that has children, sorted by \c record; it is followed by an array of 
+ * \c uint32_t with the record indizes of the children, grouped by parent 
+ * and in the order of the records.
+ *
+ * That allows to find the children of a directory without looking at 
+ * the other records, so that only the needed parts of the tree have to be 
+ * loaded; see waa__input_subtrees(). */
+struct waa__dir_index_t {
+	/** Index of the directory record, counted from \c 1. */
+	uint32_t record;
+	/** Position of the first child in the children array. */
+	uint32_t first;
+};
+
+/** The end of the binary \ref dir file.
+ * Holds a checksum (see hlp__checksum()) over the records, the index and 
+ * the names, followed by the header. */
+struct waa__dir_trailer_t {
+	/** \c WAA_TRAILER_MAGIC. */
+	uint64_t magic;
+	/** The checksum. */
+	uint64_t sum_a, sum_b;
+};
+#define WAA_TRAILER_MAGIC (0x3130534b43454843ULL)
+
+
+/** \name Journal of the binary \ref dir file.
+ *
+ * The \ref dirlog file starts with a struct \ref waa__journal_head_t, 
+ * which names the \ref dir file it belongs to, and the format of the 
+ * entries; if that doesn't match, the journal is stale (eg. after a crash, 
+ * or written by another version) and ignored.
+ *
+ * Then any number of batches follow, one for each waa__output_tree() 
+ * call; each has a struct \ref waa__journal_batch_t, and \c count 
+ * entries. The batch header has a checksum of the entries, calculated 
+ * like the one in the \ref waa__dir_trailer_t "trailer" of the \ref dir 
+ * file; an incomplete or damaged batch at the end is ignored.
+ *
+ * The entries are keyed by their index in the \ref dir file (counted from 
+ * \c 1); added entries get indizes after the last used one. Each entry is 
+ * a struct \ref waa__journal_entry_t, followed by the name (with \c \\0), 
+ * padded to a multiple of 8 bytes.
+ * @{ */
+#define WAA_JOURNAL_MAGIC (0x4c4a5346)
+#define WAA_JOURNAL_BATCH (0x48544142)
+/** Operations in the journal. */
+enum waa__journal_op_e {
+	WAA_JOURNAL_ADD=1,
+	WAA_JOURNAL_CHANGE,
+	WAA_JOURNAL_REMOVE,
+};
+
+/** Header of the journal. */
+struct waa__journal_head_t {
+	/** \c WAA_JOURNAL_MAGIC and \c WAA_BYTE_ORDER. */
+	uint32_t magic, byte_order;
+	/** \c WAA_VERSION_BINARY, as the entries hold a struct \ref 
+	 * waa__dir_record_t, and the size of a struct \ref 
+	 * waa__journal_entry_t. */
+	uint32_t version, record_size;
+	/** Inode number, size and modification time of the \ref dir file. */
+	uint64_t base_ino, base_size;
+	int64_t base_mtime, base_mtime_nsec;
+};
+
+/** Start of a batch of changes. */
+struct waa__journal_batch_t {
+	/** \c WAA_JOURNAL_BATCH. */
+	uint32_t magic;
+	/** Number of entries. */
+	uint32_t count;
+	/** Number of bytes of the entries. */
+	uint64_t length;
+	/** The checksum of the entries, see hlp__checksum(). */
+	uint64_t sum_a, sum_b;
+};
+
+/** A single change. */
+struct waa__journal_entry_t {
+	/** A \ref waa__journal_op_e. */
+	uint32_t op;
+	/** The index of the entry. */
+	uint32_t index;
+	/** Length of the name, including the \c \\0; \c 0 for removals. */
+	uint32_t name_len;
+	uint32_t padding;
+	/** The new data; \c name_offset is not used. */
+	struct waa__dir_record_t rec;
+};
+
+/** Bytes needed for a journal entry with a name of \a name_len bytes. */
+#define WAA_JOURNAL_ENTRY_SIZE(name_len) \
+	((sizeof(struct waa__journal_entry_t) + (name_len) + 7) & ~7)
+/** @} */
 
 /** Copy URL revision number.
  * The problem on commit is that we send a number of entries to the 